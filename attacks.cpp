@@ -0,0 +1,132 @@
+#include <iostream>
+#include <string>
+#include <cstdlib>
+
+#include "attacks.h"
+#include "logging.h"
+#include "rng.h"
+
+using namespace std;
+
+
+InterceptResendAttack::InterceptResendAttack(Detector *det, Generator *gen) {
+	detector = det;
+	generator = gen;
+	name = "Intercept-Resend Attack";
+}
+void InterceptResendAttack::operator()(PulseBlock& block) {
+	for (int i = 0; i < block.size; ++i) {
+		TRACE_PULSE(block.first + i);
+		Pulse& pulse = block.pulses[i];
+		if (pulse.size() == 0) {
+			block.interceptions[i] = -1;
+			continue;
+		}
+		bool basisChoice = detector->chooseBasis();
+		int observation = detector->detectPulse(pulse, basisChoice);
+		pulse.release();
+		block.interceptions[i] = observation;
+		if (observation >= 0) {
+			generator->createPulse(pulse, observation == 1, basisChoice);
+		}
+	}
+}
+
+PhotonNumberSplittingAttack::PhotonNumberSplittingAttack(Detector *det, Generator *gen) {
+	detector = det;
+	generator = gen;
+	name = "Photon Number Splitting Attack";
+}
+void PhotonNumberSplittingAttack::operator()(PulseBlock& block) {
+	for (int i = 0; i < block.size; ++i) {
+		TRACE_PULSE(block.first + i);
+		Pulse& pulse = block.pulses[i];
+		if (pulse.size() == 0) {
+			block.interceptions[i] = -1;
+			continue;
+		}
+		// The split off photon comes from the last group
+		int last = pulse.groups()-1;
+		PulseView splitPhoton(pulse.data() + last, 1);
+		if (pulse.size() > 1) {
+			// Stored photon, measured once Alice has announced her basis
+			block.interceptions[i] = detector->detectPulse(splitPhoton, block.sourceBases[i] != 0);
+			pulse.setMultiplicity(last, pulse.multiplicity(last)-1);
+			pulse.compact();
+		} else {
+			TRACE("Intercepted Single qubit pulse, Eve constructing new pulse");
+			bool basisChoice = detector->chooseBasis();
+			int observation = detector->detectPulse(splitPhoton, basisChoice);
+			pulse.release();
+			block.interceptions[i] = observation;
+			if (observation >= 0) {
+				generator->createPulse(pulse, observation == 1, basisChoice);
+			}
+		}
+	}
+}
+
+BeamSplittingAttack::BeamSplittingAttack(Detector *det, double fraction) {
+	detector = det;
+	tapFraction = fraction;
+	name = to_string(tapFraction) + " Beam Splitting Attack";
+}
+BeamSplittingAttack::BeamSplittingAttack(Detector *det) {
+	detector = det;
+	cout << "Enter fraction(0-1) of photons diverted to Eve: ";
+	cin >> tapFraction;
+	name = to_string(tapFraction) + " Beam Splitting Attack";
+}
+void BeamSplittingAttack::operator()(PulseBlock& block) {
+	for (int i = 0; i < block.size; ++i) {
+		TRACE_PULSE(block.first + i);
+		Pulse& pulse = block.pulses[i];
+		// Reused by every pulse this thread splits
+		static thread_local Pulse diverted;
+		for (int g = 0; g < pulse.groups(); ++g) {
+			int tapped = rng().binomial(pulse.multiplicity(g), tapFraction);
+			if (tapped > 0) {
+				diverted.insert(pulse.group(g)->alpha, pulse.group(g)->beta, tapped);
+				pulse.setMultiplicity(g, pulse.multiplicity(g) - tapped);
+			}
+		}
+		pulse.compact();
+		block.interceptions[i] = (diverted.size() > 0) ? detector->detectPulse(diverted) : -1;
+		diverted.release();
+	}
+}
+
+UnambiguousStateDiscriminationAttack::UnambiguousStateDiscriminationAttack(Detector *det, Generator *gen) {
+	detector = det;
+	generator = gen;
+	name = "Unambiguous State Discrimination Attack";
+}
+void UnambiguousStateDiscriminationAttack::operator()(PulseBlock& block) {
+	for (int i = 0; i < block.size; ++i) {
+		TRACE_PULSE(block.first + i);
+		Pulse& pulse = block.pulses[i];
+		// bit (value + 2*basis) set once that state has been ruled out
+		int ruledOut = 0;
+		for (int g = 0; g < pulse.groups(); ++g) {
+			PulseView photon(pulse.data() + g, 1);
+			for (int j = 0; j < pulse.multiplicity(g); ++j) {
+				bool basisChoice = detector->chooseBasis();
+				int observation = detector->detectPulse(photon, basisChoice);
+				if (observation >= 0) {
+					ruledOut |= 1 << ((1-observation) + 2*basisChoice);
+				}
+			}
+		}
+		pulse.release();
+
+		block.interceptions[i] = -1;
+		for (int candidate = 0; candidate < 4; ++candidate) {
+			if (ruledOut == (0xF & ~(1 << candidate))) {
+				bool value = candidate & 1;
+				bool basisChoice = candidate >> 1;
+				block.interceptions[i] = value;
+				generator->createPulse(pulse, value, basisChoice);
+			}
+		}
+	}
+}
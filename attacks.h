@@ -0,0 +1,70 @@
+#ifndef _ATTACKS_H_
+#define _ATTACKS_H_
+
+#include <string>
+
+#include "constants.h"
+#include "quantum.h"
+#include "devices.h"
+
+using namespace std;
+
+// An eavesdropping stage that runs on a whole block between
+// Channel::propagateBlock and Detector::detectBlock. Eve may replace or
+// thin out block.pulses and records what she learned about each pulse in
+// block.interceptions (-1 when she learned nothing).
+class Attack {
+public:
+	string name;
+	virtual ~Attack(){};
+	virtual void operator()(PulseBlock& block){};
+};
+
+
+// Eve measures every pulse in a basis of her choosing and resends her
+// result in that basis.
+class InterceptResendAttack : public Attack {
+private:
+	Detector *detector;
+	Generator *generator;
+public:
+	InterceptResendAttack(Detector *det, Generator *gen);
+	void operator()(PulseBlock& block) override;
+};
+
+// Eve splits one photon off every multiphoton pulse and keeps it until the
+// bases are announced; single photon pulses are intercepted and resent.
+class PhotonNumberSplittingAttack : public Attack {
+private:
+	Detector *detector;
+	Generator *generator;
+public:
+	PhotonNumberSplittingAttack(Detector *det, Generator *gen);
+	void operator()(PulseBlock& block) override;
+};
+
+// Eve replaces the lossy line with a beam splitter that diverts a fraction
+// of the photons to her detector, which measures one of them.
+class BeamSplittingAttack : public Attack {
+private:
+	Detector *detector;
+	double tapFraction;
+public:
+	BeamSplittingAttack(Detector *det);
+	BeamSplittingAttack(Detector *det, double fraction);
+	void operator()(PulseBlock& block) override;
+};
+
+// Eve measures each photon of a pulse in a random basis; every outcome rules
+// out the state orthogonal to it. When three of the four BB84 states are
+// ruled out she knows the state and resends it, otherwise she blocks the pulse.
+class UnambiguousStateDiscriminationAttack : public Attack {
+private:
+	Detector *detector;
+	Generator *generator;
+public:
+	UnambiguousStateDiscriminationAttack(Detector *det, Generator *gen);
+	void operator()(PulseBlock& block) override;
+};
+
+#endif
@@ -0,0 +1,101 @@
+#include <iostream>
+#include <string>
+#include <cctype>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bitfile.h"
+
+using namespace std;
+
+
+BitFile::BitFile(string _path, bool _packed, int values) {
+	path = _path;
+	packed = _packed;
+	data = nullptr;
+	bytes = 0;
+	if (packed && values != 2) {
+		cout << "Packed file " << path << " can only hold two valued slots, not " << values << endl;
+		throw -1;
+	}
+	int fd = open(path.c_str(), O_RDONLY);
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info) != 0) {
+		cout << "Could not open " << path << endl;
+		if (fd >= 0)
+			close(fd);
+		throw -1;
+	}
+	bytes = info.st_size;
+	version = to_string(info.st_dev) + ":" + to_string(info.st_ino) + ":" + to_string(info.st_mtim.tv_sec) + "."
+			  + to_string(info.st_mtim.tv_nsec);
+	if (bytes > 0) {
+		void *mapped = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapped == MAP_FAILED) {
+			cout << "Could not map " << path << endl;
+			close(fd);
+			throw -1;
+		}
+		data = (const unsigned char*) mapped;
+		madvise(mapped, bytes, MADV_SEQUENTIAL);
+	}
+	close(fd);
+
+	if (packed) {
+		slots = (long long) bytes * 8;
+		return;
+	}
+	size_t end = bytes;
+	while (end > 0 && isspace(data[end-1]))
+		end--;
+	for (size_t i = 0; i < end; ++i) {
+		if (data[i] < '0' || data[i] >= '0' + values) {
+			cout << "Invalid value '" << data[i] << "' at " << i << " of " << path << endl;
+			throw -1;
+		}
+	}
+	slots = end;
+}
+BitFile::~BitFile() {
+	if (data != nullptr)
+		munmap((void*) data, bytes);
+}
+long long BitFile::length() const {
+	return slots;
+}
+void BitFile::read(long long first, int count, char *out) const {
+	if (!packed) {
+		const unsigned char *digits = data + first;
+		for (int i = 0; i < count; ++i)
+			out[i] = digits[i] - '0';
+		return;
+	}
+	// Blocks start on byte boundaries, the general case is kept for others
+	int i = 0;
+	for (; i < count && ((first + i) & 7) != 0; ++i)
+		out[i] = (data[(first + i) >> 3] >> ((first + i) & 7)) & 1;
+	const unsigned char *packedBytes = data + ((first + i) >> 3);
+	for (; i + 8 <= count; i += 8) {
+		unsigned char byte = *packedBytes++;
+		for (int bit = 0; bit < 8; ++bit)
+			out[i + bit] = (byte >> bit) & 1;
+	}
+	for (; i < count; ++i)
+		out[i] = (data[(first + i) >> 3] >> ((first + i) & 7)) & 1;
+}
+string BitFile::describe() const {
+	return string(packed ? "packed:" : "ascii:") + path + ":" + to_string(bytes) + ":" + version;
+}
+
+BitFile* openBitFile(string key, string spec, int values) {
+	size_t colon = spec.find(':');
+	string format = spec.substr(0, colon);
+	if (colon == string::npos || (format != "ascii" && format != "packed")) {
+		cout << "Expected ascii:path or packed:path for " << key << endl;
+		throw -1;
+	}
+	return new BitFile(spec.substr(colon + 1), format == "packed", values);
+}
@@ -0,0 +1,41 @@
+#ifndef _BITFILE_H_
+#define _BITFILE_H_
+
+#include <string>
+
+using namespace std;
+
+// Per-slot values (key bits or basis indices) recorded in a file, e.g. a
+// device's randomness, mapped with mmap and read a block at a time so
+// files far larger than memory stream straight into the simulation.
+//
+//	ascii   one digit '0'..'9' per slot, trailing whitespace ignored
+//	packed  one bit per slot, slot i in byte i/8 at bit i%8 (as PackedBits);
+//	        only for two valued slots
+//
+// ASCII files are checked once when opened: every digit has to be below
+// values.
+class BitFile {
+private:
+	string path;
+	bool packed;
+	const unsigned char *data;
+	size_t bytes;
+	long long slots;
+	// Device, inode and modification time when opened, so a new recording
+	// written to the same path does not look like the old one
+	string version;
+public:
+	BitFile(string _path, bool _packed, int values);
+	~BitFile();
+	long long length() const;
+	// Values of slots [first, first + count) into out, one per byte
+	void read(long long first, int count, char *out) const;
+	// "packed:path:bytes:version" (or ascii), for stage cache keys
+	string describe() const;
+};
+
+// "ascii:path" or "packed:path"; key names the setting in error messages
+BitFile* openBitFile(string key, string spec, int values);
+
+#endif
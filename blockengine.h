@@ -0,0 +1,89 @@
+#ifndef _BLOCKENGINE_H_
+#define _BLOCKENGINE_H_
+
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+#include "metrics.h"
+#include "rng.h"
+
+using namespace std;
+
+// Block engine behind runScenarios and runEntangled. Blocks [firstBlock,
+// lastBlock) are handed out in order to threads workers, block b with
+// stream jumped once per block before it, and their chunks are merged back
+// in block order. With the engine lock held:
+//
+//	dispatch(b, merged, scratch)	before block b is handed out, with merged
+//					the number of blocks merged so far: false
+//					to wait for more of them, otherwise takes
+//					what has to be taken in block order
+//	merge(b, chunk)			merges block b's chunk, true to stop the
+//					run after it
+//
+// and on each worker's own Scratch, without it:
+//
+//	simulate(b, stream, scratch, chunk)
+//
+// The caller's rng() is left as it was.
+template<typename Scratch, typename Chunk, typename Dispatch, typename Simulate, typename Merge>
+void runBlocks(Rng stream, long long firstBlock, long long lastBlock, int threads,
+			   Dispatch dispatch, Simulate simulate, Merge merge) {
+	mutex engineMutex;
+	condition_variable mergedMore;
+	long long nextBlock = firstBlock, stopAt = lastBlock, merged = firstBlock;
+	map<long long, Chunk> pending;
+
+	auto worker = [&]() {
+		Scratch scratch;
+		while (true) {
+			long long blockIndex;
+			Rng blockStream;
+			{
+				unique_lock<mutex> lock(engineMutex);
+				mergedMore.wait(lock, [&]() {
+					return nextBlock >= stopAt || dispatch(nextBlock, merged, scratch);
+				});
+				if (nextBlock >= stopAt)
+					break;
+				blockIndex = nextBlock++;
+				blockStream = stream;
+				stream.jump();
+			}
+
+			Chunk chunk;
+			simulate(blockIndex, blockStream, scratch, chunk);
+
+			lock_guard<mutex> lock(engineMutex);
+			// Past a block the run stopped at
+			if (blockIndex >= stopAt)
+				continue;
+			swap(pending[blockIndex], chunk);
+			while (merged < stopAt && pending.count(merged)) {
+				bool stop = merge(merged, pending[merged]);
+				pending.erase(merged);
+				merged++;
+				if (stop)
+					stopAt = merged;
+			}
+			mergedMore.notify_all();
+		}
+	};
+
+	METRICS_RESET();
+	Rng savedStream = rng();
+	vector<thread> pool;
+	for (int t = 1; t < threads; ++t) {
+		pool.push_back(thread(worker));
+	}
+	worker();
+	for (auto& t : pool) {
+		t.join();
+	}
+	rng() = savedStream;
+}
+
+#endif
@@ -0,0 +1,82 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "classical.h"
+#include "config.h"
+
+using namespace std;
+
+
+ClassicalChannel::ClassicalChannel(double _latency, double _bandwidth, int _tagBits) {
+	latency = _latency;
+	bandwidth = _bandwidth;
+	tagBits = _tagBits;
+	for (auto& stage : counters) {
+		stage.messages = 0;
+		stage.bytes = 0;
+		stage.hops = 0;
+	}
+}
+void ClassicalChannel::send(ClassicalStage stage, long long bytes) {
+	lock_guard<mutex> guard(lock);
+	counters[stage].messages++;
+	counters[stage].bytes += bytes;
+	counters[stage].hops++;
+}
+void ClassicalChannel::exchange(ClassicalStage stage, long long requestBytes, long long replyBytes) {
+	lock_guard<mutex> guard(lock);
+	counters[stage].messages += 2;
+	counters[stage].bytes += requestBytes + replyBytes;
+	counters[stage].hops += 2;
+}
+long long ClassicalChannel::messages() const {
+	lock_guard<mutex> guard(lock);
+	long long total = 0;
+	for (auto& stage : counters)
+		total += stage.messages;
+	return total;
+}
+long long ClassicalChannel::authenticationBits() const {
+	return messages() * tagBits;
+}
+void ClassicalChannel::printReport(long long finalBits) const {
+	const char *names[] = {"sifting", "estimation", "reconciliation", "verification", "amplification"};
+	lock_guard<mutex> guard(lock);
+	cout << "Classical channel (latency " << latency << " s, " << bandwidth << " bytes/s, " << tagBits
+		 << "-bit tags):" << endl;
+	long long messages = 0;
+	for (int s = 0; s < CLASSICAL_STAGES; ++s) {
+		const Counters& stage = counters[s];
+		messages += stage.messages;
+		if (stage.messages == 0)
+			continue;
+		double waiting = stage.hops * latency, transmitting = stage.bytes / bandwidth;
+		cout << "\t" << names[s] << ": " << stage.messages << " messages, " << stage.bytes << " bytes, "
+			 << stage.hops / 2.0 << " round trips; " << waiting << " s latency, " << transmitting
+			 << " s transmission, " << (waiting > transmitting ? "round trip" : "bandwidth") << " bound" << endl;
+	}
+	long long authentication = messages * tagBits;
+	cout << "\tAuthentication key: " << authentication << " bits";
+	if (finalBits > 0)
+		cout << " (" << 100.0 * authentication / (finalBits + authentication)
+			 << "% of the key before authentication, " << finalBits << " bits net)";
+	cout << endl;
+}
+
+ClassicalChannel* buildClassicalChannel(string key, string spec) {
+	vector<string> parts;
+	stringstream stream(spec);
+	string part;
+	while (getline(stream, part, ':'))
+		parts.push_back(part);
+	if (parts.size() == 1 && parts[0] == "none")
+		return nullptr;
+	if (parts.size() != 4 || parts[0] != "link") {
+		cout << "Expected none or link:latency:bandwidth:tag_bits for " << key << endl;
+		throw -1;
+	}
+	return new ClassicalChannel(parseNumber(key, parts[1]), parseNumber(key, parts[2]),
+								(int) parseInteger(key, parts[3]));
+}
@@ -0,0 +1,57 @@
+#ifndef _CLASSICAL_H_
+#define _CLASSICAL_H_
+
+#include <string>
+#include <mutex>
+
+using namespace std;
+
+enum ClassicalStage {
+	CLASSICAL_SIFTING,
+	CLASSICAL_ESTIMATION,
+	CLASSICAL_RECONCILIATION,
+	CLASSICAL_VERIFICATION,
+	CLASSICAL_AMPLIFICATION,
+	CLASSICAL_STAGES
+};
+
+// Authenticated public channel between Alice and Bob, kept in process as
+// counters: nothing is actually sent, each protocol stage reports the
+// messages it would exchange. A message of b bytes costs latency seconds
+// to arrive plus b / bandwidth to transmit, and its Wegman-Carter tag
+// uses tagBits of secret key (the hash key is reused, the tag is one time
+// padded). Hops are messages that have to wait for the previous one, so
+// hops * latency is what a stage spends on round trips and is what
+// batching more per message reduces.
+class ClassicalChannel {
+private:
+	struct Counters {
+		long long messages;
+		long long bytes;
+		long long hops;
+	};
+	mutable mutex lock;
+	Counters counters[CLASSICAL_STAGES];
+public:
+	double latency;
+	double bandwidth;
+	int tagBits;
+
+	ClassicalChannel(double _latency, double _bandwidth, int _tagBits);
+	// One message one way
+	void send(ClassicalStage stage, long long bytes);
+	// A request and the reply to it
+	void exchange(ClassicalStage stage, long long requestBytes, long long replyBytes);
+	long long messages() const;
+	long long authenticationBits() const;
+	// Per stage counts, time spent on latency and on bandwidth and which
+	// one bounds it; finalBits is the key the run distilled with the tags
+	// already paid from it (0 if unknown)
+	void printReport(long long finalBits) const;
+};
+
+// "none" (nullptr) or link:latency:bandwidth:tagBits, latency in seconds
+// and bandwidth in bytes per second
+ClassicalChannel* buildClassicalChannel(string key, string spec);
+
+#endif
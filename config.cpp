@@ -0,0 +1,375 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <stdexcept>
+
+#include "config.h"
+
+using namespace std;
+
+
+static string trim(string s) {
+	size_t start = s.find_first_not_of(" \t\r\n");
+	size_t end = s.find_last_not_of(" \t\r\n");
+	return (start == string::npos) ? "" : s.substr(start, end - start + 1);
+}
+// "name:arg1:arg2" -> {"name", "arg1", "arg2"}
+static vector<string> splitSpec(string spec) {
+	vector<string> parts;
+	stringstream stream(spec);
+	string part;
+	while (getline(stream, part, ':')) {
+		parts.push_back(trim(part));
+	}
+	if (parts.empty())
+		parts.push_back("");
+	return parts;
+}
+template<typename T, typename Convert>
+static T parse(string key, string value, Convert convert) {
+	size_t used = 0;
+	T parsed = 0;
+	try {
+		parsed = convert(value, &used);
+	} catch (const logic_error&) {
+		used = 0;
+	}
+	if (used == 0 || !trim(value.substr(used)).empty()) {
+		cout << "Expected a number for " << key << endl;
+		throw -1;
+	}
+	return parsed;
+}
+double parseNumber(string key, string value) {
+	return parse<double>(key, value, [](const string& text, size_t *used) { return stod(text, used); });
+}
+long long parseInteger(string key, string value) {
+	return parse<long long>(key, value, [](const string& text, size_t *used) { return stoll(text, used); });
+}
+uint64_t parseUnsigned(string key, string value) {
+	return parse<uint64_t>(key, value, [](const string& text, size_t *used) { return stoull(text, used); });
+}
+static double argument(const vector<string>& spec, size_t index, string key) {
+	if (spec.size() <= index) {
+		cout << "Missing parameter " << index << " for " << key << endl;
+		throw -1;
+	}
+	return parseNumber(key, spec[index]);
+}
+static void unknown(string key, string value) {
+	cout << "Unknown value '" << value << "' for " << key << endl;
+	throw -1;
+}
+// Hands object to owner, when there is one
+template<typename T>
+static T* keep(BuiltObjects *owner, T *object) {
+	return (owner != nullptr) ? owner->own(object) : object;
+}
+
+
+SimulationConfig::SimulationConfig() {
+	values["generator.pulses"] = "ideal";
+	values["generator.bases"] = "ideal";
+	values["generator.deviation"] = "ideal";
+	values["channel.absorption"] = "ideal";
+	values["channel.deviation"] = "ideal";
+	values["channel.noise"] = "none";
+	values["channel.analytic"] = "0";
+	values["channel.drift"] = "none";
+	values["detector.darkcount"] = "0";
+	values["detector.dark_probability"] = "0";
+	values["detector.efficiency"] = "ideal";
+	values["detector.bases"] = "ideal";
+	values["detector.deviation"] = "ideal";
+	values["alice.channel.absorption"] = "ideal";
+	values["alice.channel.deviation"] = "ideal";
+	values["alice.channel.noise"] = "none";
+	values["alice.channel.analytic"] = "0";
+	values["alice.channel.drift"] = "none";
+	values["alice.detector.darkcount"] = "0";
+	values["alice.detector.efficiency"] = "ideal";
+	values["alice.detector.bases"] = "ideal";
+	values["alice.detector.deviation"] = "ideal";
+	values["protocol"] = "bb84";
+	values["source.state"] = "phi+";
+	values["attack"] = "none";
+	values["pulses"] = "1000";
+	values["input.bits"] = "auto";
+	values["input.source_bases"] = "auto";
+	values["input.detector_bases"] = "auto";
+	values["seed"] = "1";
+	values["threads"] = "1";
+	values["outcome_bias"] = "0";
+	values["target_width"] = "0";
+	values["confidence"] = "0.95";
+	values["cache"] = "";
+	values["postprocess.block_bits"] = "0";
+	values["postprocess.in_flight"] = "4";
+	values["postprocess.sample"] = "0.1";
+	values["postprocess.epsilon"] = "1e-10";
+	values["classical"] = "none";
+	values["curve.distances"] = "0:200:10";
+	values["curve.check"] = "";
+	values["curve.attenuation"] = "0.2";
+	values["curve.efficiency"] = "0.1";
+	values["curve.dark_probability"] = "1e-5";
+	values["curve.misalignment"] = "0.01";
+	values["curve.error_correction"] = "1.16";
+	values["curve.decoy"] = "0.5:0.1:0.8:0.1";
+	values["curve.finite_pulses"] = "1e10";
+	values["curve.sigmas"] = "5";
+}
+SimulationConfig::SimulationConfig(string path) : SimulationConfig() {
+	ifstream file(path);
+	if (!file) {
+		cout << "Could not open config file " << path << endl;
+		throw -1;
+	}
+	string line;
+	while (getline(file, line)) {
+		line = trim(line.substr(0, line.find('#')));
+		if (line.empty())
+			continue;
+		size_t equals = line.find('=');
+		if (equals == string::npos) {
+			cout << "Expected key = value in config line: " << line << endl;
+			throw -1;
+		}
+		set(trim(line.substr(0, equals)), trim(line.substr(equals+1)));
+	}
+}
+void SimulationConfig::set(string key, string value) {
+	if (values.count(key) == 0) {
+		cout << "Unknown config key " << key << endl;
+		throw -1;
+	}
+	values[key] = value;
+}
+string SimulationConfig::get(string key) const {
+	return values.at(key);
+}
+double SimulationConfig::number(string key) const {
+	return parseNumber(key, get(key));
+}
+long long SimulationConfig::integer(string key) const {
+	return parseInteger(key, get(key));
+}
+string SimulationConfig::describe() const {
+	string description;
+	for (auto& entry : values) {
+		description += entry.first + "=" + entry.second + ";";
+	}
+	return description;
+}
+string SimulationConfig::describe(const vector<string>& prefixes) const {
+	string description;
+	for (auto& entry : values) {
+		for (auto& prefix : prefixes) {
+			if (entry.first.compare(0, prefix.size(), prefix) == 0) {
+				description += entry.first + "=" + entry.second + ";";
+				break;
+			}
+		}
+	}
+	return description;
+}
+
+static IntFactory* buildPulseNumberFactory(string key, string value, BuiltObjects *owner) {
+	auto spec = splitSpec(value);
+	if (spec[0] == "ideal")
+		return keep(owner, new IdealPulseNumberFactory());
+	if (spec[0] == "poisson")
+		return keep(owner, new PoissonPulseNumberFactory((int) argument(spec, 1, key)));
+	if (spec[0] == "importance")
+		return keep(owner, new ImportancePoissonPulseNumberFactory(argument(spec, 1, key),
+																   argument(spec, 2, key)));
+	if (spec[0] == "decoy")
+		return keep(owner, new DecoyPulseNumberFactory(argument(spec, 1, key), argument(spec, 2, key),
+													   argument(spec, 3, key), argument(spec, 4, key)));
+	unknown(key, value);
+	return nullptr;
+}
+static BoolFactory* buildBasisChoiceFactory(string key, string value, BuiltObjects *owner) {
+	auto spec = splitSpec(value);
+	if (spec[0] == "ideal")
+		return keep(owner, new IdealBasisChoiceFactory());
+	if (spec[0] == "zeroone")
+		return keep(owner, new AlwaysZeroOneBasisChoiceFactory());
+	if (spec[0] == "biased")
+		return keep(owner, new BiasedBasisChoiceFactory(argument(spec, 1, key)));
+	unknown(key, value);
+	return nullptr;
+}
+static StateTransformer* buildStateDeviationTransformer(string key, string value, BuiltObjects *owner) {
+	auto spec = splitSpec(value);
+	if (spec[0] == "ideal")
+		return keep(owner, new IdealStateDeviationTransformer());
+	if (spec[0] == "uniform")
+		return keep(owner, new UniformRadianStateDeviationTransformer(argument(spec, 1, key)));
+	unknown(key, value);
+	return nullptr;
+}
+static BoolFactory* buildAbsorptionRateFactory(string key, string value, BuiltObjects *owner) {
+	auto spec = splitSpec(value);
+	if (spec[0] == "ideal")
+		return keep(owner, new IdealAbsorptionRateFactory());
+	if (spec[0] == "percent")
+		return keep(owner, new PercentAbsorptionRateFactory(argument(spec, 1, key)));
+	unknown(key, value);
+	return nullptr;
+}
+static NoiseModel* buildNoiseModel(string key, string value, BuiltObjects *owner) {
+	auto spec = splitSpec(value);
+	if (spec[0] == "none")
+		return nullptr;
+	if (spec[0] == "depolarizing")
+		return keep(owner, new DepolarizingNoiseModel(argument(spec, 1, key)));
+	if (spec[0] == "dephasing")
+		return keep(owner, new DephasingNoiseModel(argument(spec, 1, key)));
+	if (spec[0] == "damping")
+		return keep(owner, new AmplitudeDampingNoiseModel(argument(spec, 1, key)));
+	if (spec[0] == "rotation")
+		return keep(owner, new RotationNoiseModel(argument(spec, 1, key)));
+	unknown(key, value);
+	return nullptr;
+}
+static BoolFactory* buildQuantumEfficiencyFactory(string key, string value, BuiltObjects *owner) {
+	auto spec = splitSpec(value);
+	if (spec[0] == "ideal")
+		return keep(owner, new IdealQuantumEfficiencyFactory());
+	unknown(key, value);
+	return nullptr;
+}
+static BasisTransformer* buildBasisDeviationTransformer(string key, string value, BuiltObjects *owner) {
+	auto spec = splitSpec(value);
+	if (spec[0] == "ideal")
+		return keep(owner, new IdealBasisDeviationTransformer());
+	if (spec[0] == "fixed")
+		return keep(owner, new FixedMisalignmentBasisTransformer(argument(spec, 1, key)));
+	if (spec[0] == "gaussian")
+		return keep(owner, new GaussianMisalignmentBasisTransformer(argument(spec, 1, key)));
+	if (spec[0] == "drift")
+		return keep(owner, new DriftMisalignmentBasisTransformer(argument(spec, 1, key),
+																 argument(spec, 2, key)));
+	unknown(key, value);
+	return nullptr;
+}
+// walk:sigma drifts freely, walk:sigma:gain:window:delay is compensated
+static PolarizationDrift* buildPolarizationDrift(string key, string value, BuiltObjects *owner) {
+	auto spec = splitSpec(value);
+	if (spec[0] == "none")
+		return nullptr;
+	if (spec[0] == "walk" && spec.size() <= 2)
+		return keep(owner, new PolarizationDrift(argument(spec, 1, key)));
+	if (spec[0] == "walk")
+		return keep(owner, new PolarizationDrift(argument(spec, 1, key), argument(spec, 2, key),
+												 (int) argument(spec, 3, key), (int) argument(spec, 4, key)));
+	unknown(key, value);
+	return nullptr;
+}
+
+Generator* SimulationConfig::buildGenerator(BuiltObjects *owner) const {
+	auto pulses = buildPulseNumberFactory("generator.pulses", get("generator.pulses"), owner);
+	auto bases = buildBasisChoiceFactory("generator.bases", get("generator.bases"), owner);
+	auto deviation = buildStateDeviationTransformer("generator.deviation", get("generator.deviation"), owner);
+	return keep(owner, new Generator(pulses, bases, deviation));
+}
+Channel* SimulationConfig::buildChannel(BuiltObjects *owner) const {
+	return buildChannel("", owner);
+}
+Detector* SimulationConfig::buildDetector(BuiltObjects *owner) const {
+	return buildDetector("", owner);
+}
+Channel* SimulationConfig::buildChannel(string prefix, BuiltObjects *owner) const {
+	string key = prefix + "channel.";
+	auto absorption = buildAbsorptionRateFactory(key + "absorption", get(key + "absorption"), owner);
+	auto deviation = buildStateDeviationTransformer(key + "deviation", get(key + "deviation"), owner);
+	auto noise = buildNoiseModel(key + "noise", get(key + "noise"), owner);
+	auto channel = keep(owner, new Channel(absorption, deviation, noise, integer(key + "analytic") != 0));
+	channel->setDrift(buildPolarizationDrift(key + "drift", get(key + "drift"), owner));
+	return channel;
+}
+Detector* SimulationConfig::buildDetector(string prefix, BuiltObjects *owner) const {
+	string key = prefix + "detector.";
+	auto efficiency = buildQuantumEfficiencyFactory(key + "efficiency", get(key + "efficiency"), owner);
+	auto bases = buildBasisChoiceFactory(key + "bases", get(key + "bases"), owner);
+	auto deviation = buildBasisDeviationTransformer(key + "deviation", get(key + "deviation"), owner);
+	auto detector = keep(owner, new Detector((int) integer(key + "darkcount"), efficiency, bases, deviation));
+	// Dark counts are simulated for prepare and measure runs only
+	if (prefix.empty())
+		detector->setDarkCountProbability(number("detector.dark_probability"));
+	return detector;
+}
+Attack* SimulationConfig::buildAttack(BuiltObjects *owner) const {
+	auto spec = splitSpec(get("attack"));
+	if (spec[0] == "none")
+		return nullptr;
+	// Eve measures and resends in Z/X and compares her outcome with Alice's
+	// bit, which only means something for BB84 states
+	if (get("protocol") != "bb84") {
+		cout << "Attacks are only modelled for protocol = bb84, not " << get("protocol") << endl;
+		throw -1;
+	}
+	auto eveDetector = keep(owner, new Detector(0, keep(owner, new IdealQuantumEfficiencyFactory()),
+												keep(owner, new IdealBasisChoiceFactory()),
+												keep(owner, new IdealBasisDeviationTransformer())));
+	auto eveGenerator = keep(owner, new Generator(keep(owner, new IdealPulseNumberFactory()),
+												  keep(owner, new IdealBasisChoiceFactory()),
+												  keep(owner, new IdealStateDeviationTransformer())));
+	if (spec[0] == "pns")
+		return keep(owner, new PhotonNumberSplittingAttack(eveDetector, eveGenerator));
+	if (spec[0] == "intercept")
+		return keep(owner, new InterceptResendAttack(eveDetector, eveGenerator));
+	if (spec[0] == "beamsplit")
+		return keep(owner, new BeamSplittingAttack(eveDetector, argument(spec, 1, "attack")));
+	if (spec[0] == "usd")
+		return keep(owner, new UnambiguousStateDiscriminationAttack(eveDetector, eveGenerator));
+	unknown("attack", get("attack"));
+	return nullptr;
+}
+SimulationInput SimulationConfig::buildInput(BuiltObjects *owner) const {
+	SimulationInput input;
+	input.bits = "auto";
+	// Entangled protocols are run by runEntangledProtocol
+	if (findProtocol(get("protocol")) != nullptr)
+		input.protocol = findProtocol(get("protocol"));
+	input.length = integer("pulses");
+	if (get("input.bits") != "auto")
+		input.bitsFile = keep(owner, openBitFile("input.bits", get("input.bits"), 2));
+	if (get("input.source_bases") != "auto")
+		input.sourceBasesFile = keep(owner, openBitFile("input.source_bases", get("input.source_bases"),
+														input.protocol->sourceBases()));
+	if (get("input.detector_bases") != "auto")
+		input.detectorBasesFile = keep(owner, openBitFile("input.detector_bases", get("input.detector_bases"),
+														  input.protocol->bases.size()));
+	for (BitFile *file : {input.sourceBasesFile, input.detectorBasesFile}) {
+		if (file != nullptr && file->length() < input.pulses()) {
+			cout << "Basis choice file " << file->describe() << " is shorter than the run" << endl;
+			throw -1;
+		}
+	}
+	input.seed = parseUnsigned("seed", get("seed"));
+	input.threads = (int) integer("threads");
+	input.outcomeBias = number("outcome_bias");
+	input.targetWidth = number("target_width");
+	input.confidence = number("confidence");
+	input.classicalChannel = keep(owner, buildClassicalChannel("classical", get("classical")));
+	if (!get("cache").empty()) {
+		input.stageCache = keep(owner, new StageCache(get("cache")));
+		input.upstream = describe({"generator.", "channel."});
+	}
+	return input;
+}
+PostProcessor* SimulationConfig::buildPostProcessor(const SimulationInput& input) const {
+	long long blockBits = integer("postprocess.block_bits");
+	if (blockBits <= 0)
+		return nullptr;
+	int inFlight = (int) integer("postprocess.in_flight");
+	// Shards of one run cut different key blocks
+	uint64_t state = input.seed + (uint64_t) input.firstBlock;
+	return new PostProcessor(blockBits, inFlight, number("postprocess.sample"), number("postprocess.epsilon"),
+							 input.confidence, splitmix64(state), inFlight, input.classicalChannel);
+}
@@ -0,0 +1,109 @@
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+#include <string>
+#include <map>
+#include <vector>
+#include <memory>
+
+#include "devices.h"
+#include "attacks.h"
+#include "simulation.h"
+
+using namespace std;
+
+// Non-interactive description of a run, read from "key = value" lines
+// ('#' starts a comment). Device values name a factory/transformer and
+// its parameters separated by ':', e.g.
+//
+//	generator.pulses     = poisson:3
+//	channel.absorption   = percent:20
+//	channel.noise        = depolarizing:0.05
+//	detector.deviation   = drift:0.1:1000000
+//	channel.drift        = walk:0.01:0.5:4:2
+//	attack               = beamsplit:0.5
+//	pulses               = 1000000
+//
+// Eve, when there is an attack, uses an ideal generator and detector.
+//
+// cache names a directory for the stage cache (see stagecache.h): runs
+// with the same generator.*, channel.*, protocol, pulses and seed reuse
+// the propagated pulses and only re-run the attack and detector.
+//
+// protocol picks a prepare and measure protocol (bb84, sixstate, b92,
+// sarg04; see protocol.h), or bbm92 or e91 runs an entangled protocol
+// (see entanglement.h): generator.pulses then counts pairs per slot,
+// source.state picks the Bell state, channel.* and detector.* are Bob's
+// arm and alice.channel.* and alice.detector.* are Alice's.
+//
+// input.bits, input.source_bases and input.detector_bases = ascii:path or
+// packed:path replay recorded values instead of drawing them (see
+// bitfile.h); a bits file sets the number of pulses.
+//
+// postprocess.block_bits > 0 runs sifted key through estimation,
+// reconciliation and privacy amplification while the run goes on (see
+// postprocessing.h); shard runs print its report.
+//
+// classical = link:latency:bandwidth:tag_bits counts what sifting and
+// post-processing send over the authenticated classical channel (see
+// classical.h); shard runs print the report.
+//
+// detector.dark_probability is the chance of a dark click in a slot where
+// no photon is detected. curve.* describe a fiber link for key rate curves
+// (see keyrate.h).
+// value as a number, all of it; anything else prints "Expected a number
+// for key" and throws -1
+double parseNumber(string key, string value);
+long long parseInteger(string key, string value);
+uint64_t parseUnsigned(string key, string value);
+
+// Owns what the build* calls below allocate when given to them, and frees
+// all of it with itself. The devices do not own their factories and
+// transformers, nor attacks Eve's devices, and those base classes have no
+// virtual destructors, so every object is deleted as the type it was built
+// as.
+class BuiltObjects {
+private:
+	vector<shared_ptr<void> > objects;
+public:
+	template<typename T>
+	T* own(T *object) {
+		if (object != nullptr)
+			objects.push_back(shared_ptr<void>(object));
+		return object;
+	}
+};
+
+struct SimulationConfig {
+	map<string, string> values;
+
+	SimulationConfig();
+	SimulationConfig(string path);
+	void set(string key, string value);
+	string get(string key) const;
+	// The value as a number (see parseNumber)
+	double number(string key) const;
+	long long integer(string key) const;
+	// Canonical "key=value;" listing of every setting, in key order
+	string describe() const;
+	// Same, restricted to keys starting with one of the prefixes
+	string describe(const vector<string>& prefixes) const;
+
+	// With an owner, everything built is handed to it (see BuiltObjects);
+	// without one it is the caller's and is typically never freed
+	Generator* buildGenerator(BuiltObjects *owner = nullptr) const;
+	Channel* buildChannel(BuiltObjects *owner = nullptr) const;
+	Detector* buildDetector(BuiltObjects *owner = nullptr) const;
+	// Devices under prefix, e.g. "alice." for Alice's arm of an entangled
+	// protocol ("alice.channel.noise", ...)
+	Channel* buildChannel(string prefix, BuiltObjects *owner = nullptr) const;
+	Detector* buildDetector(string prefix, BuiltObjects *owner = nullptr) const;
+	// nullptr for attack = none; attacks need protocol = bb84
+	Attack* buildAttack(BuiltObjects *owner = nullptr) const;
+	// Its classical channel, stage cache and bit files go to owner too
+	SimulationInput buildInput(BuiltObjects *owner = nullptr) const;
+	// From postprocess.*, nullptr when postprocess.block_bits is 0
+	PostProcessor* buildPostProcessor(const SimulationInput& input) const;
+};
+
+#endif
@@ -3,9 +3,12 @@
 
 #include "constants.h"
 
-bool DEBUGPRINT = false;
-
 state PLUS  = make_pair(amplitude(1/root2), amplitude(1/root2));
 state MINUS = make_pair(amplitude(1/root2), amplitude(-1/root2));
 state ONE   = make_pair(amplitude(0), amplitude(1)); 
-state ZERO  = make_pair(amplitude(1), amplitude(0));
\ No newline at end of file
+state ZERO  = make_pair(amplitude(1), amplitude(0));
+
+pairState PHI_PLUS  = {{amplitude(1/root2), amplitude(0), amplitude(0), amplitude(1/root2)}};
+pairState PHI_MINUS = {{amplitude(1/root2), amplitude(0), amplitude(0), amplitude(-1/root2)}};
+pairState PSI_PLUS  = {{amplitude(0), amplitude(1/root2), amplitude(1/root2), amplitude(0)}};
+pairState PSI_MINUS = {{amplitude(0), amplitude(1/root2), amplitude(-1/root2), amplitude(0)}};
\ No newline at end of file
@@ -2,21 +2,27 @@
 #define _CONSTANTS_H_
 
 #include <complex>
+#include <array>
 
 using namespace std;
 
 #define eps (0.0001)
 #define root2 (sqrt(2))
 
-extern bool DEBUGPRINT;
-
 typedef complex<double> amplitude;
 typedef pair<amplitude, amplitude> state;
 typedef pair<state, state> basis;
+// Two-qubit state, amplitudes of |00>, |01>, |10>, |11> with Alice's qubit
+// first
+typedef array<amplitude, 4> pairState;
 
 extern state PLUS;
 extern state MINUS;
 extern state ONE;
 extern state ZERO;
+extern pairState PHI_PLUS;
+extern pairState PHI_MINUS;
+extern pairState PSI_PLUS;
+extern pairState PSI_MINUS;
 
 #endif
\ No newline at end of file
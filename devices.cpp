@@ -2,89 +2,327 @@
 #include <complex>
 #include <algorithm>
 #include <iostream>
+#include <cmath>
 
 #include "devices.h"
+#include "metrics.h"
+#include "logging.h"
+#include "rng.h"
+#include "packedbits.h"
 
 using namespace std;
 
 
+PulseBlock::PulseBlock() {
+	first = 0;
+	size = 0;
+	mixed = false;
+	protocol = &bb84Protocol();
+	outcomeBias = 0;
+	pristine = false;
+}
+void PulseBlock::reset(long long firstPulse, int count) {
+	first = firstPulse;
+	size = count;
+	mixed = false;
+	bits.resize(count);
+	sourceBases.resize(count);
+	announcements.assign(count, 0);
+	detectorBases.resize(count);
+	pulses.resize(count);
+	mixedStates.resize(count);
+	detections.assign(count, -1);
+	interceptions.assign(count, -1);
+	photons.assign(count, 0);
+	weights.assign(count, 1.0);
+	intensityClasses.assign(count, 0);
+	channelRotation = 0;
+}
+void PulseBlock::copySource(const PulseBlock& source) {
+	reset(source.first, source.size);
+	protocol = source.protocol;
+	bits = source.bits;
+	sourceBases = source.sourceBases;
+	announcements = source.announcements;
+	pristine = source.pristine;
+	photons = source.photons;
+	weights = source.weights;
+	intensityClasses = source.intensityClasses;
+	outcomeBias = source.outcomeBias;
+	for (int i = 0; i < size; ++i) {
+		pulses[i].copyFrom(source.pulses[i]);
+	}
+}
+void PulseBlock::release() {
+	for (auto& pulse : pulses) {
+		pulse.release();
+	}
+}
+
+
 Generator::Generator(IntFactory *png, BoolFactory *bcg, StateTransformer *sdg) {
 	pulseNumberFactory = png;
 	basisChoiceFactory = bcg;
 	stateDeviationTransformer = sdg;
 }
-Pulse Generator::createPulse(amplitude a, amplitude b) {
-	int pulseSize = pulseNumberFactory->operator()();
-	vector<Qubit*> qubits;
+void Generator::createPulse(Pulse& pulse, amplitude a, amplitude b) {
+	createPulse(pulse, a, b, pulseNumberFactory->operator()());
+}
+void Generator::createPulse(Pulse& pulse, amplitude a, amplitude b, int pulseSize) {
+	METRIC_STAGE_TIMER(METRIC_STAGE_GENERATE);
+	METRIC_INC(METRIC_PULSES_GENERATED);
+	METRIC_PHOTONS(pulseSize);
+	if (pulseSize > 1) {
+		METRIC_INC(METRIC_MULTIPHOTON_PULSES);
+	}
+	pulse.release();
+	if (stateDeviationTransformer->isIdentity()) {
+		if (pulseSize > 0)
+			pulse.insert(a, b, pulseSize);
+		return;
+	}
 	for (int i = 0; i < pulseSize; ++i)
 	{
 		state deviatedState = stateDeviationTransformer->operator()(make_pair(a,b));
-		amplitude zero_amp  = deviatedState.first;
-		amplitude one_amp   = deviatedState.second; 
-		qubits.push_back(new Qubit(zero_amp, one_amp));
+		pulse.insert(deviatedState.first, deviatedState.second);
 	}
-	return Pulse(qubits);
-}
-Pulse Generator::createPulse(state s) {
-	return createPulse(s.first, s.second);
 }
-Pulse Generator::createPulse(bool value, bool basisChoice) {
+void Generator::createPulse(Pulse& pulse, bool value, bool basisChoice) {
+	state s;
 	if (basisChoice == false) {
-		return value? createPulse(ONE):createPulse(ZERO);
+		s = value? ONE:ZERO;
 	} else {
-		return value? createPulse(MINUS):createPulse(PLUS);
+		s = value? MINUS:PLUS;
 	}
+	createPulse(pulse, s.first, s.second);
 }
-Pulse Generator::createPulse(bool value) {
-	bool basisChoice = basisChoiceFactory->operator()();
-	return createPulse(value, basisChoice);
+bool Generator::chooseBasis() {
+	return basisChoiceFactory->operator()();
+}
+int Generator::chooseBasis(const Protocol& protocol) {
+	int bases = protocol.sourceBases();
+	if (bases == 2)
+		return basisChoiceFactory->operator()();
+	return (bases == 1) ? 0 : rng().below(bases);
+}
+// Shared by generator and detector: two bases come from the factory's
+// packed words, others uniformly
+static void chooseBases(BoolFactory *basisChoiceFactory, int choices, char *bases, int count) {
+	if (choices == 2) {
+		static thread_local vector<uint64_t> words;
+		words.resize((count + 63) / 64);
+		basisChoiceFactory->fill(words.data(), count);
+		unpackBits(words.data(), bases, count);
+	} else {
+		for (int i = 0; i < count; ++i)
+			bases[i] = (choices == 1) ? 0 : rng().below(choices);
+	}
+}
+void Generator::chooseBases(int choices, char *bases, int count) {
+	::chooseBases(basisChoiceFactory, choices, bases, count);
+}
+int Generator::emissionSize() {
+	return pulseNumberFactory->operator()();
+}
+vector<double> Generator::intensities() {
+	return pulseNumberFactory->intensities();
+}
+void Generator::createBlock(PulseBlock& block) {
+	block.pristine = stateDeviationTransformer->isIdentity();
+	// Every intensity class goes through the same pass, tagged per pulse
+	bool decoy = !pulseNumberFactory->intensities().empty();
+	for (int i = 0; i < block.size; ++i) {
+		const state& s = block.protocol->states[2*block.sourceBases[i] + block.bits[i]];
+		if (decoy) {
+			block.intensityClasses[i] = pulseNumberFactory->chooseClass();
+			createPulse(block.pulses[i], s.first, s.second, pulseNumberFactory->photons(block.intensityClasses[i]));
+		} else {
+			createPulse(block.pulses[i], s.first, s.second);
+		}
+		block.photons[i] = block.pulses[i].size();
+		block.weights[i] *= pulseNumberFactory->likelihoodRatio(block.photons[i]);
+	}
 }
 
 
 Detector::Detector(int dcr, BoolFactory *qeGen, BoolFactory *bcGen, BasisTransformer *bdGen) {
 	darkCountRate = dcr;
+	darkCountProbability = 0;
 	quantumEfficiencyFactory = qeGen;
 	basisChoiceFactory = bcGen;
 	basisDeviationTransformer = bdGen;
 }
-int Detector::detectPulse(Pulse pulse, basis basisChoice) {
+int Detector::detectPulse(PulseView pulse, basis basisChoice) {
+	METRIC_STAGE_TIMER(METRIC_STAGE_DETECT);
 	if (!(quantumEfficiencyFactory->operator()())) {
 		return -1;
 	}
-	int size = pulse.size();
-	Qubit *qubit = pulse[rand()%size];
-	bool observation = qubit->observe(basisDeviationTransformer->operator()(basisChoice));
-	if (DEBUGPRINT) {
-		//cout << "Detecting qbit: " << qubit->alpha << "," << qubit->beta << endl;
-	}
+	// The chosen photon may stand for a whole group, so a copy is measured
+	Qubit *chosen = pulse[rng().below(pulse.size())];
+	Qubit photon(chosen->alpha, chosen->beta);
+	bool observation = photon.observe(basisDeviationTransformer->operator()(basisChoice));
+	METRIC_INC(METRIC_DETECTIONS);
 	return (observation)? 1:0;
 }
-int Detector::detectPulse(Pulse pulse) {
+int Detector::detectPulse(PulseView pulse) {
 	basis basisChoice;
 	if (basisChoiceFactory->operator()()) {
-		if (DEBUGPRINT){
-			cout << "Choose diagonal basis" << endl;
-		}
+		TRACE("Choose diagonal basis");
 		basisChoice = make_pair(PLUS, MINUS);
 	} else {
-		if (DEBUGPRINT){
-			cout << "Choose normal basis" << endl;
-		}
+		TRACE("Choose normal basis");
 		basisChoice = make_pair(ZERO, ONE);
 	}
 	return detectPulse(pulse, basisChoice);
 }
-int Detector::detectPulse(Pulse pulse, bool commonBasisChoice) {
+int Detector::detectPulse(PulseView pulse, basis basisChoice, double minorityFloor, double& weight) {
+	METRIC_STAGE_TIMER(METRIC_STAGE_DETECT);
+	if (!(quantumEfficiencyFactory->operator()())) {
+		return -1;
+	}
+	Qubit *chosen = pulse[rng().below(pulse.size())];
+	Qubit photon(chosen->alpha, chosen->beta);
+	bool observation = photon.observe(basisDeviationTransformer->operator()(basisChoice), minorityFloor, weight);
+	METRIC_INC(METRIC_DETECTIONS);
+	return (observation)? 1:0;
+}
+int Detector::detectMixed(const DensityMatrix& rho, basis basisChoice, double minorityFloor, double& weight) {
+	return measureMixed(rho, basisDeviationTransformer->operator()(basisChoice), minorityFloor, weight);
+}
+int Detector::measureMixed(const DensityMatrix& rho, basis deviatedBasis, double minorityFloor, double& weight) {
+	METRIC_STAGE_TIMER(METRIC_STAGE_DETECT);
+	if (rho.trace() <= eps || !(quantumEfficiencyFactory->operator()())) {
+		return -1;
+	}
+	double zeroProb = rho.probability(deviatedBasis.first);
+	double oneProb  = rho.probability(deviatedBasis.second);
+	oneProb /= (zeroProb + oneProb);
+	bool minority = (oneProb < 0.5);
+	double minorityProb = minority ? oneProb : 1-oneProb;
+	bool observation;
+	if (minorityProb > 0 && minorityProb < minorityFloor) {
+		bool drawMinority = rng().uniform() < minorityFloor;
+		weight *= drawMinority ? minorityProb/minorityFloor : (1-minorityProb)/(1-minorityFloor);
+		observation = drawMinority ? minority : !minority;
+	} else {
+		observation = rng().uniform() < oneProb;
+	}
+	METRIC_INC(METRIC_DETECTIONS);
+	TRACE("mixed state observed to be " << observation << "(" << zeroProb << "," << oneProb << ")");
+	return (observation)? 1:0;
+}
+int Detector::detectMixed(const DensityMatrix& rho, basis basisChoice) {
+	double weight = 1;
+	return detectMixed(rho, basisChoice, 0, weight);
+}
+int Detector::detectMixed(const DensityMatrix& rho) {
+	bool basisChoice = basisChoiceFactory->operator()();
+	return detectMixed(rho, basisChoice);
+}
+int Detector::detectMixed(const DensityMatrix& rho, bool commonBasisChoice) {
+	return detectMixed(rho, commonBasisChoice ? make_pair(PLUS, MINUS) : make_pair(ZERO, ONE));
+}
+bool Detector::chooseBasis() {
+	return basisChoiceFactory->operator()();
+}
+int Detector::chooseBasis(const Protocol& protocol) {
+	int bases = protocol.bases.size();
+	if (bases == 2)
+		return basisChoiceFactory->operator()();
+	return (bases == 1) ? 0 : rng().below(bases);
+}
+void Detector::chooseBases(int choices, char *bases, int count) {
+	::chooseBases(basisChoiceFactory, choices, bases, count);
+}
+int Detector::detectState(double oneProbability) {
+	METRIC_STAGE_TIMER(METRIC_STAGE_DETECT);
+	if (!(quantumEfficiencyFactory->operator()())) {
+		return -1;
+	}
+	METRIC_INC(METRIC_DETECTIONS);
+	return (rng().uniform() < oneProbability) ? 1 : 0;
+}
+int Detector::detectCompiled(PulseView pulse, const CompiledBasis& measured, double minorityFloor, double& weight) {
+	METRIC_STAGE_TIMER(METRIC_STAGE_DETECT);
+	if (!(quantumEfficiencyFactory->operator()())) {
+		return -1;
+	}
+	Qubit *chosen = pulse[rng().below(pulse.size())];
+	double oneProb = measured.oneProbability(chosen->alpha, chosen->beta);
+	bool minority = (oneProb < 0.5);
+	double minorityProb = minority ? oneProb : 1-oneProb;
+	bool observation;
+	if (minorityProb > 0 && minorityProb < minorityFloor) {
+		bool drawMinority = rng().uniform() < minorityFloor;
+		weight *= drawMinority ? minorityProb/minorityFloor : (1-minorityProb)/(1-minorityFloor);
+		observation = drawMinority ? minority : !minority;
+	} else {
+		observation = rng().uniform() < oneProb;
+	}
+	METRIC_INC(METRIC_DETECTIONS);
+	return (observation)? 1:0;
+}
+void Detector::detectBlock(PulseBlock& block) {
+	const Protocol& protocol = *block.protocol;
+	bool ideal = basisDeviationTransformer->isIdentity();
+	bool tabulated = block.pristine && block.outcomeBias == 0 && ideal;
+	static thread_local vector<CompiledBasis> compiled;
+	if (!ideal) {
+		compiled.resize(block.size);
+		compileBases(protocol.bases, block.detectorBases.data(), block.first, block.size, compiled.data());
+	}
+	for (int i = 0; i < block.size; ++i) {
+		TRACE_PULSE(block.first + i);
+		int basisIndex = block.detectorBases[i];
+		const basis& chosenBasis = protocol.bases[basisIndex];
+		if (block.mixed && !ideal) {
+			// The compiled basis is already misaligned
+			block.detections[i] = measureMixed(block.mixedStates[i], compiled[i].measured(), block.outcomeBias,
+											   block.weights[i]);
+		} else if (block.mixed) {
+			block.detections[i] = detectMixed(block.mixedStates[i], chosenBasis, block.outcomeBias, block.weights[i]);
+		} else if (block.pulses[i].size() > 0 && tabulated) {
+			int aliceState = 2*block.sourceBases[i] + block.bits[i];
+			block.detections[i] = detectState(protocol.oneProbability(aliceState, basisIndex));
+		} else if (block.pulses[i].size() > 0 && !ideal) {
+			block.detections[i] = detectCompiled(block.pulses[i], compiled[i], block.outcomeBias, block.weights[i]);
+		} else if (block.pulses[i].size() > 0 && block.outcomeBias > 0) {
+			block.detections[i] = detectPulse(block.pulses[i], chosenBasis, block.outcomeBias, block.weights[i]);
+		} else if (block.pulses[i].size() > 0) {
+			block.detections[i] = detectPulse(block.pulses[i], chosenBasis);
+		} else {
+			block.detections[i] = -1;
+		}
+	}
+	if (darkCountProbability > 0) {
+		for (int i = 0; i < block.size; ++i) {
+			if (block.detections[i] < 0 && rng().uniform() < darkCountProbability) {
+				block.detections[i] = rng().bit();
+				METRIC_INC(METRIC_DETECTIONS);
+			}
+		}
+	}
+}
+bool Detector::clicks() {
+	return quantumEfficiencyFactory->operator()();
+}
+bool Detector::isIdeal() {
+	return basisDeviationTransformer->isIdentity();
+}
+void Detector::setDarkCountProbability(double probability) {
+	darkCountProbability = probability;
+}
+void Detector::compileBases(const vector<basis>& bases, const char *choices, long long firstSlot, int count,
+							CompiledBasis *compiled) {
+	basisDeviationTransformer->compile(bases, choices, firstSlot, count, compiled);
+}
+int Detector::detectPulse(PulseView pulse, bool commonBasisChoice) {
 	basis basisChoice;
 	if (commonBasisChoice) {
-		if (DEBUGPRINT){
-			cout << "Choose diagonal basis" << endl;
-		}
+		TRACE("Choose diagonal basis");
 		basisChoice = make_pair(PLUS, MINUS);
 	} else {
-		if (DEBUGPRINT){
-			cout << "Choose normal basis" << endl;
-		}
+		TRACE("Choose normal basis");
 		basisChoice = make_pair(ZERO, ONE);
 	}
 	return detectPulse(pulse, basisChoice);
@@ -94,18 +332,177 @@ int Detector::detectPulse(Pulse pulse, bool commonBasisChoice) {
 Channel::Channel(BoolFactory *arg, StateTransformer *sdg) {
 	absorptionRateFactory = arg;
 	stateDeviationTransformer = sdg;
+	noiseModel = nullptr;
+	analytic = false;
+	drift = nullptr;
+}
+Channel::Channel(BoolFactory *arg, StateTransformer *sdg, NoiseModel *nm, bool analyticDetection) {
+	absorptionRateFactory = arg;
+	stateDeviationTransformer = sdg;
+	noiseModel = nm;
+	analytic = analyticDetection && (nm != nullptr);
+	drift = nullptr;
+}
+void Channel::propagate(Pulse& pulse) {
+	METRIC_STAGE_TIMER(METRIC_STAGE_PROPAGATE);
+	bool identity = stateDeviationTransformer->isIdentity() && noiseModel == nullptr;
+	if (!identity)
+		pulse.expand();
+	for (int g = 0; g < pulse.groups(); ++g) {
+		if (!identity) {
+			auto qubit = pulse.group(g);
+			auto state = make_pair(qubit->alpha, qubit->beta);
+			state = stateDeviationTransformer->operator()(state);
+			if (noiseModel != nullptr)
+				state = noiseModel->sample(state);
+			qubit->changeState(state);
+		}
+		int absorbed = absorptionRateFactory->count(pulse.multiplicity(g));
+		METRIC_ADD(METRIC_PHOTONS_ABSORBED, absorbed);
+		pulse.setMultiplicity(g, pulse.multiplicity(g) - absorbed);
+	}
+	pulse.compact();
 }
-Pulse Channel::propagate(Pulse& pulse) {
-	Pulse propagatedPulse = Pulse();
-	while(pulse.size() > 0) {
-		auto extractedQubit = pulse.extract();
-		auto state = make_pair(extractedQubit->alpha, extractedQubit->beta);
-		extractedQubit->changeState(stateDeviationTransformer->operator()(state));
 
-		if (absorptionRateFactory->operator()() == false)
-			propagatedPulse.insert(extractedQubit);
+void Channel::propagateDeviated(PulseBlock& block) {
+	METRIC_STAGE_TIMER(METRIC_STAGE_PROPAGATE);
+	// Absorption does not depend on the state, so it is drawn first and
+	// only the surviving photons are deviated, all of the block's in one
+	// batch
+	static thread_local vector<state> states;
+	states.clear();
+	for (int i = 0; i < block.size; ++i) {
+		Pulse& pulse = block.pulses[i];
+		for (int g = 0; g < pulse.groups(); ++g) {
+			int absorbed = absorptionRateFactory->count(pulse.multiplicity(g));
+			METRIC_ADD(METRIC_PHOTONS_ABSORBED, absorbed);
+			pulse.setMultiplicity(g, pulse.multiplicity(g) - absorbed);
+		}
+		pulse.compact();
+		pulse.expand();
+		for (int g = 0; g < pulse.groups(); ++g) {
+			states.push_back(make_pair(pulse.group(g)->alpha, pulse.group(g)->beta));
+		}
+	}
+	stateDeviationTransformer->transform(states.data(), states.size());
+
+	const state *next = states.data();
+	for (int i = 0; i < block.size; ++i) {
+		Pulse& pulse = block.pulses[i];
+		for (int g = 0; g < pulse.groups(); ++g) {
+			state s = *next++;
+			if (noiseModel != nullptr)
+				s = noiseModel->sample(s);
+			// Deviations and noise trajectories keep states normalized
+			pulse.group(g)->alpha = s.first;
+			pulse.group(g)->beta = s.second;
+		}
 	}
-	return propagatedPulse;
+}
+DensityMatrix Channel::mixPulse(Pulse& pulse) {
+	DensityMatrix mixedState;
+	bool identity = stateDeviationTransformer->isIdentity();
+	int survivors = 0;
+	for (int g = 0; g < pulse.groups(); ++g) {
+		auto state = make_pair(pulse.group(g)->alpha, pulse.group(g)->beta);
+		int absorbed = absorptionRateFactory->count(pulse.multiplicity(g));
+		int kept = pulse.multiplicity(g) - absorbed;
+		METRIC_ADD(METRIC_PHOTONS_ABSORBED, absorbed);
+		if (identity) {
+			mixedState.add(DensityMatrix(state), kept);
+		} else {
+			for (int i = 0; i < kept; ++i) {
+				mixedState.add(DensityMatrix(stateDeviationTransformer->operator()(state)), 1);
+			}
+		}
+		survivors += kept;
+	}
+	pulse.release();
+	if (survivors > 1)
+		mixedState.scale(1.0/survivors);
+	return mixedState;
+}
+DensityMatrix Channel::propagateMixed(Pulse& pulse) {
+	METRIC_STAGE_TIMER(METRIC_STAGE_PROPAGATE);
+	DensityMatrix mixedState = mixPulse(pulse);
+	return (noiseModel != nullptr) ? noiseModel->operator()(mixedState) : mixedState;
+}
+void Channel::propagateMixed(vector<Pulse>& pulses, vector<DensityMatrix>& mixedStates) {
+	METRIC_STAGE_TIMER(METRIC_STAGE_PROPAGATE);
+	mixedStates.resize(pulses.size());
+	for (size_t i = 0; i < pulses.size(); ++i) {
+		mixedStates[i] = mixPulse(pulses[i]);
+	}
+	if (noiseModel != nullptr)
+		noiseModel->apply(mixedStates.data(), mixedStates.size());
+}
+void Channel::propagateBlock(PulseBlock& block, bool allowMixed) {
+	if (analytic && allowMixed) {
+		propagateMixed(block.pulses, block.mixedStates);
+		block.mixed = true;
+		rotateBlock(block);
+		return;
+	}
+	if (stateDeviationTransformer->isIdentity()) {
+		for (int i = 0; i < block.size; ++i) {
+			propagate(block.pulses[i]);
+		}
+	} else {
+		propagateDeviated(block);
+	}
+	rotateBlock(block);
+	block.pristine = block.pristine && stateDeviationTransformer->isIdentity() && noiseModel == nullptr
+				  && block.channelRotation == 0;
+}
+void Channel::rotateBlock(PulseBlock& block) {
+	if (block.channelRotation == 0)
+		return;
+	METRIC_STAGE_TIMER(METRIC_STAGE_PROPAGATE);
+	double c = cos(block.channelRotation), s = sin(block.channelRotation);
+	if (block.mixed) {
+		// R rho R^T with R = [[c,-s],[s,c]]
+		for (int i = 0; i < block.size; ++i) {
+			amplitude *m = block.mixedStates[i].m;
+			amplitude a = c*m[0] - s*m[2], b = c*m[1] - s*m[3];
+			amplitude d = s*m[0] + c*m[2], e = s*m[1] + c*m[3];
+			m[0] = c*a - s*b;
+			m[1] = s*a + c*b;
+			m[2] = c*d - s*e;
+			m[3] = s*d + c*e;
+		}
+		return;
+	}
+	for (int i = 0; i < block.size; ++i) {
+		Pulse& pulse = block.pulses[i];
+		for (int g = 0; g < pulse.groups(); ++g) {
+			Qubit *photon = pulse.group(g);
+			amplitude alpha = photon->alpha, beta = photon->beta;
+			photon->alpha = c*alpha - s*beta;
+			photon->beta = s*alpha + c*beta;
+		}
+	}
+}
+void Channel::propagatePairs(pairState *states, char *arrived, int count, int half) {
+	METRIC_STAGE_TIMER(METRIC_STAGE_PROPAGATE);
+	for (int i = 0; i < count; ++i) {
+		if (absorptionRateFactory->count(1) > 0) {
+			METRIC_INC(METRIC_PHOTONS_ABSORBED);
+			arrived[i] = false;
+			continue;
+		}
+		arrived[i] = true;
+		if (noiseModel != nullptr)
+			states[i] = noiseModel->sample(states[i], half);
+	}
+}
+bool Channel::isAnalytic() {
+	return analytic;
+}
+void Channel::setDrift(PolarizationDrift *_drift) {
+	drift = _drift;
+}
+PolarizationDrift* Channel::getDrift() {
+	return drift;
 }
 
 GeneratorInfo::GeneratorInfo(string _name, Generator *gen, string png, string bcg, string sdg) {
@@ -125,9 +522,11 @@ DetectorInfo::DetectorInfo(string _name, Detector *det, int dcr, string qeg, str
 	basisDeviationTransformerName = bdg;
 }
 
-ChannelInfo::ChannelInfo(string _name, Channel *chan, string arg, string sdg) {
+ChannelInfo::ChannelInfo(string _name, Channel *chan, string arg, string sdg, string nm, string drift) {
 	name = _name;
 	channel = chan;
 	AbsorptionRateFactoryName = arg;
 	stateDeviationTransformerName = sdg;
+	noiseModelName = nm;
+	driftName = drift;
 }
\ No newline at end of file
@@ -7,9 +7,53 @@
 #include "quantum.h"
 #include "factories.h"
 #include "transformers.h"
+#include "noise.h"
+#include "protocol.h"
+#include "drift.h"
 
 using namespace std;
 
+#define BLOCK_SIZE (4096)
+
+// A block of consecutive pulses moving through the devices together. Every
+// stage works on the whole block before the next one runs; per-pulse data
+// lives in parallel arrays indexed from 0 to size-1.
+struct PulseBlock {
+	long long first;
+	int size;
+	bool mixed;
+	// Alice sends state 2*sourceBases[i] + bits[i] of the protocol's
+	// alphabet and Bob measures in its basis detectorBases[i]
+	const Protocol *protocol;
+	vector<char> bits;
+	vector<char> sourceBases;
+	vector<char> announcements;
+	vector<char> detectorBases;
+	vector<Pulse> pulses;
+	vector<DensityMatrix> mixedStates;
+	vector<int> detections;
+	vector<int> interceptions;
+	// Importance sampling: photons[i] is the photon number Alice sent and
+	// weights[i] the likelihood ratio accumulated by biased stages. Outcomes
+	// rarer than outcomeBias are oversampled by the detector (0 disables).
+	vector<int> photons;
+	vector<double> weights;
+	// Decoy states: the source's intensity class of each pulse
+	vector<char> intensityClasses;
+	// Net polarization rotation of a drifting channel for this block
+	double channelRotation;
+	double outcomeBias;
+	// Every photon is still exactly the state Alice chose, so detection
+	// probabilities can come from the protocol's table
+	bool pristine;
+
+	PulseBlock();
+	void reset(long long firstPulse, int count);
+	void release();
+	// Deep copy of Alice's side (bits, bases, photons) of another block
+	void copySource(const PulseBlock& source);
+};
+
 class Generator  {
 private:
 IntFactory 			*pulseNumberFactory;
@@ -17,32 +61,105 @@ BoolFactory 		*basisChoiceFactory;
 StateTransformer 	*stateDeviationTransformer;
 public:
 	Generator(IntFactory *png, BoolFactory *bcg, StateTransformer *sdg);
-	Pulse createPulse(amplitude a, amplitude b);
-	Pulse createPulse(state s);
-	Pulse createPulse(bool value, bool basisChoice);
-	Pulse createPulse(bool value);
+	// Refill pulse in place, releasing its old photons, so pulse storage is
+	// reused
+	void createPulse(Pulse& pulse, amplitude a, amplitude b);
+	void createPulse(Pulse& pulse, amplitude a, amplitude b, int pulseSize);
+	void createPulse(Pulse& pulse, bool value, bool basisChoice);
+	bool chooseBasis();
+	// Index of one of the protocol's source bases
+	int chooseBasis(const Protocol& protocol);
+	// count indices into choices bases at once; with two bases they come
+	// from the basis choice factory in packed words
+	void chooseBases(int choices, char *bases, int count);
+	// Number of photons (or photon pairs) in the next emission
+	int emissionSize();
+	// Decoy states: intensity of each class, empty for a single intensity
+	vector<double> intensities();
+	void createBlock(PulseBlock& block);
 };
 
 class Detector {
 private:
 int darkCountRate;
+double darkCountProbability;
 BoolFactory	*quantumEfficiencyFactory;
 BoolFactory 	*basisChoiceFactory;
 BasisTransformer *basisDeviationTransformer;
+	// Measurements in a basis that is already deviated
+	int measureMixed(const DensityMatrix& rho, basis deviatedBasis, double minorityFloor, double& weight);
+	int detectCompiled(PulseView pulse, const CompiledBasis& measured, double minorityFloor, double& weight);
 public:
 	Detector(int dcr, BoolFactory *qeGen, BoolFactory *bcGen, BasisTransformer *bdGen);
-	int detectPulse(Pulse pulse, basis basisChoice);
-	int detectPulse(Pulse pulse);
-	int detectPulse(Pulse pulse, bool commonBasisChoice);
+	// The detector measures one uniformly chosen photon of the view; the
+	// photons themselves are left as they were and stay with the caller
+	int detectPulse(PulseView pulse, basis basisChoice);
+	int detectPulse(PulseView pulse);
+	int detectPulse(PulseView pulse, bool commonBasisChoice);
+	int detectPulse(PulseView pulse, basis basisChoice, double minorityFloor, double& weight);
+	int detectMixed(const DensityMatrix& rho, basis basisChoice, double minorityFloor, double& weight);
+	int detectMixed(const DensityMatrix& rho, basis basisChoice);
+	int detectMixed(const DensityMatrix& rho);
+	int detectMixed(const DensityMatrix& rho, bool commonBasisChoice);
+	bool chooseBasis();
+	// Index of one of the protocol's bases
+	int chooseBasis(const Protocol& protocol);
+	// As Generator::chooseBases
+	void chooseBases(int choices, char *bases, int count);
+	// Detection of a photon known to give outcome 1 with oneProbability
+	// in the (ideal) basis measured
+	int detectState(double oneProbability);
+	void detectBlock(PulseBlock& block);
+	// Pieces of detectPulse for joint measurements that are not made one
+	// photon at a time: whether the detector fires at all, and the bases
+	// it actually measures in over count slots from firstSlot (see
+	// BasisTransformer::compile)
+	bool clicks();
+	void compileBases(const vector<basis>& bases, const char *choices, long long firstSlot, int count,
+					  CompiledBasis *compiled);
+	// True when it measures in exactly the bases chosen
+	bool isIdeal();
+	// Probability of a click with a random outcome in a slot where no
+	// photon is detected (detectBlock only; 0 by default)
+	void setDarkCountProbability(double probability);
 };
 
 class Channel {
 private:
 	BoolFactory *absorptionRateFactory;
 	StateTransformer *stateDeviationTransformer;
+	NoiseModel *noiseModel;
+	bool analytic;
+	PolarizationDrift *drift;
+	DensityMatrix mixPulse(Pulse& pulse);
+	// Turns every photon (or density matrix) of the block by its
+	// channelRotation; identical photons stay one group
+	void rotateBlock(PulseBlock& block);
+	// propagate() for a whole block with a deviation transformer
+	void propagateDeviated(PulseBlock& block);
 public:
 	Channel(BoolFactory *arg, StateTransformer *sdg);
-	Pulse propagate(Pulse& pulse);
+	Channel(BoolFactory *arg, StateTransformer *sdg, NoiseModel *nm, bool analyticDetection);
+	// In place: transforms every photon and returns absorbed ones to the pool
+	void propagate(Pulse& pulse);
+	// Density matrix path: the surviving photons are averaged into one mixed
+	// state (the detector measures a uniformly chosen photon) and the noise
+	// model is applied to it. An empty pulse comes back with trace 0.
+	DensityMatrix propagateMixed(Pulse& pulse);
+	void propagateMixed(vector<Pulse>& pulses, vector<DensityMatrix>& mixedStates);
+	// Uses the density matrix path when the channel is analytic and the
+	// caller allows it, i.e. no later stage needs the photons themselves.
+	void propagateBlock(PulseBlock& block, bool allowMixed);
+	// One half (0 Alice, 1 Bob) of count entangled pairs travels through
+	// the channel: arrived[i] is cleared when that half is absorbed and the
+	// noise model acts on that half of the ones that arrive. Deviation
+	// transformers map single photon states and are not applied.
+	void propagatePairs(pairState *states, char *arrived, int count, int half);
+	bool isAnalytic();
+	// Time varying polarization (nullptr for none); the simulation tracks
+	// it per run and hands each block its rotation
+	void setDrift(PolarizationDrift *_drift);
+	PolarizationDrift* getDrift();
 };
 
 struct GeneratorInfo {
@@ -69,7 +186,9 @@ struct ChannelInfo {
 	Channel *channel;
 	string AbsorptionRateFactoryName;
 	string stateDeviationTransformerName;
-	ChannelInfo(string _name, Channel *chan, string arg, string sdg);
+	string noiseModelName;
+	string driftName;
+	ChannelInfo(string _name, Channel *chan, string arg, string sdg, string nm = "None", string drift = "None");
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,122 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "drift.h"
+
+using namespace std;
+
+
+PolarizationDrift::PolarizationDrift(double _sigma) {
+	sigma = _sigma;
+	compensated = false;
+	gain = 0;
+	window = 1;
+	delay = 1;
+	name = to_string(sigma) + " radian/block Polarization Drift";
+}
+PolarizationDrift::PolarizationDrift(double _sigma, double _gain, int _window, int _delay) {
+	if (_window < 1 || _delay < 1) {
+		cout << "Drift compensation window and delay must be at least one block" << endl;
+		throw -1;
+	}
+	sigma = _sigma;
+	compensated = true;
+	gain = _gain;
+	window = _window;
+	delay = _delay;
+	name = to_string(sigma) + " radian/block Polarization Drift, compensated every " + to_string(window)
+		 + " blocks";
+}
+PolarizationDrift::PolarizationDrift() {
+	cout << "Enter drift of the polarization angle in radians per block of pulses: ";
+	double _sigma;
+	cin >> _sigma;
+	cout << "Compensate the drift (1/0): ";
+	bool compensate;
+	cin >> compensate;
+	if (!compensate) {
+		*this = PolarizationDrift(_sigma);
+		return;
+	}
+	double _gain;
+	int _window, _delay;
+	cout << "Enter controller gain (fraction of the estimated angle per move): ";
+	cin >> _gain;
+	cout << "Enter blocks per QBER estimate: ";
+	cin >> _window;
+	cout << "Enter blocks before an estimate reaches the controller: ";
+	cin >> _delay;
+	*this = PolarizationDrift(_sigma, _gain, _window, _delay);
+}
+
+PolarizationDrift* choosePolarizationDrift() {
+	cout << "(1) Static channel" << endl;
+	cout << "(2) Polarization drift" << endl;
+	cout << "Choose: ";
+	int choice;
+	cin >> choice;
+	switch (choice) {
+		case 1:
+			return nullptr;
+		case 2:
+			return new PolarizationDrift();
+		default: {
+			cout << "Out of Index Polarization Drift choice" << endl;
+			throw -1;
+		}
+	}
+}
+
+
+DriftTracker::DriftTracker(const PolarizationDrift *_drift, uint64_t seed, long long _firstBlock) {
+	drift = _drift;
+	// Separate from the block streams, which start from seed itself
+	walk = Rng(seed ^ 0xD81F7D81F7D81F7DULL);
+	fiberAngle = 0;
+	firstBlock = _firstBlock;
+	corrections.push_back(0);
+	direction = 1;
+	lastQber = 0.5;
+	windowErrors = 0;
+	windowTrials = 0;
+	windowBlocks = 0;
+	if (drift->compensated && firstBlock > 0) {
+		cout << "A compensated drift needs the run's earlier blocks and can not start mid-run" << endl;
+		throw -1;
+	}
+	// The walk is one normal draw per block from the start of the run
+	for (long long b = 0; b < firstBlock; ++b)
+		rotation(b);
+}
+long long DriftTracker::mergedBefore(long long blockIndex) const {
+	return drift->compensated ? blockIndex - drift->delay + 1 : firstBlock;
+}
+double DriftTracker::rotation(long long blockIndex) {
+	// Box-Muller
+	double radius = sqrt(-2 * log(1 - walk.uniform()));
+	fiberAngle += drift->sigma * radius * cos(2*M_PI * walk.uniform());
+	if (!drift->compensated)
+		return fiberAngle;
+	long long known = max(0LL, blockIndex - drift->delay + 1 - firstBlock);
+	return fiberAngle - corrections[min<long long>(known, corrections.size() - 1)];
+}
+void DriftTracker::merged(long long errors, long long trials) {
+	double correction = corrections.back();
+	windowErrors += errors;
+	windowTrials += trials;
+	if (++windowBlocks == drift->window) {
+		if (windowTrials > 0) {
+			double qber = (double) windowErrors / windowTrials;
+			if (qber > lastQber)
+				direction = -direction;
+			correction += direction * drift->gain * asin(sqrt(min(qber, 0.5)));
+			lastQber = qber;
+		}
+		windowErrors = windowTrials = 0;
+		windowBlocks = 0;
+	}
+	corrections.push_back(correction);
+}
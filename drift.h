@@ -0,0 +1,64 @@
+#ifndef _DRIFT_H_
+#define _DRIFT_H_
+
+#include <string>
+#include <vector>
+
+#include "rng.h"
+
+using namespace std;
+
+// Polarization drift of a fiber and the active compensation Bob runs
+// against it. The fiber turns every photon of a block by the same angle in
+// the polarization plane (as MisalignmentBasisTransformer turns bases),
+// and the angle does a random walk of sigma radians per block.
+//
+// When compensated, Bob's polarization controller turns back by its own
+// estimate. Every window blocks it moves by gain*asin(sqrt(QBER)) of the
+// window, keeping its direction when the QBER fell since the last move
+// and reversing it when the QBER rose (perturb and observe). Its QBER
+// estimate arrives delay blocks late, as real error estimation does.
+struct PolarizationDrift {
+	string name;
+	double sigma;
+	bool compensated;
+	double gain;
+	int window;
+	int delay;
+
+	PolarizationDrift();
+	PolarizationDrift(double _sigma);
+	PolarizationDrift(double _sigma, double _gain, int _window, int _delay);
+};
+// nullptr for a static channel
+PolarizationDrift* choosePolarizationDrift();
+
+// State of one drifting channel over a run, advanced in block order: the
+// fiber's walk when blocks are handed out and the controller as results
+// are merged. Both come from the run's seed only, so results do not depend
+// on the number of threads.
+class DriftTracker {
+private:
+	const PolarizationDrift *drift;
+	Rng walk;
+	double fiberAngle;
+	long long firstBlock;
+	// Controller position in force once firstBlock + k blocks are merged
+	vector<double> corrections;
+	double direction;
+	double lastQber;
+	long long windowErrors;
+	long long windowTrials;
+	int windowBlocks;
+public:
+	DriftTracker(const PolarizationDrift *_drift, uint64_t seed, long long _firstBlock);
+	// Blocks that must be merged before blockIndex can be handed out
+	long long mergedBefore(long long blockIndex) const;
+	// Net rotation of blockIndex, the fiber's angle less the controller's;
+	// called once per block in increasing order
+	double rotation(long long blockIndex);
+	// Sifted errors and trials of the next block in order
+	void merged(long long errors, long long trials);
+};
+
+#endif
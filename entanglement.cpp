@@ -0,0 +1,288 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "entanglement.h"
+#include "blockengine.h"
+#include "metrics.h"
+#include "rng.h"
+
+using namespace std;
+
+
+PairBlock::PairBlock() {
+	first = 0;
+	size = 0;
+}
+void PairBlock::reset(long long firstSlot, int count) {
+	first = firstSlot;
+	size = count;
+	aliceBases.resize(count);
+	bobBases.resize(count);
+	offsets.assign(count + 1, 0);
+	states.clear();
+	aliceResults.assign(count, -1);
+	bobResults.assign(count, -1);
+}
+
+
+EntangledSource::EntangledSource(Generator *gen, pairState _bellState) {
+	generator = gen;
+	bellState = _bellState;
+}
+pairState EntangledSource::state() {
+	return bellState;
+}
+void EntangledSource::createBlock(PairBlock& block) {
+	METRIC_STAGE_TIMER(METRIC_STAGE_GENERATE);
+	for (int i = 0; i < block.size; ++i) {
+		int pairs = generator->emissionSize();
+		METRIC_INC(METRIC_PULSES_GENERATED);
+		METRIC_PHOTONS(pairs);
+		block.offsets[i+1] = block.offsets[i] + pairs;
+	}
+	block.states.assign(block.offsets[block.size], bellState);
+	block.aliceArrived.resize(block.states.size());
+	block.bobArrived.resize(block.states.size());
+}
+
+
+basis polarizationBasis(double angle) {
+	return make_pair(make_pair(amplitude(cos(angle)), amplitude(sin(angle))),
+					 make_pair(amplitude(-sin(angle)), amplitude(cos(angle))));
+}
+EntangledProtocol bbm92Protocol() {
+	EntangledProtocol protocol;
+	protocol.name = "BBM92";
+	protocol.aliceBases = {make_pair(ZERO, ONE), make_pair(PLUS, MINUS)};
+	protocol.bobBases = protocol.aliceBases;
+	protocol.keyBases = {make_pair(0, 0), make_pair(1, 1)};
+	fill(protocol.chsh, protocol.chsh + 4, -1);
+	return protocol;
+}
+EntangledProtocol e91Protocol() {
+	const double degree = M_PI / 180;
+	EntangledProtocol protocol;
+	protocol.name = "E91";
+	protocol.aliceBases = {polarizationBasis(0), polarizationBasis(22.5*degree), polarizationBasis(45*degree)};
+	protocol.bobBases = {polarizationBasis(22.5*degree), polarizationBasis(45*degree), polarizationBasis(67.5*degree)};
+	protocol.keyBases = {make_pair(1, 0), make_pair(2, 1)};
+	protocol.chsh[0] = 0;
+	protocol.chsh[1] = 2;
+	protocol.chsh[2] = 0;
+	protocol.chsh[3] = 2;
+	return protocol;
+}
+
+
+EntangledResult::EntangledResult() {
+	pairHistogram.assign(PHOTON_HISTOGRAM_BINS, 0);
+}
+void EntangledResult::append(const EntangledResult& chunk) {
+	coincidences.add(chunk.coincidences.successes, chunk.coincidences.trials);
+	qber.add(chunk.qber.successes, chunk.qber.trials);
+	aliceKey.append(chunk.aliceKey);
+	bobKey.append(chunk.bobKey);
+	agreement.resize(max(agreement.size(), chunk.agreement.size()));
+	for (size_t s = 0; s < chunk.agreement.size(); ++s) {
+		agreement[s].add(chunk.agreement[s].successes, chunk.agreement[s].trials);
+	}
+	for (size_t i = 0; i < pairHistogram.size(); ++i) {
+		pairHistogram[i] += chunk.pairHistogram[i];
+	}
+}
+double EntangledResult::correlation(int setting) const {
+	return 2*agreement[setting].value() - 1;
+}
+double EntangledResult::chsh(const EntangledProtocol& protocol) const {
+	int bobCount = protocol.bobBases.size();
+	const int *c = protocol.chsh;
+	return fabs(correlation(c[0]*bobCount + c[2]) - correlation(c[0]*bobCount + c[3])
+				+ correlation(c[1]*bobCount + c[2]) + correlation(c[1]*bobCount + c[3]));
+}
+
+
+// Uniformly chosen pair among [begin, end) whose half arrived, -1 if none
+static int pickArrived(const vector<char>& arrived, int begin, int end) {
+	int count = 0;
+	for (int p = begin; p < end; ++p) {
+		count += arrived[p];
+	}
+	if (count == 0)
+		return -1;
+	int chosen = rng().below(count);
+	for (int p = begin; ; ++p) {
+		if (arrived[p] && chosen-- == 0)
+			return p;
+	}
+}
+
+// Each detector measures one photon of its arm. When both picked halves of
+// the same pair the outcome comes from the joint distribution; halves of
+// different pairs are uncorrelated and each follows its own marginal.
+static void detectPairs(PairBlock& block, Detector *aliceDetector, Detector *bobDetector,
+						const EntangledProtocol& protocol) {
+	METRIC_STAGE_TIMER(METRIC_STAGE_DETECT);
+	bool aliceIdeal = aliceDetector->isIdeal(), bobIdeal = bobDetector->isIdeal();
+	static thread_local vector<CompiledBasis> aliceMeasured, bobMeasured;
+	aliceMeasured.resize(block.size);
+	bobMeasured.resize(block.size);
+	if (!aliceIdeal)
+		aliceDetector->compileBases(protocol.aliceBases, block.aliceBases.data(), block.first, block.size,
+									aliceMeasured.data());
+	if (!bobIdeal)
+		bobDetector->compileBases(protocol.bobBases, block.bobBases.data(), block.first, block.size,
+								  bobMeasured.data());
+	for (int i = 0; i < block.size; ++i) {
+		int begin = block.offsets[i], end = block.offsets[i+1];
+		int aliceHalf = pickArrived(block.aliceArrived, begin, end);
+		int bobHalf = pickArrived(block.bobArrived, begin, end);
+		if (aliceHalf < 0 || bobHalf < 0 || !aliceDetector->clicks() || !bobDetector->clicks())
+			continue;
+		JointBasis joint(aliceIdeal ? protocol.aliceBases[block.aliceBases[i]] : aliceMeasured[i].measured(),
+						 bobIdeal ? protocol.bobBases[block.bobBases[i]] : bobMeasured[i].measured());
+		double p[4];
+		jointProbabilities(joint, block.states[aliceHalf], p);
+		if (aliceHalf == bobHalf) {
+			int outcome = sampleOutcome(p, rng().uniform());
+			block.aliceResults[i] = outcome >> 1;
+			block.bobResults[i] = outcome & 1;
+		} else {
+			block.aliceResults[i] = rng().uniform() * (p[0] + p[1] + p[2] + p[3]) >= p[0] + p[1];
+			jointProbabilities(joint, block.states[bobHalf], p);
+			block.bobResults[i] = rng().uniform() * (p[0] + p[1] + p[2] + p[3]) >= p[0] + p[2];
+		}
+		METRIC_ADD(METRIC_DETECTIONS, 2);
+	}
+}
+
+static void simulatePairBlock(long long blockIndex, const Rng& blockStream, EntangledSource *source,
+							  Channel *aliceChannel, Detector *aliceDetector, Channel *bobChannel,
+							  Detector *bobDetector, const EntangledProtocol& protocol,
+							  const vector<char>& keyFlip, const SimulationInput& input,
+							  PairBlock& block, EntangledResult& chunk) {
+	long long first = blockIndex * BLOCK_SIZE;
+	int count = (int) min<long long>(BLOCK_SIZE, input.pulses() - first);
+	int aliceSettings = protocol.aliceBases.size(), bobSettings = protocol.bobBases.size();
+
+	rng() = blockStream;
+	block.reset(first, count);
+	aliceDetector->chooseBases(aliceSettings, block.aliceBases.data(), count);
+	bobDetector->chooseBases(bobSettings, block.bobBases.data(), count);
+	source->createBlock(block);
+	aliceChannel->propagatePairs(block.states.data(), block.aliceArrived.data(), block.states.size(), 0);
+	bobChannel->propagatePairs(block.states.data(), block.bobArrived.data(), block.states.size(), 1);
+	detectPairs(block, aliceDetector, bobDetector, protocol);
+
+	chunk.agreement.resize(aliceSettings * bobSettings);
+	for (int i = 0; i < count; ++i) {
+		int alice = block.aliceResults[i], bob = block.bobResults[i];
+		int pairs = block.offsets[i+1] - block.offsets[i];
+		chunk.pairHistogram[min(pairs, PHOTON_HISTOGRAM_BINS-1)]++;
+		chunk.coincidences.add(alice >= 0);
+		if (alice < 0)
+			continue;
+		int setting = block.aliceBases[i] * bobSettings + block.bobBases[i];
+		chunk.agreement[setting].add(alice == bob);
+		// keyFlip: 0 not a key setting, 1 correlated, 2 anticorrelated
+		if (keyFlip[setting]) {
+			bool bobBit = (bob == 1) != (keyFlip[setting] == 2);
+			chunk.qber.add(bobBit != (alice == 1));
+			chunk.aliceKey.push(alice == 1);
+			chunk.bobKey.push(bobBit);
+		}
+	}
+}
+
+EntangledResult runEntangled(EntangledSource *source, Channel *aliceChannel, Detector *aliceDetector,
+							 Channel *bobChannel, Detector *bobDetector,
+							 const EntangledProtocol& protocol, const SimulationInput& input) {
+	// Whether Bob flips his bit for each key setting follows from the
+	// source state: anticorrelated outcomes (e.g. psi-) are flipped
+	int bobSettings = protocol.bobBases.size();
+	vector<char> keyFlip(protocol.aliceBases.size() * bobSettings, 0);
+	for (auto& key : protocol.keyBases) {
+		double p[4];
+		jointProbabilities(JointBasis(protocol.aliceBases[key.first], protocol.bobBases[key.second]),
+						   source->state(), p);
+		keyFlip[key.first * bobSettings + key.second] = (p[0] + p[3] >= 0.5) ? 1 : 2;
+	}
+
+	EntangledResult result;
+	long long blocks = (input.pulses() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	auto dispatch = [](long long, long long, PairBlock&) {
+		return true;
+	};
+	auto simulate = [&](long long blockIndex, const Rng& blockStream, PairBlock& block, EntangledResult& chunk) {
+		simulatePairBlock(blockIndex, blockStream, source, aliceChannel, aliceDetector, bobChannel,
+						  bobDetector, protocol, keyFlip, input, block, chunk);
+	};
+	auto merge = [&](long long blockIndex, EntangledResult& chunk) {
+		result.append(chunk);
+		METRICS_PERIODIC(min((blockIndex + 1) * BLOCK_SIZE, input.pulses()));
+		return false;
+	};
+	runBlocks<PairBlock, EntangledResult>(Rng(input.seed), 0, blocks, input.threads, dispatch, simulate, merge);
+	return result;
+}
+
+void printEntangledResult(const SimulationInput& input, const EntangledProtocol& protocol,
+						  const EntangledResult& result) {
+	cout << protocol.name << endl;
+	cout << "Slots simulated: " << result.coincidences.trials << endl;
+	printProportion("Coincidence rate: ", result.coincidences, input.confidence);
+	printProportion("QBER (sifted): ", result.qber, input.confidence);
+	double fraction = max(0.0, 1 - 2*binaryEntropy(result.qber.value()));
+	cout << "Sifted key: " << result.aliceKey.size << " bits, secret (1 - 2h(QBER)): "
+		 << (long long) (result.aliceKey.size * fraction) << " bits" << endl;
+	if (protocol.chsh[0] >= 0) {
+		// Settings are independent binomials, Var(E) = 4 p (1-p) / n
+		double variance = 0;
+		int bobCount = protocol.bobBases.size();
+		for (int a = 0; a < 2; ++a)
+		for (int b = 2; b < 4; ++b) {
+			auto& stat = result.agreement[protocol.chsh[a]*bobCount + protocol.chsh[b]];
+			if (stat.trials > 0)
+				variance += 4 * stat.value() * (1 - stat.value()) / stat.trials;
+		}
+		cout << "CHSH S: " << result.chsh(protocol) << " +/- " << zForConfidence(input.confidence)*sqrt(variance)
+			 << " (local bound 2, quantum bound " << 2*sqrt(2) << ")" << endl;
+	}
+	METRICS_DUMP(cout);
+}
+
+int runEntangledProtocol(const SimulationConfig& config) {
+	EntangledProtocol protocol;
+	string name = config.get("protocol");
+	if (name == "bbm92") {
+		protocol = bbm92Protocol();
+	} else if (name == "e91") {
+		protocol = e91Protocol();
+	} else {
+		cout << "Unknown entangled protocol " << name << endl;
+		throw -1;
+	}
+	string stateName = config.get("source.state");
+	pairState bellState;
+	if (stateName == "phi+") {
+		bellState = PHI_PLUS;
+	} else if (stateName == "phi-") {
+		bellState = PHI_MINUS;
+	} else if (stateName == "psi+") {
+		bellState = PSI_PLUS;
+	} else if (stateName == "psi-") {
+		bellState = PSI_MINUS;
+	} else {
+		cout << "Unknown value '" << stateName << "' for source.state" << endl;
+		throw -1;
+	}
+
+	auto input = config.buildInput();
+	EntangledSource source(config.buildGenerator(), bellState);
+	auto result = runEntangled(&source, config.buildChannel("alice."), config.buildDetector("alice."),
+							   config.buildChannel(), config.buildDetector(), protocol, input);
+	printEntangledResult(input, protocol, result);
+	return 0;
+}
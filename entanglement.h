@@ -0,0 +1,101 @@
+#ifndef _ENTANGLEMENT_H_
+#define _ENTANGLEMENT_H_
+
+#include <string>
+#include <vector>
+
+#include "constants.h"
+#include "twoqubit.h"
+#include "devices.h"
+#include "simulation.h"
+#include "config.h"
+
+using namespace std;
+
+// A block of consecutive slots of an entangled source, the pair analogue
+// of PulseBlock. Slot i emitted the pairs states[offsets[i]] up to
+// states[offsets[i+1]-1]; arrival flags and states are per pair.
+struct PairBlock {
+	long long first;
+	int size;
+	// Index into the protocol's bases
+	vector<char> aliceBases;
+	vector<char> bobBases;
+	vector<int> offsets;
+	vector<pairState> states;
+	vector<char> aliceArrived;
+	vector<char> bobArrived;
+	// Results of coincidences, -1 when either side saw nothing
+	vector<int> aliceResults;
+	vector<int> bobResults;
+
+	PairBlock();
+	void reset(long long firstSlot, int count);
+};
+
+// Source of entangled photon pairs, one half to Alice and one to Bob. The
+// generator's pulse number factory gives the number of pairs per slot
+// (e.g. Poisson for SPDC), all of them in the same Bell state.
+class EntangledSource {
+private:
+	Generator *generator;
+	pairState bellState;
+public:
+	EntangledSource(Generator *gen, pairState _bellState);
+	pairState state();
+	void createBlock(PairBlock& block);
+};
+
+// Measurement settings of an entangled protocol. Alice and Bob pick one
+// of their bases per slot, uniformly (through their detectors' basis
+// choice when there are two).
+struct EntangledProtocol {
+	string name;
+	vector<basis> aliceBases;
+	vector<basis> bobBases;
+	// (Alice, Bob) basis pairs whose coincidences are sifted into key
+	vector<pair<int, int> > keyBases;
+	// Alice's a1, a2 and Bob's b1, b2 of the CHSH test
+	// S = E(a1,b1) - E(a1,b2) + E(a2,b1) + E(a2,b2), or -1 for none
+	int chsh[4];
+};
+// Linear polarization basis at angle radians: {cos|0> + sin|1>, -sin|0> + cos|1>}
+basis polarizationBasis(double angle);
+// Both sides measure in Z or X and keep the matching ones (BBM92)
+EntangledProtocol bbm92Protocol();
+// Alice at 0, 22.5 and 45 degrees, Bob at 22.5, 45 and 67.5: matching
+// angles give key and the others the CHSH test (E91)
+EntangledProtocol e91Protocol();
+
+struct EntangledResult {
+	// Slots where both detectors fired
+	ProportionStat coincidences;
+	ProportionStat qber;
+	PackedBits aliceKey;
+	PackedBits bobKey;
+	// Agreement of coincident results per setting, index a*bobBases + b
+	vector<ProportionStat> agreement;
+	// Slots by number of pairs emitted, the last bin counting all larger ones
+	vector<long long> pairHistogram;
+
+	EntangledResult();
+	void append(const EntangledResult& chunk);
+	// E = P(same) - P(different) for a setting
+	double correlation(int setting) const;
+	// |S|, whose sign depends on the Bell state
+	double chsh(const EntangledProtocol& protocol) const;
+};
+
+// Runs input.pulses() slots a block at a time like runScenarios: create
+// pairs, send each half through its arm's channel, measure the pairs
+// jointly. Block b draws from the seed's stream jumped b times and blocks
+// merge in order, so the result depends only on the seed.
+EntangledResult runEntangled(EntangledSource *source, Channel *aliceChannel, Detector *aliceDetector,
+							 Channel *bobChannel, Detector *bobDetector,
+							 const EntangledProtocol& protocol, const SimulationInput& input);
+void printEntangledResult(const SimulationInput& input, const EntangledProtocol& protocol,
+						  const EntangledResult& result);
+// Runs config's protocol ("bbm92" or "e91") and prints the result
+int runEntangledProtocol(const SimulationConfig& config);
+
+#endif
@@ -1,8 +1,10 @@
 #include <random>
 #include <iostream>
 #include <string>
+#include <cmath>
 
 #include "factories.h"
+#include "rng.h"
 
 using namespace std;
 
@@ -15,26 +17,92 @@ int IdealPulseNumberFactory::operator()()  {
 }
 
 PoissonPulseNumberFactory::PoissonPulseNumberFactory(int lambda) {
-	gen  = default_random_engine();
-	dist = poisson_distribution<int>(lambda);
+	param = poisson_distribution<int>::param_type(lambda);
 	name = string("Poisson Pulse Number Factory, lambda = ") + to_string(lambda);
 }
 PoissonPulseNumberFactory::PoissonPulseNumberFactory() {
-	gen  = default_random_engine();
 	cout << "Enter lambda,i.e. mean of Distribution: ";
 	int lambda;
 	cin >> lambda;
-	dist = poisson_distribution<int>(lambda);
+	param = poisson_distribution<int>::param_type(lambda);
 	name = string("Poisson Pulse Number Factory, lambda = ") + to_string(lambda);
 }
 int PoissonPulseNumberFactory::operator()() {
-	return 1+dist(gen);
+	// A fresh distribution per draw keeps this safe to share between
+	// threads (the libstdc++ one caches normal deviates internally)
+	poisson_distribution<int> dist(param);
+	return 1+dist(rng());
+}
+
+ImportancePoissonPulseNumberFactory::ImportancePoissonPulseNumberFactory(double _mu, double _biasedMu) {
+	mu = _mu;
+	biasedMu = _biasedMu;
+	param = poisson_distribution<int>::param_type(biasedMu);
+	name = string("Importance Sampled Poisson Pulse Number Factory, mu = ") + to_string(mu)
+		 + ", sampled at mu = " + to_string(biasedMu);
+}
+ImportancePoissonPulseNumberFactory::ImportancePoissonPulseNumberFactory() {
+	cout << "Enter mean photon number mu: ";
+	cin >> mu;
+	cout << "Enter biased mean photon number to sample from: ";
+	cin >> biasedMu;
+	*this = ImportancePoissonPulseNumberFactory(mu, biasedMu);
+}
+int ImportancePoissonPulseNumberFactory::operator()() {
+	poisson_distribution<int> dist(param);
+	return dist(rng());
+}
+double ImportancePoissonPulseNumberFactory::likelihoodRatio(int value) {
+	return exp(biasedMu - mu + value * log(mu / biasedMu));
+}
+
+DecoyPulseNumberFactory::DecoyPulseNumberFactory(double mu, double nu, double signalProbability,
+												 double decoyProbability) {
+	if (!(0 < nu && nu < mu) || signalProbability < 0 || decoyProbability < 0
+		|| signalProbability + decoyProbability > 1) {
+		cout << "Decoy states need 0 < nu < mu and class probabilities summing to at most 1" << endl;
+		throw -1;
+	}
+	means = {mu, nu, 0};
+	cumulative = {signalProbability, signalProbability + decoyProbability, 1};
+	name = string("Decoy State Pulse Number Factory, mu = ") + to_string(mu) + ", nu = " + to_string(nu)
+		 + ", vacuum";
+}
+DecoyPulseNumberFactory::DecoyPulseNumberFactory() {
+	double mu, nu, signalProbability, decoyProbability;
+	cout << "Enter signal mean photon number mu: ";
+	cin >> mu;
+	cout << "Enter decoy mean photon number nu: ";
+	cin >> nu;
+	cout << "Enter probability of a signal pulse: ";
+	cin >> signalProbability;
+	cout << "Enter probability of a decoy pulse (vacuum takes the rest): ";
+	cin >> decoyProbability;
+	*this = DecoyPulseNumberFactory(mu, nu, signalProbability, decoyProbability);
+}
+int DecoyPulseNumberFactory::operator()() {
+	return photons(chooseClass());
+}
+vector<double> DecoyPulseNumberFactory::intensities() {
+	return means;
+}
+int DecoyPulseNumberFactory::chooseClass() {
+	double u = rng().uniform();
+	return (u < cumulative[0]) ? 0 : (u < cumulative[1]) ? 1 : 2;
+}
+int DecoyPulseNumberFactory::photons(int intensityClass) {
+	if (means[intensityClass] == 0)
+		return 0;
+	poisson_distribution<int> dist(means[intensityClass]);
+	return dist(rng());
 }
 
 IntFactory* choosePulseNumberFactory() {
 	IntFactory* chosenFactory;
 	vector<string> factories {"Ideal Pulse Number Factory, Always generate single pulse",
-							  "Poisson Pulse Number Factory, Pulses generated in Poisson Distribution according to Fock States"};
+							  "Poisson Pulse Number Factory, Pulses generated in Poisson Distribution according to Fock States",
+							  "Importance Sampled Poisson Pulse Number Factory, Poisson(mu) photons sampled from a biased Poisson and reweighted",
+							  "Decoy State Pulse Number Factory, Poisson signal, decoy and vacuum pulses mixed at random"};
 
 	int index = 1;
 	for (auto name: factories) {
@@ -53,6 +121,14 @@ IntFactory* choosePulseNumberFactory() {
 			chosenFactory = new PoissonPulseNumberFactory();
 			break;
 		}
+		case 3: {
+			chosenFactory = new ImportancePoissonPulseNumberFactory();
+			break;
+		}
+		case 4: {
+			chosenFactory = new DecoyPulseNumberFactory();
+			break;
+		}
 		default:{
 			cout << "Out of Index Pulse Number Factory choice" << endl;
 			throw -1;
@@ -67,7 +143,10 @@ IdealBasisChoiceFactory::IdealBasisChoiceFactory() {
 	name = "Ideal Basis Choice Factory";
 }
 bool IdealBasisChoiceFactory::operator()() {
-	return (rand()%2 == 0);
+	return rng().bit();
+}
+void IdealBasisChoiceFactory::fill(uint64_t *words, int count) {
+	rng().fillBits(words, count);
 }
 
 AlwaysZeroOneBasisChoiceFactory::AlwaysZeroOneBasisChoiceFactory() {
@@ -76,11 +155,37 @@ AlwaysZeroOneBasisChoiceFactory::AlwaysZeroOneBasisChoiceFactory() {
 bool AlwaysZeroOneBasisChoiceFactory::operator()() {
 	return 0;
 }
+void AlwaysZeroOneBasisChoiceFactory::fill(uint64_t *words, int count) {
+	for (int w = 0; w < (count + 63) / 64; ++w)
+		words[w] = 0;
+}
+
+BiasedBasisChoiceFactory::BiasedBasisChoiceFactory(double p) {
+	if (p < 0 || p > 1) {
+		cout << "Diagonal basis probability must be in [0,1]" << endl;
+		throw -1;
+	}
+	diagonalProbability = p;
+	name = string("Biased Basis Choice Factory, diagonal with p = ") + to_string(p);
+}
+BiasedBasisChoiceFactory::BiasedBasisChoiceFactory() {
+	cout << "Enter probability of choosing the diagonal basis: ";
+	double p;
+	cin >> p;
+	*this = BiasedBasisChoiceFactory(p);
+}
+bool BiasedBasisChoiceFactory::operator()() {
+	return rng().uniform() < diagonalProbability;
+}
+void BiasedBasisChoiceFactory::fill(uint64_t *words, int count) {
+	rng().fillBiasedBits(words, count, diagonalProbability);
+}
 
 BoolFactory* chooseBasisChoiceFactory() {
 	BoolFactory* chosenFactory;
 	vector<string> factories {"Ideal Basis Choice Factory, 50% Psuedo-Random chance of either Basis",
-							  "Always <0|,<1| Basis Choice Factory"};
+							  "Always <0|,<1| Basis Choice Factory",
+							  "Biased Basis Choice Factory, diagonal Basis with a given probability"};
 
 	int index = 1;
 	for (auto name: factories) {
@@ -99,6 +204,10 @@ BoolFactory* chooseBasisChoiceFactory() {
 			chosenFactory = new AlwaysZeroOneBasisChoiceFactory();
 			break;
 		}
+		case 3: {
+			chosenFactory = new BiasedBasisChoiceFactory();
+			break;
+		}
 		default:{
 			cout << "Out of Index Basis Choice Factory choice" << endl;
 			throw -1;
@@ -149,6 +258,9 @@ IdealAbsorptionRateFactory::IdealAbsorptionRateFactory() {
 bool IdealAbsorptionRateFactory::operator()(){
 	return false;
 }
+int IdealAbsorptionRateFactory::count(int trials) {
+	return 0;
+}
 
 PercentAbsorptionRateFactory::PercentAbsorptionRateFactory(double percent) {
 	percentAbsorbed = percent;
@@ -160,7 +272,10 @@ PercentAbsorptionRateFactory::PercentAbsorptionRateFactory() {
 	name = to_string(percentAbsorbed) + "% Absorption Rate Factory"; 
 }
 bool PercentAbsorptionRateFactory::operator()() {
-	return ((rand()%100000) < (percentAbsorbed*1000));
+	return rng().uniform()*100 < percentAbsorbed;
+}
+int PercentAbsorptionRateFactory::count(int trials) {
+	return (trials == 1) ? operator()() : rng().binomial(trials, percentAbsorbed/100);
 }
 
 BoolFactory* chooseAbsorptionRateFactory() {
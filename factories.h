@@ -1,6 +1,8 @@
 #ifndef _FACTORIES_H_
 #define _FACTORIES_H_
 #include <random>
+#include <cstdint>
+#include <vector>
 
 #include "constants.h"
 
@@ -10,12 +12,38 @@ class IntFactory {
 public:
 	string name;
 	virtual int operator()(){};
+	// p(value)/q(value) of the target over the sampled distribution, for
+	// factories that sample from a biased distribution
+	virtual double likelihoodRatio(int value) { return 1; };
+	// Decoy states: a source with several intensity classes picks one per
+	// pulse with chooseClass() and then its photon number with photons().
+	// intensities() is empty for a single intensity source.
+	virtual vector<double> intensities() { return vector<double>(); };
+	virtual int chooseClass() { return 0; };
+	virtual int photons(int intensityClass) { return operator()(); };
 };
 
 class BoolFactory {
 public:
 	string name;
 	virtual bool operator()(){};
+	// Number of true results in trials draws, for applying the factory to
+	// a group of identical photons at once
+	virtual int count(int trials) {
+		int n = 0;
+		for (int i = 0; i < trials; ++i)
+			n += operator()();
+		return n;
+	};
+	// count draws packed 64 per word (bit i in words[i/64] at i%64), for
+	// choices made a block at a time; basis choice factories fill whole
+	// words straight from the generator
+	virtual void fill(uint64_t *words, int count) {
+		for (int w = 0; w < (count + 63) / 64; ++w)
+			words[w] = 0;
+		for (int i = 0; i < count; ++i)
+			words[i >> 6] |= (uint64_t) operator()() << (i & 63);
+	};
 };
 
 
@@ -26,13 +54,42 @@ public:
 };
 class PoissonPulseNumberFactory : public IntFactory {
 private:
-	default_random_engine gen;
-	poisson_distribution<int> dist;
+	poisson_distribution<int>::param_type param;
 public: 
 	PoissonPulseNumberFactory();
 	PoissonPulseNumberFactory(int lambda);
 	int operator()() override;
 };
+// Importance sampling version of a Poisson(mu) photon source (vacuum
+// included): photon numbers are drawn from Poisson(biasedMu) so that rare
+// multiphoton pulses show up often, and weighted back to Poisson(mu).
+class ImportancePoissonPulseNumberFactory : public IntFactory {
+private:
+	double mu;
+	double biasedMu;
+	poisson_distribution<int>::param_type param;
+public:
+	ImportancePoissonPulseNumberFactory();
+	ImportancePoissonPulseNumberFactory(double mu, double biasedMu);
+	int operator()() override;
+	double likelihoodRatio(int value) override;
+};
+// Decoy-state source: Poisson(mu) signal pulses, Poisson(nu) decoys and
+// vacuum, mixed per pulse with the given probabilities. Classes are 0
+// signal, 1 decoy, 2 vacuum.
+class DecoyPulseNumberFactory : public IntFactory {
+private:
+	vector<double> means;
+	// P(class <= k)
+	vector<double> cumulative;
+public:
+	DecoyPulseNumberFactory();
+	DecoyPulseNumberFactory(double mu, double nu, double signalProbability, double decoyProbability);
+	int operator()() override;
+	vector<double> intensities() override;
+	int chooseClass() override;
+	int photons(int intensityClass) override;
+};
 IntFactory* choosePulseNumberFactory();
 
 
@@ -40,11 +97,24 @@ class IdealBasisChoiceFactory : public BoolFactory {
 public:
 	IdealBasisChoiceFactory();
 	bool operator()() override;
+	void fill(uint64_t *words, int count) override;
 };
 class AlwaysZeroOneBasisChoiceFactory : public BoolFactory {
 public:
 	AlwaysZeroOneBasisChoiceFactory();
 	bool operator()() override;
+	void fill(uint64_t *words, int count) override;
+};
+// Diagonal basis with probability p, e.g. 0.1 for efficient BB84's 90/10
+// Z/X split, which raises the sifted fraction to (1-p)^2 + p^2
+class BiasedBasisChoiceFactory : public BoolFactory {
+private:
+	double diagonalProbability;
+public:
+	BiasedBasisChoiceFactory();
+	BiasedBasisChoiceFactory(double p);
+	bool operator()() override;
+	void fill(uint64_t *words, int count) override;
 };
 BoolFactory* chooseBasisChoiceFactory();
 
@@ -61,6 +131,7 @@ class IdealAbsorptionRateFactory : public BoolFactory {
 public:
 	IdealAbsorptionRateFactory();
 	bool operator()() override;
+	int count(int trials) override;
 };
 class PercentAbsorptionRateFactory : public BoolFactory {
 	double percentAbsorbed;
@@ -68,6 +139,7 @@ public:
 	PercentAbsorptionRateFactory();
 	PercentAbsorptionRateFactory(double percent);
 	bool operator()() override;
+	int count(int trials) override;
 };
 BoolFactory* chooseAbsorptionRateFactory();
 
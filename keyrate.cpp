@@ -0,0 +1,224 @@
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#include "keyrate.h"
+
+using namespace std;
+
+
+// "a:b:c" -> {a, b, c}, nothing for ""
+static vector<double> numbers(string key, string value) {
+	vector<double> parsed;
+	stringstream stream(value);
+	string part;
+	while (getline(stream, part, ':')) {
+		try {
+			parsed.push_back(stod(part));
+		} catch (...) {
+			cout << "Expected numbers separated by ':' for " << key << endl;
+			throw -1;
+		}
+	}
+	return parsed;
+}
+static string number(double x) {
+	ostringstream stream;
+	stream << setprecision(17) << x;
+	return stream.str();
+}
+// Probability of the diagonal basis of a basis choice setting
+static double diagonalProbability(string key, string value) {
+	if (value.compare(0, 7, "biased:") == 0)
+		return parseNumber(key, value.substr(7));
+	return (value == "zeroone") ? 0 : 0.5;
+}
+
+
+LinkModel::LinkModel() {
+	attenuation = 0.2;
+	efficiency = 0.1;
+	darkProbability = 1e-5;
+	misalignment = 0.01;
+	errorCorrection = 1.16;
+	mu = 0.5;
+	nu = 0.1;
+	signalProbability = 0.8;
+	decoyProbability = 0.1;
+	finitePulses = 1e10;
+	sigmas = 5;
+	siftedFraction = 0.5;
+}
+LinkModel::LinkModel(const SimulationConfig& config) {
+	attenuation = config.number("curve.attenuation");
+	efficiency = config.number("curve.efficiency");
+	darkProbability = config.number("curve.dark_probability");
+	misalignment = config.number("curve.misalignment");
+	errorCorrection = config.number("curve.error_correction");
+	auto decoy = numbers("curve.decoy", config.get("curve.decoy"));
+	if (decoy.size() != 4 || decoy[1] <= 0 || decoy[1] >= decoy[0]
+		|| decoy[2] + decoy[3] >= 1 || decoy[2] <= 0 || decoy[3] <= 0) {
+		cout << "Expected curve.decoy = mu:nu:pmu:pnu with 0 < nu < mu and some vacuum pulses" << endl;
+		throw -1;
+	}
+	mu = decoy[0];
+	nu = decoy[1];
+	signalProbability = decoy[2];
+	decoyProbability = decoy[3];
+	finitePulses = config.number("curve.finite_pulses");
+	sigmas = config.number("curve.sigmas");
+	double alice = diagonalProbability("generator.bases", config.get("generator.bases"));
+	double bob = diagonalProbability("detector.bases", config.get("detector.bases"));
+	siftedFraction = alice*bob + (1 - alice)*(1 - bob);
+}
+double LinkModel::transmittance(double distance) const {
+	return efficiency * pow(10, -attenuation*distance/10);
+}
+SimulationConfig LinkModel::simulationConfig(const SimulationConfig& base, double distance) const {
+	SimulationConfig config = base;
+	config.set("protocol", "bb84");
+	config.set("attack", "none");
+	config.set("generator.pulses", "decoy:" + number(mu) + ":" + number(nu) + ":" + number(signalProbability)
+			   + ":" + number(decoyProbability));
+	config.set("channel.absorption", "percent:" + number(100*(1 - transmittance(distance))));
+	config.set("channel.deviation", "ideal");
+	config.set("channel.noise", "none");
+	config.set("channel.drift", "none");
+	config.set("detector.deviation", (misalignment > 0) ? "fixed:" + number(asin(sqrt(misalignment))) : "ideal");
+	config.set("detector.dark_probability", number(darkProbability));
+	return config;
+}
+
+double decoyKeyRate(const LinkModel& link, double signalGain, double signalErrors, double decoyGain,
+					double decoyErrors, double y0ForY1, double y0ForE1, double siftedFraction) {
+	return decoyBounds(link.mu, link.nu, signalGain, signalErrors, decoyGain, decoyErrors, y0ForY1, y0ForE1,
+					   siftedFraction, link.errorCorrection).rate;
+}
+
+vector<KeyRatePoint> keyRateCurve(const LinkModel& link, const vector<double>& distances) {
+	int n = distances.size();
+	double y0 = link.darkProbability, ed = link.misalignment, q = link.siftedFraction;
+	vector<double> eta(n), signalGain(n), signalErrors(n), decoyGain(n), decoyErrors(n);
+	for (int i = 0; i < n; ++i)
+		eta[i] = link.transmittance(distances[i]);
+	for (int i = 0; i < n; ++i) {
+		double arrive = 1 - exp(-eta[i]*link.mu);
+		signalGain[i] = arrive + y0*(1 - arrive);
+		signalErrors[i] = ed*arrive + y0/2*(1 - arrive);
+	}
+	for (int i = 0; i < n; ++i) {
+		double arrive = 1 - exp(-eta[i]*link.nu);
+		decoyGain[i] = arrive + y0*(1 - arrive);
+		decoyErrors[i] = ed*arrive + y0/2*(1 - arrive);
+	}
+
+	vector<KeyRatePoint> points(n);
+	for (int i = 0; i < n; ++i) {
+		KeyRatePoint& point = points[i];
+		point.distance = distances[i];
+		point.transmittance = eta[i];
+		point.signalGain = signalGain[i];
+		point.signalQber = signalErrors[i] / signalGain[i];
+		double y1 = eta[i] + y0*(1 - eta[i]);
+		double e1 = (ed*eta[i] + y0/2*(1 - eta[i])) / y1;
+		double q1 = y1 * link.mu * exp(-link.mu);
+		point.rateIdeal = max(0.0, q * (q1*(1 - binaryEntropy(e1))
+										- link.errorCorrection*signalGain[i]*binaryEntropy(point.signalQber)));
+		point.rateDecoy = decoyKeyRate(link, signalGain[i], signalErrors[i], decoyGain[i], decoyErrors[i],
+									   y0, y0, q);
+	}
+
+	// Counts of N pulses with probability x are x +/- sigmas sqrt(x/N)
+	// (Ma et al. 2005), each taken on the side that lowers the rate
+	double u = link.sigmas;
+	double signals = link.finitePulses*link.signalProbability, decoys = link.finitePulses*link.decoyProbability;
+	double vacua = link.finitePulses*(1 - link.signalProbability - link.decoyProbability);
+	for (int i = 0; i < n; ++i) {
+		if (link.finitePulses <= 0) {
+			points[i].rateFinite = points[i].rateDecoy;
+			continue;
+		}
+		double signalHigh = signalGain[i] + u*sqrt(signalGain[i]/signals);
+		double decoyLow = max(0.0, decoyGain[i] - u*sqrt(decoyGain[i]/decoys));
+		double errorsHigh = decoyErrors[i] + u*sqrt(decoyErrors[i]/decoys);
+		double y0High = y0 + u*sqrt(y0/vacua), y0Low = max(0.0, y0 - u*sqrt(y0/vacua));
+		points[i].rateFinite = decoyKeyRate(link, signalHigh, signalHigh*points[i].signalQber, decoyLow, errorsHigh,
+											y0High, y0Low, q);
+	}
+	return points;
+}
+
+KeyRateCheck checkKeyRate(const SimulationConfig& config, const LinkModel& link, const KeyRatePoint& expected) {
+	SimulationConfig linkConfig = link.simulationConfig(config, expected.distance);
+	auto input = linkConfig.buildInput();
+	input.keepStrings = false;
+	auto generator = linkConfig.buildGenerator();
+	auto channel = linkConfig.buildChannel();
+	auto detector = linkConfig.buildDetector();
+	auto result = runSimulation(generator, channel, nullptr, detector, input);
+
+	KeyRateCheck check;
+	check.expected = expected;
+	check.signalGain = result.classGain[0];
+	check.signalQber = result.classQber[0];
+	// The measured classes at the curve's error correction efficiency
+	check.rate = estimateDecoy(result, link.errorCorrection).rate;
+	double z = zForConfidence(input.confidence);
+	auto gain = check.signalGain.wilson(z), qber = check.signalQber.wilson(z);
+	check.agrees = gain.first <= expected.signalGain && expected.signalGain <= gain.second
+				   && qber.first <= expected.signalQber && expected.signalQber <= qber.second;
+	return check;
+}
+
+int runKeyRateCurve(const SimulationConfig& config) {
+	LinkModel link(config);
+	auto grid = numbers("curve.distances", config.get("curve.distances"));
+	if (grid.size() != 3 || grid[2] <= 0 || grid[1] < grid[0]) {
+		cout << "Expected curve.distances = start:stop:step in km" << endl;
+		throw -1;
+	}
+	vector<double> distances;
+	for (long long i = 0; grid[0] + i*grid[2] <= grid[1] + 1e-9; ++i)
+		distances.push_back(grid[0] + i*grid[2]);
+
+	auto start = chrono::steady_clock::now();
+	auto points = keyRateCurve(link, distances);
+	double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	cout << "Key rate per signal pulse (" << distances.size() << " distances in " << elapsed*1000 << " ms):" << endl;
+	cout << "\tkm\tloss dB\tgain\tQBER\tideal\tdecoy\tfinite (N = " << link.finitePulses << ")" << endl;
+	for (auto& point : points) {
+		cout << "\t" << point.distance << "\t" << -10*log10(point.transmittance) << "\t" << point.signalGain
+			 << "\t" << point.signalQber << "\t" << point.rateIdeal << "\t" << point.rateDecoy
+			 << "\t" << point.rateFinite << endl;
+	}
+	double lastDecoy = 0;
+	for (auto& point : points) {
+		if (point.rateDecoy > 0)
+			lastDecoy = point.distance;
+	}
+	cout << "Decoy key up to " << lastDecoy << " km" << endl;
+
+	auto checks = numbers("curve.check", config.get("curve.check"));
+	if (checks.empty())
+		return 0;
+	cout << "Monte Carlo checks (" << config.get("pulses") << " pulses each):" << endl;
+	double z = zForConfidence(config.number("confidence"));
+	for (double distance : checks) {
+		auto expected = keyRateCurve(link, {distance})[0];
+		auto check = checkKeyRate(config, link, expected);
+		auto gain = check.signalGain.wilson(z), qber = check.signalQber.wilson(z);
+		cout << "\t" << distance << " km: gain " << check.signalGain.value() << " [" << gain.first << ", "
+			 << gain.second << "] expected " << expected.signalGain << ", QBER " << check.signalQber.value()
+			 << " [" << qber.first << ", " << qber.second << "] expected " << expected.signalQber << endl;
+		cout << "\t\tdecoy rate " << check.rate << " expected " << expected.rateDecoy;
+		if (expected.rateDecoy > 0)
+			cout << " (" << (check.rate/expected.rateDecoy - 1)*100 << "%)";
+		cout << ", " << (check.agrees ? "agrees" : "DISAGREES") << endl;
+	}
+	return 0;
+}
@@ -0,0 +1,91 @@
+#ifndef _KEYRATE_H_
+#define _KEYRATE_H_
+
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "simulation.h"
+#include "statistics.h"
+
+using namespace std;
+
+// Decoy state BB84 over fiber, the standard model of key rate curves
+// (Ma, Qi, Zhao, Lo 2005). A pulse of intensity lambda reaches a click
+// with probability eta = efficiency * 10^(-attenuation L/10) per photon,
+// the detector clicks in the dark with probability Y0 when nothing
+// arrives, and a signal click is wrong with probability e_d:
+//	Q_lambda   = 1 - (1 - Y0) e^(-eta lambda)
+//	E Q_lambda = e_d (1 - e^(-eta lambda)) + Y0/2 e^(-eta lambda)
+// which is what the simulation does with channel.absorption = percent of
+// 1 - eta, detector.deviation = fixed:asin(sqrt(e_d)) and
+// detector.dark_probability = Y0.
+struct LinkModel {
+	// dB/km
+	double attenuation;
+	// Detector (and Bob's optics) transmittance
+	double efficiency;
+	double darkProbability;
+	double misalignment;
+	// Error correction leaks f h(E) bits per sifted bit
+	double errorCorrection;
+	// Decoy source, as DecoyPulseNumberFactory
+	double mu;
+	double nu;
+	double signalProbability;
+	double decoyProbability;
+	// Pulses sent for the finite key rate and the standard deviations of
+	// the statistical fluctuation allowed for each class's counts
+	double finitePulses;
+	double sigmas;
+	// Fraction of detections whose bases match
+	double siftedFraction;
+
+	LinkModel();
+	// From the curve.* keys of a config
+	LinkModel(const SimulationConfig& config);
+	double transmittance(double distance) const;
+	// Settings of a simulation of this link at distance km, on top of base
+	SimulationConfig simulationConfig(const SimulationConfig& base, double distance) const;
+};
+
+// Key rates are secret bits per signal pulse, as estimateDecoy's
+struct KeyRatePoint {
+	double distance;
+	double transmittance;
+	double signalGain;
+	double signalQber;
+	// Y1 and e1 known exactly (infinitely many decoys)
+	double rateIdeal;
+	// Vacuum + weak decoy bounds from the expected gains
+	double rateDecoy;
+	// The same bounds from gains sigmas standard deviations off, for
+	// finitePulses pulses in all
+	double rateFinite;
+};
+
+// Every quantity is worked out over the whole grid before the next one, so
+// a curve of thousands of distances takes milliseconds
+vector<KeyRatePoint> keyRateCurve(const LinkModel& link, const vector<double>& distances);
+
+// decoyBounds' rate at the link's intensities and error correction
+double decoyKeyRate(const LinkModel& link, double signalGain, double signalErrors, double decoyGain,
+					double decoyErrors, double y0ForY1, double y0ForE1, double siftedFraction);
+
+// A point of the curve next to a Monte Carlo run of the link there
+struct KeyRateCheck {
+	KeyRatePoint expected;
+	ProportionStat signalGain;
+	ProportionStat signalQber;
+	// estimateDecoy's rate of the measured classes, with the link's f
+	double rate;
+	// Whether the expected signal gain and QBER lie in the run's intervals
+	bool agrees;
+};
+KeyRateCheck checkKeyRate(const SimulationConfig& config, const LinkModel& link, const KeyRatePoint& expected);
+
+// curve.distances = start:stop:step (km) is evaluated analytically and each
+// distance of curve.check = d1:d2:... is also simulated with pulses pulses
+int runKeyRateCurve(const SimulationConfig& config);
+
+#endif
@@ -0,0 +1,478 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <new>
+#include <cstring>
+#include <cstdlib>
+#include <csignal>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "kms.h"
+#include "simulation.h"
+#include "postprocessing.h"
+#include "rng.h"
+
+using namespace std;
+
+
+static const uint32_t KEY_BUFFER_MAGIC = 0x514B4D53;
+// How long the producer waits on a delivered key before expiring it
+static const int KEY_LIFETIME_MS = 1000;
+
+KeyBuffer::KeyBuffer(uint64_t capacity, int keyBytes, string name) {
+	// With fewer slots key n + capacity's free state would read as key
+	// n being ready or delivered
+	if (capacity < 3 || keyBytes <= 0) {
+		cout << "Key buffer needs a capacity of at least 3 and a key size" << endl;
+		throw -1;
+	}
+	shmName = name;
+	// Slots on their own cache lines so consumers of neighbouring keys do
+	// not contend
+	uint64_t slotBytes = (sizeof(atomic<uint64_t>) + keyBytes + 63) / 64 * 64;
+	size_t headerBytes = (sizeof(KeyBufferHeader) + 63) / 64 * 64;
+	regionBytes = headerBytes + capacity * slotBytes;
+
+	void *memory;
+	if (shmName.empty()) {
+		memory = mmap(NULL, regionBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	} else {
+		int fd = shm_open(shmName.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600);
+		if (fd < 0 || ftruncate(fd, regionBytes) != 0) {
+			cout << "Could not create shared memory " << shmName << endl;
+			throw -1;
+		}
+		memory = mmap(NULL, regionBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+	}
+	if (memory == MAP_FAILED) {
+		cout << "Could not map the key buffer" << endl;
+		throw -1;
+	}
+	region = (char*) memory;
+	header = new (region) KeyBufferHeader();
+	header->magic = KEY_BUFFER_MAGIC;
+	header->keyBytes = keyBytes;
+	header->capacity = capacity;
+	header->slotBytes = slotBytes;
+	header->produced.store(0);
+	header->claimed.store(0);
+	header->fetched.store(0);
+	for (uint64_t id = 0; id < capacity; ++id) {
+		new (region + offset(id) - sizeof(atomic<uint64_t>)) atomic<uint64_t>(id);
+	}
+}
+KeyBuffer::~KeyBuffer() {
+	munmap(region, regionBytes);
+	if (!shmName.empty())
+		shm_unlink(shmName.c_str());
+}
+atomic<uint64_t>& KeyBuffer::sequence(uint64_t id) const {
+	return *(atomic<uint64_t>*) (region + offset(id) - sizeof(atomic<uint64_t>));
+}
+int KeyBuffer::keyBytes() const {
+	return header->keyBytes;
+}
+uint64_t KeyBuffer::capacity() const {
+	return header->capacity;
+}
+uint64_t KeyBuffer::stored() const {
+	return header->produced.load() - header->claimed.load();
+}
+const KeyBufferHeader& KeyBuffer::counters() const {
+	return *header;
+}
+size_t KeyBuffer::offset(uint64_t id) const {
+	size_t headerBytes = (sizeof(KeyBufferHeader) + 63) / 64 * 64;
+	return headerBytes + (id % header->capacity) * header->slotBytes + sizeof(atomic<uint64_t>);
+}
+const uint8_t* KeyBuffer::key(uint64_t id) const {
+	return (const uint8_t*) (region + offset(id));
+}
+
+bool KeyBuffer::push(const uint8_t *key) {
+	uint64_t id = header->produced.load(memory_order_relaxed);
+	auto& seq = sequence(id);
+	if (seq.load(memory_order_acquire) != id)
+		return false;
+	memcpy(region + offset(id), key, header->keyBytes);
+	seq.store(id + 1, memory_order_release);
+	header->produced.store(id + 1, memory_order_release);
+	return true;
+}
+bool KeyBuffer::expire() {
+	uint64_t id = header->produced.load(memory_order_relaxed);
+	if (id < header->capacity)
+		return false;
+	uint64_t delivered = id - header->capacity + 2;
+	return sequence(id).compare_exchange_strong(delivered, id, memory_order_acq_rel);
+}
+bool KeyBuffer::claim(int count, uint64_t& firstId) {
+	if (count <= 0)
+		return false;
+	uint64_t first = header->claimed.load(memory_order_relaxed);
+	while (true) {
+		// The producer publishes in order, so the last key being ready
+		// means all of them are
+		uint64_t last = first + count - 1;
+		if (sequence(last).load(memory_order_acquire) != last + 1)
+			return false;
+		if (header->claimed.compare_exchange_weak(first, first + count, memory_order_acq_rel))
+			break;
+	}
+	for (uint64_t id = first; id < first + count; ++id) {
+		sequence(id).store(id + 2, memory_order_release);
+	}
+	firstId = first;
+	return true;
+}
+bool KeyBuffer::delivered(uint64_t id) const {
+	return sequence(id).load(memory_order_acquire) == id + 2;
+}
+bool KeyBuffer::fetch(uint64_t id, uint8_t *out) {
+	auto& seq = sequence(id);
+	uint64_t delivered = id + 2;
+	if (seq.load(memory_order_acquire) != delivered)
+		return false;
+	// Nobody writes a delivered slot, so the copy is good if we are the
+	// one that frees it
+	memcpy(out, region + offset(id), header->keyBytes);
+	if (!seq.compare_exchange_strong(delivered, id + header->capacity, memory_order_acq_rel))
+		return false;
+	header->fetched.fetch_add(1, memory_order_relaxed);
+	return true;
+}
+
+
+static string base64(const uint8_t *data, int length) {
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	string encoded;
+	for (int i = 0; i < length; i += 3) {
+		uint32_t chunk = data[i] << 16;
+		if (i+1 < length) chunk |= data[i+1] << 8;
+		if (i+2 < length) chunk |= data[i+2];
+		encoded += alphabet[(chunk >> 18) & 63];
+		encoded += alphabet[(chunk >> 12) & 63];
+		encoded += (i+1 < length) ? alphabet[(chunk >> 6) & 63] : '=';
+		encoded += (i+2 < length) ? alphabet[chunk & 63] : '=';
+	}
+	return encoded;
+}
+
+// Buffered line reads and whole writes on a socket
+class LineSocket {
+private:
+	int fd;
+	string pending;
+public:
+	LineSocket(int _fd) : fd(_fd) {}
+	bool readLine(string& line) {
+		size_t newline;
+		while ((newline = pending.find('\n')) == string::npos) {
+			char chunk[4096];
+			ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+			if (n <= 0)
+				return false;
+			pending.append(chunk, n);
+		}
+		line = pending.substr(0, newline);
+		pending.erase(0, newline + 1);
+		return true;
+	}
+	bool writeLine(const string& line) {
+		string data = line + "\n";
+		for (size_t sent = 0; sent < data.size(); ) {
+			ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+			if (n <= 0)
+				return false;
+			sent += n;
+		}
+		return true;
+	}
+};
+
+static string handleRequest(KeyBuffer& buffer, const string& request, const string& shmName, bool finalKeys) {
+	stringstream tokens(request);
+	string command, argument;
+	tokens >> command;
+	if (command == "GET_KEY") {
+		long long number = 1;
+		bool inPlace = false;
+		while (tokens >> argument) {
+			if (argument.compare(0, 7, "number=") == 0) {
+				char *end;
+				number = strtoll(argument.c_str() + 7, &end, 10);
+				if (end == argument.c_str() + 7 || *end != '\0')
+					number = 0;
+			} else if (argument == "shm") {
+				inPlace = true;
+			}
+		}
+		// More keys than the buffer holds could never be claimed
+		if (number < 1 || (uint64_t) number > buffer.capacity())
+			return "{\"message\":\"number must be 1 to " + to_string(buffer.capacity()) + "\"}";
+		if (inPlace && shmName.empty())
+			return "{\"message\":\"no shared memory region\"}";
+		uint64_t first;
+		if (!buffer.claim(number, first))
+			return "{\"message\":\"not enough keys\"}";
+		string reply = "{\"keys\":[";
+		for (uint64_t id = first; id < first + number; ++id) {
+			reply += (id > first ? "," : "");
+			reply += "{\"key_ID\":\"" + to_string(id) + "\",";
+			if (inPlace) {
+				reply += "\"offset\":" + to_string(buffer.offset(id)) + "}";
+			} else {
+				reply += "\"key\":\"" + base64(buffer.key(id), buffer.keyBytes()) + "\"}";
+			}
+		}
+		return reply + "]}";
+	}
+	if (command == "GET_KEY_WITH_IDS") {
+		vector<string> ids;
+		while (tokens >> argument) {
+			ids.push_back(argument);
+		}
+		// Fetching consumes a key, so none is fetched unless all of them
+		// are there
+		for (auto& id : ids) {
+			if (!buffer.delivered(strtoull(id.c_str(), NULL, 10)))
+				return "{\"message\":\"key " + id + " is not available\"}";
+		}
+		string reply = "{\"keys\":[", lost;
+		vector<uint8_t> key(buffer.keyBytes());
+		bool first = true;
+		for (auto& id : ids) {
+			// Another client or the producer can still take a key since the
+			// check; the keys already fetched are returned all the same
+			if (!buffer.fetch(strtoull(id.c_str(), NULL, 10), key.data())) {
+				lost += (lost.empty() ? "" : " ") + id;
+				continue;
+			}
+			reply += (first ? "" : ",");
+			reply += "{\"key_ID\":\"" + id + "\",\"key\":\"" + base64(key.data(), key.size()) + "\"}";
+			first = false;
+		}
+		reply += "]";
+		if (!lost.empty())
+			reply += ",\"message\":\"not available: " + lost + "\"";
+		return reply + "}";
+	}
+	if (command == "STATUS") {
+		auto& counters = buffer.counters();
+		return "{\"key_size\":" + to_string(buffer.keyBytes()*8) +
+			   ",\"stored_key_count\":" + to_string(buffer.stored()) +
+			   ",\"max_key_count\":" + to_string(buffer.capacity()) +
+			   ",\"produced\":" + to_string(counters.produced.load()) +
+			   ",\"delivered\":" + to_string(counters.claimed.load()) +
+			   ",\"fetched\":" + to_string(counters.fetched.load()) +
+			   ",\"key_source\":\"" + (finalKeys ? "final" : "raw sifted") + "\"" +
+			   ",\"shm\":\"" + shmName + "\"}";
+	}
+	return "{\"message\":\"unknown request\"}";
+}
+
+static void produceKeys(const SimulationConfig& config, KeyBuffer& buffer) {
+	auto generator = config.buildGenerator();
+	auto channel = config.buildChannel();
+	auto detector = config.buildDetector();
+	auto attack = config.buildAttack();
+	auto input = config.buildInput();
+	input.keepStrings = false;
+	uint64_t seedState = input.seed;
+	int keyBits = buffer.keyBytes() * 8;
+	vector<uint8_t> key(buffer.keyBytes());
+
+	while (true) {
+		input.seed = splitmix64(seedState);
+		// Each round has its own classical channel, so its tags are paid
+		// from its own key
+		if (input.classicalChannel != nullptr) {
+			delete input.classicalChannel;
+			input.classicalChannel = buildClassicalChannel("classical", config.get("classical"));
+		}
+		input.postProcessor = config.buildPostProcessor(input);
+		auto result = runSimulation(generator, channel, attack, detector, input);
+		// Without postprocess.* the keys are Alice's raw sifted bits, cut to
+		// the secret key length but neither reconciled nor amplified
+		PackedBits secret = result.aliceKey;
+		if (input.postProcessor != nullptr) {
+			secret = input.postProcessor->finalKey;
+			delete input.postProcessor;
+		} else {
+			secret.truncate(secretKeyLength(result));
+		}
+		for (long long first = 0; first + keyBits <= secret.size; first += keyBits) {
+			for (int b = 0; b < buffer.keyBytes(); ++b) {
+				uint8_t byte = 0;
+				for (int i = 0; i < 8; ++i) {
+					byte |= secret.get(first + 8*b + i) << i;
+				}
+				key[b] = byte;
+			}
+			for (int waited = 0; !buffer.push(key.data()); ++waited) {
+				if (waited >= KEY_LIFETIME_MS)
+					buffer.expire();
+				this_thread::sleep_for(chrono::milliseconds(1));
+			}
+		}
+	}
+}
+
+static int connectSocket(string path) {
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (sockaddr*) &address, sizeof(address)) != 0) {
+		cout << "Could not connect to " << path << endl;
+		throw -1;
+	}
+	return fd;
+}
+
+// Names to clean up when the service is stopped
+static char stopSocketPath[108], stopShmName[256];
+
+static void stopService(int) {
+	unlink(stopSocketPath);
+	if (stopShmName[0])
+		shm_unlink(stopShmName);
+	_exit(0);
+}
+
+int runKeyManagementService(const SimulationConfig& config, string socketPath, string shmName,
+							int keyBits, uint64_t capacity) {
+	if (keyBits <= 0 || keyBits % 8 != 0) {
+		cout << "Key size must be a positive number of bytes" << endl;
+		throw -1;
+	}
+	KeyBuffer buffer(capacity, keyBits / 8, shmName);
+	bool finalKeys = config.integer("postprocess.block_bits") > 0;
+
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+	unlink(socketPath.c_str());
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0 || bind(listener, (sockaddr*) &address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+		cout << "Could not listen on " << socketPath << endl;
+		throw -1;
+	}
+
+	strncpy(stopSocketPath, socketPath.c_str(), sizeof(stopSocketPath) - 1);
+	strncpy(stopShmName, shmName.c_str(), sizeof(stopShmName) - 1);
+	signal(SIGINT, stopService);
+	signal(SIGTERM, stopService);
+
+	thread(produceKeys, cref(config), ref(buffer)).detach();
+	cout << "Serving keys on " << socketPath << endl;
+	while (true) {
+		int client = accept(listener, NULL, NULL);
+		if (client < 0)
+			continue;
+		thread([&buffer, client, shmName, finalKeys]() {
+			LineSocket connection(client);
+			string request;
+			while (connection.readLine(request)) {
+				if (!connection.writeLine(handleRequest(buffer, request, shmName, finalKeys)))
+					break;
+			}
+			close(client);
+		}).detach();
+	}
+	return 0;
+}
+
+static vector<string> fieldValues(const string& reply, string field) {
+	vector<string> values;
+	string marker = "\"" + field + "\":\"";
+	for (size_t at = reply.find(marker); at != string::npos; at = reply.find(marker, at)) {
+		at += marker.size();
+		values.push_back(reply.substr(at, reply.find('"', at) - at));
+	}
+	return values;
+}
+
+int runKeyManagementBenchmark(string socketPath, int clients, int requests, int batch) {
+	vector<vector<double> > latencies(clients);
+	vector<long long> mismatches(clients, 0);
+	atomic<bool> failed(false);
+	mutex failedLock;
+	string failedReply;
+	auto start = chrono::steady_clock::now();
+	vector<thread> threads;
+	for (int c = 0; c < clients; ++c) {
+		threads.push_back(thread([&, c]() {
+			LineSocket connection(connectSocket(socketPath));
+			string reply;
+			for (int r = 0; r < requests && !failed; ++r) {
+				auto begin = chrono::steady_clock::now();
+				// Master SAE: wait for enough keys, giving up on any other
+				// reply (e.g. a batch larger than the buffer)
+				while (true) {
+					connection.writeLine("GET_KEY number=" + to_string(batch));
+					if (!connection.readLine(reply) || (reply.find("\"keys\"") == string::npos
+														&& reply.find("not enough keys") == string::npos)) {
+						lock_guard<mutex> guard(failedLock);
+						if (!failed)
+							failedReply = reply;
+						failed = true;
+						return;
+					}
+					if (reply.find("\"keys\"") != string::npos)
+						break;
+					this_thread::sleep_for(chrono::microseconds(100));
+				}
+				auto ids = fieldValues(reply, "key_ID");
+				auto keys = fieldValues(reply, "key");
+				// Slave SAE: the same keys by id
+				string request = "GET_KEY_WITH_IDS";
+				for (auto& id : ids) {
+					request += " " + id;
+				}
+				connection.writeLine(request);
+				connection.readLine(reply);
+				if (fieldValues(reply, "key") != keys)
+					mismatches[c]++;
+				latencies[c].push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - begin).count());
+			}
+		}));
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	if (failed) {
+		cout << "Key requests failed: " << (failedReply.empty() ? "connection closed" : failedReply) << endl;
+		return 1;
+	}
+
+	vector<double> all;
+	long long mismatched = 0;
+	for (int c = 0; c < clients; ++c) {
+		all.insert(all.end(), latencies[c].begin(), latencies[c].end());
+		mismatched += mismatches[c];
+	}
+	sort(all.begin(), all.end());
+	if (all.empty())
+		return 0;
+	cout << "Round trips: " << all.size() << " of " << batch << " keys from " << clients << " clients" << endl;
+	cout << "Latency (us): p50 " << all[all.size()/2] << ", p99 " << all[all.size()*99/100]
+		 << ", max " << all.back() << endl;
+	cout << "Throughput: " << all.size() * batch / seconds << " keys/s" << endl;
+	cout << "Master/slave key mismatches: " << mismatched << endl;
+	return mismatched > 0;
+}
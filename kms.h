@@ -0,0 +1,98 @@
+#ifndef _KMS_H_
+#define _KMS_H_
+
+#include <atomic>
+#include <string>
+#include <cstdint>
+
+#include "config.h"
+
+using namespace std;
+
+// Lives at the start of the key buffer's memory region
+struct KeyBufferHeader {
+	uint32_t magic;
+	uint32_t keyBytes;
+	uint64_t capacity;
+	uint64_t slotBytes;
+	atomic<uint64_t> produced;
+	atomic<uint64_t> claimed;
+	atomic<uint64_t> fetched;
+};
+
+// Bounded buffer of fixed size keys with one producer and any number of
+// consumers, none of which take a lock. Key id n lives in slot n % capacity
+// whose sequence number tells where the key is in its life:
+//
+//	n			free, the producer may write key n
+//	n + 1		ready, get_key may hand it to the master SAE
+//	n + 2		delivered, waiting for the slave SAE to fetch it by id
+//	n + capacity	fetched, free for key n + capacity
+//
+// A delivered key the slave SAE never fetches would stall the producer at
+// its slot, so the producer expires it after waiting there for a while.
+//
+// The region can be a named POSIX shared memory object, so local clients
+// map it and read delivered keys in place (KeyBuffer::offset) instead of
+// having them copied through the socket.
+class KeyBuffer {
+private:
+	char *region;
+	size_t regionBytes;
+	string shmName;
+	KeyBufferHeader *header;
+	atomic<uint64_t>& sequence(uint64_t id) const;
+public:
+	// shmName "" keeps the buffer private to this process
+	KeyBuffer(uint64_t capacity, int keyBytes, string shmName);
+	KeyBuffer(const KeyBuffer&) = delete;
+	KeyBuffer& operator=(const KeyBuffer&) = delete;
+	~KeyBuffer();
+
+	int keyBytes() const;
+	uint64_t capacity() const;
+	uint64_t stored() const;
+	const KeyBufferHeader& counters() const;
+
+	// Producer only: false while the slot for the next key is still in use
+	bool push(const uint8_t *key);
+	// Producer only: frees the slot the next key needs if it holds a
+	// delivered key, which can then no longer be fetched
+	bool expire();
+	// Hands out count consecutive ready keys, false if fewer are ready
+	bool claim(int count, uint64_t& firstId);
+	// Key bytes of a delivered key, valid until it is fetched or expires
+	const uint8_t* key(uint64_t id) const;
+	size_t offset(uint64_t id) const;
+	// Whether id is waiting to be fetched
+	bool delivered(uint64_t id) const;
+	// Copies out a delivered key and frees its slot, false if id is not
+	// waiting to be fetched
+	bool fetch(uint64_t id, uint8_t *out);
+};
+
+// Long lived key producer: simulates the configured link round after round
+// (each from the next seed), cuts every round's key into keys and serves
+// them on a Unix domain socket until killed. The key is the post-processed
+// final key when postprocess.block_bits is set, and otherwise Alice's raw
+// sifted bits cut to the secret key length (not error corrected or privacy
+// amplified, so Bob's copy still differs at the QBER). One request or reply
+// per line:
+//
+//	GET_KEY number=N [shm]		{"keys":[{"key_ID":"17","key":"<base64>"},...]}
+//						shm: "offset":<byte offset> instead of "key"
+//						N from 1 to the buffer's capacity
+//	GET_KEY_WITH_IDS id id ...	{"keys":[...]} for delivered keys, none
+//						fetched unless all are delivered
+//	STATUS				{"key_size":...,"stored_key_count":...,
+//						"key_source":"final"|"raw sifted",...}
+//
+// and {"message":"..."} for errors.
+int runKeyManagementService(const SimulationConfig& config, string socketPath, string shmName,
+							int keyBits, uint64_t capacity);
+// Load generator: clients concurrent connections each making requests
+// GET_KEY + GET_KEY_WITH_IDS round trips of batch keys; prints latency
+// percentiles and key throughput
+int runKeyManagementBenchmark(string socketPath, int clients, int requests, int batch);
+
+#endif
@@ -0,0 +1,115 @@
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "logging.h"
+
+using namespace std;
+
+long long PulseTrace::stride = 0;
+int PulseTrace::reservoirSize = 0;
+thread_local bool PulseTrace::tracing = false;
+thread_local ostringstream* PulseTrace::buffer = nullptr;
+
+static mutex traceMutex;
+static mt19937_64 reservoirGen;
+static long long candidatesSeen = 0;
+static vector<pair<long long, string> > reservoir;
+// The current block's chosen pulses, their reservoir slots and traces
+static thread_local vector<long long> chosen;
+static thread_local vector<int> slots;
+static thread_local vector<unique_ptr<ostringstream> > traces;
+
+void PulseTrace::configure(long long everyNth, int reservoir_) {
+	lock_guard<mutex> lock(traceMutex);
+	stride = everyNth;
+	reservoirSize = reservoir_;
+	candidatesSeen = 0;
+	reservoir.clear();
+}
+bool PulseTrace::enabled() {
+	return LogPolicy<LOG_LEVEL_TRACE>::compiled && stride > 0;
+}
+
+bool PulseTrace::choose(long long pulseIndex, int& slot) {
+	slot = -1;
+	if (stride <= 0 || pulseIndex % stride != 0)
+		return false;
+	if (reservoirSize <= 0)
+		return true;
+
+	lock_guard<mutex> lock(traceMutex);
+	candidatesSeen++;
+	if (candidatesSeen <= reservoirSize) {
+		slot = candidatesSeen-1;
+	} else {
+		long long j = uniform_int_distribution<long long>(0, candidatesSeen-1)(reservoirGen);
+		if (j >= reservoirSize)
+			return false;
+		slot = j;
+	}
+	// Claimed now, so a pulse chosen later into the same slot wins even if
+	// its block is committed first
+	if (slot >= (int) reservoir.size())
+		reservoir.resize(slot+1);
+	reservoir[slot] = make_pair(pulseIndex, string());
+	return true;
+}
+void PulseTrace::commit(long long pulseIndex, int slot, const string& text) {
+	lock_guard<mutex> lock(traceMutex);
+	if (reservoirSize <= 0) {
+		cout << "Pulse #" << pulseIndex << ":" << endl << text;
+		return;
+	}
+	if (reservoir[slot].first == pulseIndex)
+		reservoir[slot].second = text;
+}
+
+void PulseTrace::beginBlock(long long firstPulse, int count) {
+	tracing = false;
+	chosen.clear();
+	slots.clear();
+	if (stride <= 0)
+		return;
+	for (long long p = (firstPulse + stride-1) / stride * stride; p < firstPulse + count; p += stride) {
+		int slot;
+		if (!choose(p, slot))
+			continue;
+		if (chosen.size() == traces.size())
+			traces.push_back(unique_ptr<ostringstream>(new ostringstream()));
+		traces[chosen.size()]->str("");
+		chosen.push_back(p);
+		slots.push_back(slot);
+	}
+}
+void PulseTrace::select(long long pulseIndex) {
+	tracing = false;
+	if (chosen.empty())
+		return;
+	auto it = lower_bound(chosen.begin(), chosen.end(), pulseIndex);
+	if (it != chosen.end() && *it == pulseIndex) {
+		tracing = true;
+		buffer = traces[it - chosen.begin()].get();
+	}
+}
+void PulseTrace::endBlock() {
+	tracing = false;
+	for (size_t k = 0; k < chosen.size(); ++k) {
+		commit(chosen[k], slots[k], traces[k]->str());
+	}
+	chosen.clear();
+}
+void PulseTrace::flush(ostream& out) {
+	lock_guard<mutex> lock(traceMutex);
+	sort(reservoir.begin(), reservoir.end());
+	for (auto& entry : reservoir) {
+		out << "Pulse #" << entry.first << ":" << endl << entry.second;
+	}
+	reservoir.clear();
+	candidatesSeen = 0;
+}
@@ -0,0 +1,82 @@
+#ifndef _LOGGING_H_
+#define _LOGGING_H_
+
+#include <iostream>
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+// Log levels are fixed at compile time with -DQKDSIM_LOG_LEVEL=<n>. Builds
+// with NDEBUG default to LOG_LEVEL_OFF, which removes every LOG/TRACE site
+// from the hot path; other builds keep per-pulse tracing available behind
+// the runtime sampler below.
+#define LOG_LEVEL_OFF	(0)
+#define LOG_LEVEL_INFO	(1)
+#define LOG_LEVEL_DEBUG	(2)
+#define LOG_LEVEL_TRACE	(3)
+
+#ifndef QKDSIM_LOG_LEVEL
+#ifdef NDEBUG
+#define QKDSIM_LOG_LEVEL LOG_LEVEL_OFF
+#else
+#define QKDSIM_LOG_LEVEL LOG_LEVEL_TRACE
+#endif
+#endif
+
+template <int level>
+struct LogPolicy {
+	static constexpr bool compiled = (level != LOG_LEVEL_OFF && level <= QKDSIM_LOG_LEVEL);
+};
+
+// Chooses which pulses get traced. With a stride of N every N-th pulse is
+// traced and printed straight away; with a reservoir of size K a uniform
+// sample of K pulses is kept (Algorithm R) and printed by flush().
+//
+// Pulses go through each stage a block at a time, so the sample is taken
+// per block: beginBlock opens a trace for every chosen pulse of the block,
+// each stage's per-pulse loop selects the pulse it is working on (TRACE
+// only writes while that is a chosen one), and endBlock prints or keeps
+// the block's traces in pulse order.
+class PulseTrace {
+private:
+	static long long stride;
+	static int reservoirSize;
+	static thread_local bool tracing;
+	static thread_local ostringstream *buffer;
+	static bool choose(long long pulseIndex, int& slot);
+	static void commit(long long pulseIndex, int slot, const string& text);
+public:
+	static void configure(long long everyNth, int reservoir);
+	static bool enabled();
+
+	static void beginBlock(long long firstPulse, int count);
+	static void select(long long pulseIndex);
+	static void endBlock();
+	static void flush(ostream& out);
+
+	static inline bool active() { return tracing; }
+	static inline ostream& stream() { return *buffer; }
+};
+
+#define LOG(level, expr) do { \
+	if (LogPolicy<level>::compiled) { cout << expr << endl; } \
+} while (0)
+
+#define TRACE(expr) do { \
+	if (LogPolicy<LOG_LEVEL_TRACE>::compiled && PulseTrace::active()) { PulseTrace::stream() << expr << "\n"; } \
+} while (0)
+
+#define TRACE_BLOCK_BEGIN(firstPulse, count) do { \
+	if (LogPolicy<LOG_LEVEL_TRACE>::compiled) { PulseTrace::beginBlock(firstPulse, count); } \
+} while (0)
+
+#define TRACE_PULSE(pulseIndex) do { \
+	if (LogPolicy<LOG_LEVEL_TRACE>::compiled) { PulseTrace::select(pulseIndex); } \
+} while (0)
+
+#define TRACE_BLOCK_END() do { \
+	if (LogPolicy<LOG_LEVEL_TRACE>::compiled) { PulseTrace::endBlock(); } \
+} while (0)
+
+#endif
@@ -0,0 +1,141 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <new>
+#include <cstdlib>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "metrics.h"
+
+using namespace std;
+
+static const char* counterNames[METRIC_COUNTER_COUNT] = {
+	"pulses_generated",
+	"photons_absorbed",
+	"detections",
+	"multiphoton_pulses"
+};
+
+static const char* stageNames[METRIC_STAGE_COUNT] = {
+	"generate",
+	"propagate",
+	"detect"
+};
+
+atomic<ThreadMetrics*> Metrics::head(nullptr);
+atomic<long long> Metrics::dumpInterval(0);
+static atomic<long long> lastDumped(0);
+static atomic<uint64_t> heapAllocations(0);
+
+#ifdef QKDSIM_METRICS
+// Counts every heap allocation so the steady state hot path can be checked
+// to allocate nothing per pulse (compare with pulses_generated).
+void* operator new(size_t size) {
+	heapAllocations.fetch_add(1, memory_order_relaxed);
+	void *memory = malloc(size ? size : 1);
+	if (memory == nullptr)
+		throw bad_alloc();
+	return memory;
+}
+void operator delete(void *memory) noexcept {
+	free(memory);
+}
+void operator delete(void *memory, size_t) noexcept {
+	free(memory);
+}
+#endif
+
+ThreadMetrics::ThreadMetrics() {
+	for (auto& c : counters) c.store(0, memory_order_relaxed);
+	for (auto& c : stageCycles) c.store(0, memory_order_relaxed);
+	for (auto& c : stageCalls) c.store(0, memory_order_relaxed);
+	for (auto& c : photonHistogram) c.store(0, memory_order_relaxed);
+	next = nullptr;
+}
+
+ThreadMetrics* Metrics::registerThread() {
+	// Blocks are never freed so that counts from finished threads still
+	// show up in the totals; pushing onto the list is a single CAS.
+	auto block = new ThreadMetrics();
+	ThreadMetrics *oldHead = head.load(memory_order_relaxed);
+	do {
+		block->next = oldHead;
+	} while (!head.compare_exchange_weak(oldHead, block, memory_order_release, memory_order_relaxed));
+	return block;
+}
+
+uint64_t Metrics::readCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return chrono::duration_cast<chrono::nanoseconds>(
+		chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+void Metrics::reset() {
+	lastDumped.store(0, memory_order_relaxed);
+	heapAllocations.store(0, memory_order_relaxed);
+	for (auto block = head.load(memory_order_acquire); block != nullptr; block = block->next) {
+		for (auto& c : block->counters) c.store(0, memory_order_relaxed);
+		for (auto& c : block->stageCycles) c.store(0, memory_order_relaxed);
+		for (auto& c : block->stageCalls) c.store(0, memory_order_relaxed);
+		for (auto& c : block->photonHistogram) c.store(0, memory_order_relaxed);
+	}
+}
+
+void Metrics::dumpJSON(ostream& out) {
+	uint64_t counters[METRIC_COUNTER_COUNT] = {};
+	uint64_t stageCycles[METRIC_STAGE_COUNT] = {};
+	uint64_t stageCalls[METRIC_STAGE_COUNT] = {};
+	uint64_t histogram[METRIC_HISTOGRAM_BUCKETS] = {};
+	int threads = 0;
+
+	for (auto block = head.load(memory_order_acquire); block != nullptr; block = block->next) {
+		for (int i = 0; i < METRIC_COUNTER_COUNT; ++i)
+			counters[i] += block->counters[i].load(memory_order_relaxed);
+		for (int i = 0; i < METRIC_STAGE_COUNT; ++i) {
+			stageCycles[i] += block->stageCycles[i].load(memory_order_relaxed);
+			stageCalls[i]  += block->stageCalls[i].load(memory_order_relaxed);
+		}
+		for (int i = 0; i < METRIC_HISTOGRAM_BUCKETS; ++i)
+			histogram[i] += block->photonHistogram[i].load(memory_order_relaxed);
+		threads++;
+	}
+
+	out << "{\"threads\":" << threads << ",\"heap_allocations\":" << heapAllocations.load(memory_order_relaxed);
+	out << ",\"counters\":{";
+	for (int i = 0; i < METRIC_COUNTER_COUNT; ++i) {
+		out << (i?",":"") << "\"" << counterNames[i] << "\":" << counters[i];
+	}
+	out << "},\"stages\":{";
+	for (int i = 0; i < METRIC_STAGE_COUNT; ++i) {
+		out << (i?",":"") << "\"" << stageNames[i] << "\":{\"calls\":" << stageCalls[i];
+		out << ",\"cycles\":" << stageCycles[i] << "}";
+	}
+	out << "},\"photons_per_pulse_log2_histogram\":[";
+	for (int i = 0; i < METRIC_HISTOGRAM_BUCKETS; ++i) {
+		out << (i?",":"") << histogram[i];
+	}
+	out << "]}" << endl;
+}
+
+void Metrics::setDumpInterval(long long pulses) {
+	dumpInterval.store(pulses, memory_order_relaxed);
+}
+
+void Metrics::periodic(long long pulsesDone) {
+	// Stages run a block at a time, so dump whenever another interval
+	// boundary has been crossed rather than on exact multiples.
+	long long interval = dumpInterval.load(memory_order_relaxed);
+	if (interval <= 0)
+		return;
+	long long boundary = pulsesDone / interval;
+	long long last = lastDumped.load(memory_order_relaxed);
+	if (boundary > last && lastDumped.compare_exchange_strong(last, boundary)) {
+		dumpJSON(cerr);
+	}
+}
@@ -0,0 +1,114 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <atomic>
+#include <ostream>
+#include <cstdint>
+
+using namespace std;
+
+// Hot path instrumentation. Everything here is compiled out unless the
+// simulator is built with -DQKDSIM_METRICS, in which case the METRIC_*
+// macros below record into per-thread blocks that are summed on dump.
+
+enum MetricCounter {
+	METRIC_PULSES_GENERATED,
+	METRIC_PHOTONS_ABSORBED,
+	METRIC_DETECTIONS,
+	METRIC_MULTIPHOTON_PULSES,
+	METRIC_COUNTER_COUNT
+};
+
+enum MetricStage {
+	METRIC_STAGE_GENERATE,
+	METRIC_STAGE_PROPAGATE,
+	METRIC_STAGE_DETECT,
+	METRIC_STAGE_COUNT
+};
+
+// Bucket 0 holds empty pulses, bucket k holds pulses of [2^(k-1), 2^k) photons
+#define METRIC_HISTOGRAM_BUCKETS (16)
+
+struct ThreadMetrics {
+	atomic<uint64_t> counters[METRIC_COUNTER_COUNT];
+	atomic<uint64_t> stageCycles[METRIC_STAGE_COUNT];
+	atomic<uint64_t> stageCalls[METRIC_STAGE_COUNT];
+	atomic<uint64_t> photonHistogram[METRIC_HISTOGRAM_BUCKETS];
+	ThreadMetrics *next;
+
+	ThreadMetrics();
+	// Only the owning thread writes, so a relaxed load/store pair is enough
+	// and avoids a locked read-modify-write on every increment.
+	inline void add(atomic<uint64_t>& slot, uint64_t n) {
+		slot.store(slot.load(memory_order_relaxed) + n, memory_order_relaxed);
+	}
+	inline void add(MetricCounter counter, uint64_t n) {
+		add(counters[counter], n);
+	}
+	inline void addStage(MetricStage stage, uint64_t cycles) {
+		add(stageCycles[stage], cycles);
+		add(stageCalls[stage], 1);
+	}
+	inline void recordPhotons(int photons) {
+		int bucket = 0;
+		if (photons > 0) {
+			bucket = 32 - __builtin_clz((unsigned int) photons);
+			if (bucket >= METRIC_HISTOGRAM_BUCKETS)
+				bucket = METRIC_HISTOGRAM_BUCKETS-1;
+		}
+		add(photonHistogram[bucket], 1);
+	}
+};
+
+class Metrics {
+private:
+	static atomic<ThreadMetrics*> head;
+	static atomic<long long> dumpInterval;
+	static ThreadMetrics* registerThread();
+public:
+	static inline ThreadMetrics& local() {
+		static thread_local ThreadMetrics *block = nullptr;
+		if (block == nullptr)
+			block = registerThread();
+		return *block;
+	}
+	static uint64_t readCycles();
+
+	static void reset();
+	static void dumpJSON(ostream& out);
+	static void setDumpInterval(long long pulses);
+	static void periodic(long long pulsesDone);
+};
+
+class StageTimer {
+private:
+	MetricStage stage;
+	uint64_t start;
+public:
+	StageTimer(MetricStage s) : stage(s), start(Metrics::readCycles()) {}
+	~StageTimer() {
+		Metrics::local().addStage(stage, Metrics::readCycles() - start);
+	}
+};
+
+#ifdef QKDSIM_METRICS
+#define METRIC_CONCAT_(a, b) a##b
+#define METRIC_CONCAT(a, b) METRIC_CONCAT_(a, b)
+#define METRIC_ADD(counter, n)		Metrics::local().add(counter, n)
+#define METRIC_INC(counter)			Metrics::local().add(counter, 1)
+#define METRIC_PHOTONS(n)			Metrics::local().recordPhotons(n)
+#define METRIC_STAGE_TIMER(stage)	StageTimer METRIC_CONCAT(_stageTimer, __LINE__)(stage)
+#define METRICS_PERIODIC(pulsesDone)	Metrics::periodic(pulsesDone)
+#define METRICS_RESET()				Metrics::reset()
+#define METRICS_DUMP(out)			Metrics::dumpJSON(out)
+#else
+#define METRIC_ADD(counter, n)		((void)0)
+#define METRIC_INC(counter)			((void)0)
+#define METRIC_PHOTONS(n)			((void)0)
+#define METRIC_STAGE_TIMER(stage)	((void)0)
+#define METRICS_PERIODIC(pulsesDone)	((void)0)
+#define METRICS_RESET()				((void)0)
+#define METRICS_DUMP(out)			((void)0)
+#endif
+
+#endif
@@ -0,0 +1,269 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <queue>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <exception>
+#include <algorithm>
+
+#include "network.h"
+#include "rng.h"
+#include "postprocessing.h"
+
+using namespace std;
+
+
+KeyPool::KeyPool() {
+	used = 0;
+}
+long long KeyPool::available() const {
+	return bits.size - used;
+}
+bool KeyPool::take(long long count, PackedBits& out) {
+	if (available() < count)
+		return false;
+	out.append(bits, used, count);
+	used += count;
+	return true;
+}
+
+KeyDemand::KeyDemand(string _from, string _to, long long _bits) {
+	from = _from;
+	to = _to;
+	bits = _bits;
+	delivered = 0;
+}
+
+
+Network::Network() {
+	seed = 1;
+}
+Network::Network(string path) : Network() {
+	ifstream file(path);
+	if (!file) {
+		cout << "Could not open topology file " << path << endl;
+		throw -1;
+	}
+	string line;
+	while (getline(file, line)) {
+		stringstream tokens(line.substr(0, line.find('#')));
+		string keyword;
+		if (!(tokens >> keyword))
+			continue;
+		if (keyword == "seed") {
+			tokens >> seed;
+		} else if (keyword == "node") {
+			string name;
+			tokens >> name;
+			addNode(name);
+		} else if (keyword == "link") {
+			string from, to, setting;
+			tokens >> from >> to;
+			SimulationConfig config;
+			while (tokens >> setting) {
+				size_t equals = setting.find('=');
+				if (equals == string::npos) {
+					cout << "Expected key=value in link " << from << " " << to << ": " << setting << endl;
+					throw -1;
+				}
+				string key = setting.substr(0, equals), value = setting.substr(equals+1);
+				if (key == "config") {
+					config = SimulationConfig(value);
+				} else {
+					config.set(key, value);
+				}
+			}
+			addLink(from, to, config);
+		} else if (keyword == "demand") {
+			string from, to;
+			long long bits;
+			tokens >> from >> to >> bits;
+			findNode(from);
+			findNode(to);
+			demands.push_back(KeyDemand(from, to, bits));
+		} else {
+			cout << "Unknown topology entry " << keyword << endl;
+			throw -1;
+		}
+	}
+}
+int Network::addNode(string name) {
+	for (size_t n = 0; n < nodes.size(); ++n) {
+		if (nodes[n].name == name)
+			return n;
+	}
+	NetworkNode node;
+	node.name = name;
+	nodes.push_back(node);
+	return nodes.size() - 1;
+}
+int Network::findNode(string name) {
+	for (size_t n = 0; n < nodes.size(); ++n) {
+		if (nodes[n].name == name)
+			return n;
+	}
+	cout << "Unknown node " << name << endl;
+	throw -1;
+}
+void Network::addLink(string from, string to, const SimulationConfig& config) {
+	int a = addNode(from), b = addNode(to);
+	if (a == b || nodes[a].links.count(to)) {
+		cout << "Invalid or duplicate link " << from << " " << to << endl;
+		throw -1;
+	}
+	NetworkLink link;
+	link.from = from;
+	link.to = to;
+	link.config = config;
+	link.secretBits = 0;
+	link.distilled = false;
+	links.push_back(link);
+	nodes[a].links[to] = links.size() - 1;
+	nodes[b].links[from] = links.size() - 1;
+}
+
+void Network::simulateLinks(int threads) {
+	atomic<size_t> nextLink(0);
+	// The first error any worker hits, rethrown once all have stopped
+	mutex failedLock;
+	exception_ptr failed;
+	auto worker = [&]() {
+		try {
+			for (size_t i = nextLink++; i < links.size(); i = nextLink++) {
+				simulateLink(i);
+			}
+		} catch (...) {
+			lock_guard<mutex> guard(failedLock);
+			if (!failed)
+				failed = current_exception();
+			nextLink = links.size();
+		}
+	};
+	vector<thread> pool;
+	for (int t = 1; t < threads; ++t) {
+		pool.push_back(thread(worker));
+	}
+	worker();
+	for (auto& t : pool) {
+		t.join();
+	}
+	if (failed)
+		rethrow_exception(failed);
+}
+void Network::simulateLink(size_t i) {
+	auto& link = links[i];
+	// Freed when the link is done; there can be hundreds of links
+	BuiltObjects built;
+	auto input = link.config.buildInput(&built);
+	uint64_t state = seed ^ (i * 0x9E3779B97F4A7C15ULL);
+	input.seed = splitmix64(state);
+	// Links are the unit of parallelism
+	input.threads = 1;
+	input.keepStrings = false;
+
+	auto generator = link.config.buildGenerator(&built);
+	auto channel = link.config.buildChannel(&built);
+	auto detector = link.config.buildDetector(&built);
+	auto attack = link.config.buildAttack(&built);
+	input.postProcessor = built.own(link.config.buildPostProcessor(input));
+	link.result = runSimulation(generator, channel, attack, detector, input);
+
+	link.distilled = (input.postProcessor != nullptr);
+	if (link.distilled) {
+		link.pool.bits = input.postProcessor->finalKey;
+	} else {
+		link.pool.bits = link.result.aliceKey;
+		link.pool.bits.truncate(secretKeyLength(link.result));
+	}
+	link.secretBits = link.pool.bits.size;
+}
+
+vector<string> Network::route(string from, string to, long long bits) {
+	int source = findNode(from), target = findNode(to);
+	vector<int> previous(nodes.size(), -1);
+	previous[source] = source;
+	queue<int> frontier;
+	frontier.push(source);
+	while (!frontier.empty() && previous[target] < 0) {
+		int n = frontier.front();
+		frontier.pop();
+		for (auto& neighbour : nodes[n].links) {
+			int next = findNode(neighbour.first);
+			if (previous[next] < 0 && links[neighbour.second].pool.available() >= bits) {
+				previous[next] = n;
+				frontier.push(next);
+			}
+		}
+	}
+	vector<string> path;
+	if (previous[target] < 0)
+		return path;
+	for (int n = target; n != source; n = previous[n]) {
+		path.push_back(nodes[n].name);
+	}
+	path.push_back(from);
+	reverse(path.begin(), path.end());
+	return path;
+}
+
+bool Network::relay(const vector<string>& path, long long bits, PackedBits& key) {
+	for (size_t hop = 0; hop+1 < path.size(); ++hop) {
+		auto& link = links[nodes[findNode(path[hop])].links[path[hop+1]]];
+		if (link.pool.available() < bits)
+			return false;
+	}
+	// The first hop's key becomes the end to end key
+	key.clear();
+	links[nodes[findNode(path[0])].links[path[1]]].pool.take(bits, key);
+	for (size_t hop = 1; hop+1 < path.size(); ++hop) {
+		// Relay path[hop] one time pads the key for the next hop
+		PackedBits pad;
+		links[nodes[findNode(path[hop])].links[path[hop+1]]].pool.take(bits, pad);
+	}
+	return true;
+}
+
+void Network::relayKeys() {
+	for (auto& demand : demands) {
+		demand.route = route(demand.from, demand.to, demand.bits);
+		PackedBits key;
+		if (demand.route.size() > 1 && relay(demand.route, demand.bits, key)) {
+			demand.delivered = key.size;
+		}
+	}
+}
+
+void Network::printReport() {
+	cout << "Links:" << endl;
+	for (auto& link : links) {
+		cout << "\t" << link.from << " - " << link.to << ": " << link.result.detectionRate.trials << " pulses, QBER "
+			 << link.result.qber.value()*100 << "%, " << link.result.aliceKey.size << " sifted, "
+			 << link.secretBits << (link.distilled ? " final, " : " secret (raw sifted), ") << link.pool.available()
+			 << " left" << endl;
+	}
+	cout << "Demands:" << endl;
+	for (auto& demand : demands) {
+		cout << "\t" << demand.from << " -> " << demand.to << ": ";
+		if (demand.route.empty()) {
+			cout << "no route with " << demand.bits << " bits of key" << endl;
+			continue;
+		}
+		for (size_t hop = 0; hop < demand.route.size(); ++hop) {
+			cout << (hop ? "," : "") << demand.route[hop];
+		}
+		cout << " delivered " << demand.delivered << " of " << demand.bits << " bits" << endl;
+	}
+}
+
+int runNetwork(string path, int threads) {
+	Network network(path);
+	network.simulateLinks(threads);
+	network.relayKeys();
+	network.printReport();
+	return 0;
+}
@@ -0,0 +1,105 @@
+#ifndef _NETWORK_H_
+#define _NETWORK_H_
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include "config.h"
+#include "simulation.h"
+#include "packedbits.h"
+
+using namespace std;
+
+// Secret key shared by the two ends of a link, consumed from the front as
+// it is used. Both nodes see the same pool, so one pool stands for the
+// copy held at each end. That is exact for a link with postprocess.*
+// settings, whose pool is its final key; without them the pool is Alice's
+// raw sifted bits cut to the secret key length, as if post-processing were
+// ideal.
+struct KeyPool {
+	PackedBits bits;
+	long long used;
+
+	KeyPool();
+	long long available() const;
+	// Moves the next count bits into out, false if there are not enough
+	bool take(long long count, PackedBits& out);
+};
+
+struct NetworkLink {
+	string from;
+	string to;
+	SimulationConfig config;
+	SimulationResult result;
+	KeyPool pool;
+	// Bits of the link's final key, or secretKeyLength of its result
+	long long secretBits;
+	// Whether the pool is a post-processed final key
+	bool distilled;
+};
+
+struct NetworkNode {
+	string name;
+	// Neighbour name -> index of the link to it
+	map<string, int> links;
+};
+
+// Request for end to end key between two nodes that need not be neighbours
+struct KeyDemand {
+	string from;
+	string to;
+	long long bits;
+	// Filled in by relayKeys
+	vector<string> route;
+	long long delivered;
+	KeyDemand(string _from, string _to, long long _bits);
+};
+
+// Nodes joined by QKD links, every link with its own device configuration.
+// Topology files have one entry per line ('#' starts a comment):
+//
+//	seed 1234
+//	node A
+//	link A B pulses=1000000 channel.absorption=percent:30
+//	link B C config=metro.cfg attack=intercept
+//	demand A C 5000
+//
+// link takes SimulationConfig settings, config=file loading a whole config
+// first. Links are undirected; a demand asks for end to end key that is
+// relayed through trusted intermediate nodes.
+class Network {
+public:
+	vector<NetworkNode> nodes;
+	vector<NetworkLink> links;
+	vector<KeyDemand> demands;
+	uint64_t seed;
+
+	Network();
+	Network(string path);
+	int addNode(string name);
+	int findNode(string name);
+	void addLink(string from, string to, const SimulationConfig& config);
+
+	// Simulates every link on a pool of threads. Link i runs from its own
+	// stream (derived from seed and i), so results do not depend on the
+	// number of threads or on the order links are picked up in. The first
+	// error a link throws is rethrown once every thread has stopped.
+	void simulateLinks(int threads);
+	// Builds, runs and frees link i's devices
+	void simulateLink(size_t i);
+	// Fewest hops route from one node to another over links that still
+	// hold at least bits of key; empty if there is none
+	vector<string> route(string from, string to, long long bits);
+	// Hop by hop trusted relaying: the first hop's key is the end to end
+	// key, every relay decrypts with the key of the hop it came in on and
+	// re-encrypts with the next hop's key. Every hop's pool pays bits.
+	bool relay(const vector<string>& path, long long bits, PackedBits& key);
+	// Serves the demands in file order
+	void relayKeys();
+	void printReport();
+};
+
+int runNetwork(string path, int threads);
+
+#endif
@@ -0,0 +1,204 @@
+#include <iostream>
+#include <complex>
+#include <string>
+#include <cstdlib>
+
+#include "noise.h"
+#include "twoqubit.h"
+#include "rng.h"
+
+using namespace std;
+
+
+DensityMatrix::DensityMatrix() {
+	for (int i = 0; i < 4; ++i)
+		m[i] = 0;
+}
+DensityMatrix::DensityMatrix(state s) {
+	m[0] = s.first  * conj(s.first);
+	m[1] = s.first  * conj(s.second);
+	m[2] = s.second * conj(s.first);
+	m[3] = s.second * conj(s.second);
+}
+double DensityMatrix::trace() const {
+	return real(m[0]) + real(m[3]);
+}
+double DensityMatrix::probability(state s) const {
+	amplitude a = s.first, b = s.second;
+	return real(conj(a)*m[0]*a + conj(a)*m[1]*b + conj(b)*m[2]*a + conj(b)*m[3]*b);
+}
+void DensityMatrix::add(const DensityMatrix& other, double weight) {
+	for (int i = 0; i < 4; ++i)
+		m[i] += weight * other.m[i];
+}
+void DensityMatrix::scale(double factor) {
+	for (int i = 0; i < 4; ++i)
+		m[i] *= factor;
+}
+
+KrausOperator::KrausOperator(amplitude a, amplitude b, amplitude c, amplitude d) {
+	m[0] = a; m[1] = b;
+	m[2] = c; m[3] = d;
+}
+
+
+void NoiseModel::compile() {
+	for (int r = 0; r < 16; ++r)
+		superoperator[r] = 0;
+	for (auto& K : kraus) {
+		for (int i = 0; i < 2; ++i)
+		for (int j = 0; j < 2; ++j)
+		for (int k = 0; k < 2; ++k)
+		for (int l = 0; l < 2; ++l)
+			superoperator[(i*2+j)*4 + (k*2+l)] += K.m[i*2+k] * conj(K.m[j*2+l]);
+	}
+}
+DensityMatrix NoiseModel::operator()(const DensityMatrix& rho) const {
+	DensityMatrix out;
+	for (int r = 0; r < 4; ++r) {
+		const amplitude *row = superoperator + r*4;
+		out.m[r] = row[0]*rho.m[0] + row[1]*rho.m[1] + row[2]*rho.m[2] + row[3]*rho.m[3];
+	}
+	return out;
+}
+void NoiseModel::apply(DensityMatrix *rhos, int count) const {
+	for (int n = 0; n < count; ++n) {
+		rhos[n] = operator()(rhos[n]);
+	}
+}
+state NoiseModel::sample(state s) const {
+	double u = rng().uniform();
+	double cumulative = 0;
+	for (size_t i = 0; i < kraus.size(); ++i) {
+		auto& K = kraus[i];
+		amplitude a = K.m[0]*s.first + K.m[1]*s.second;
+		amplitude b = K.m[2]*s.first + K.m[3]*s.second;
+		double p = norm(a) + norm(b);
+		cumulative += p;
+		if ((u < cumulative || i+1 == kraus.size()) && p > 0) {
+			double n = sqrt(p);
+			return make_pair(a/n, b/n);
+		}
+	}
+	return s;
+}
+pairState NoiseModel::sample(const pairState& psi, int half) const {
+	double u = rng().uniform();
+	double cumulative = 0;
+	for (size_t i = 0; i < kraus.size(); ++i) {
+		auto out = (half == 0) ? applyLocal<0>(kraus[i].m, psi) : applyLocal<1>(kraus[i].m, psi);
+		double p = norm(out[0]) + norm(out[1]) + norm(out[2]) + norm(out[3]);
+		cumulative += p;
+		if ((u < cumulative || i+1 == kraus.size()) && p > 0) {
+			double n = sqrt(p);
+			for (auto& a : out)
+				a /= n;
+			return out;
+		}
+	}
+	return psi;
+}
+
+
+DepolarizingNoiseModel::DepolarizingNoiseModel(double p) {
+	double i = sqrt(1 - 3*p/4), x = sqrt(p/4);
+	amplitude j(0, 1);
+	kraus.push_back(KrausOperator(i, 0, 0, i));
+	kraus.push_back(KrausOperator(0, x, x, 0));
+	kraus.push_back(KrausOperator(0, -j*x, j*x, 0));
+	kraus.push_back(KrausOperator(x, 0, 0, -x));
+	compile();
+	name = to_string(p) + " Depolarizing Noise Model";
+}
+DepolarizingNoiseModel::DepolarizingNoiseModel() {
+	cout << "Enter depolarizing probability p (0-1): ";
+	double p;
+	cin >> p;
+	*this = DepolarizingNoiseModel(p);
+}
+
+DephasingNoiseModel::DephasingNoiseModel(double p) {
+	double i = sqrt(1 - p/2), z = sqrt(p/2);
+	kraus.push_back(KrausOperator(i, 0, 0, i));
+	kraus.push_back(KrausOperator(z, 0, 0, -z));
+	compile();
+	name = to_string(p) + " Dephasing Noise Model";
+}
+DephasingNoiseModel::DephasingNoiseModel() {
+	cout << "Enter dephasing probability p (0-1): ";
+	double p;
+	cin >> p;
+	*this = DephasingNoiseModel(p);
+}
+
+AmplitudeDampingNoiseModel::AmplitudeDampingNoiseModel(double gamma) {
+	kraus.push_back(KrausOperator(1, 0, 0, sqrt(1-gamma)));
+	kraus.push_back(KrausOperator(0, sqrt(gamma), 0, 0));
+	compile();
+	name = to_string(gamma) + " Amplitude Damping Noise Model";
+}
+AmplitudeDampingNoiseModel::AmplitudeDampingNoiseModel() {
+	cout << "Enter damping rate gamma (0-1): ";
+	double gamma;
+	cin >> gamma;
+	*this = AmplitudeDampingNoiseModel(gamma);
+}
+
+RotationNoiseModel::RotationNoiseModel(double radians) {
+	double c = cos(radians/2), s = sin(radians/2);
+	kraus.push_back(KrausOperator(c, -s, s, c));
+	compile();
+	name = to_string(radians) + " radian Rotation Noise Model";
+}
+RotationNoiseModel::RotationNoiseModel() {
+	cout << "Enter Bloch sphere rotation in radians: ";
+	double radians;
+	cin >> radians;
+	*this = RotationNoiseModel(radians);
+}
+
+NoiseModel* chooseNoiseModel() {
+	NoiseModel* chosenModel;
+	vector<string> models {"No Noise Model, photons only see the State Deviation Transformer",
+						   "Depolarizing Noise Model, state replaced by the maximally mixed state with probability p",
+						   "Dephasing Noise Model, phase flip with probability p/2",
+						   "Amplitude Damping Noise Model, |1> decays to |0> at rate gamma",
+						   "Rotation Noise Model, fixed rotation about the Bloch sphere Y axis"};
+
+	int index = 1;
+	for (auto name: models) {
+		cout << index << ")" << name << endl;
+		index++;
+	}
+	cout << "Choose which Noise Model to use: ";
+	int choice;
+	cin >> choice;
+	switch(choice) {
+		case 1: {
+			chosenModel = nullptr;
+			break;
+		}
+		case 2: {
+			chosenModel = new DepolarizingNoiseModel();
+			break;
+		}
+		case 3: {
+			chosenModel = new DephasingNoiseModel();
+			break;
+		}
+		case 4: {
+			chosenModel = new AmplitudeDampingNoiseModel();
+			break;
+		}
+		case 5: {
+			chosenModel = new RotationNoiseModel();
+			break;
+		}
+		default:{
+			cout << "Out of Index Noise Model choice" << endl;
+			throw -1;
+		}
+	}
+
+	return chosenModel;
+}
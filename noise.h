@@ -0,0 +1,72 @@
+#ifndef _NOISE_H_
+#define _NOISE_H_
+
+#include <vector>
+#include <string>
+
+#include "constants.h"
+
+using namespace std;
+
+// 2x2 density matrix, row major: m[0]=<0|p|0>, m[1]=<0|p|1>, m[2]=<1|p|0>, m[3]=<1|p|1>
+struct DensityMatrix {
+	amplitude m[4];
+
+	DensityMatrix();
+	DensityMatrix(state s);
+	double trace() const;
+	// Unnormalized probability <s|p|s> of projecting onto s
+	double probability(state s) const;
+	void add(const DensityMatrix& other, double weight);
+	void scale(double factor);
+};
+
+struct KrausOperator {
+	amplitude m[4];
+	KrausOperator(amplitude a, amplitude b, amplitude c, amplitude d);
+};
+
+// A CPTP map given by Kraus operators {K_i}, sum K_i^+ K_i = I. The map is
+// also folded into a 4x4 superoperator S = sum K_i (x) conj(K_i) so that a
+// batch of density matrices is one fixed-size matrix-vector product each.
+class NoiseModel {
+protected:
+	vector<KrausOperator> kraus;
+	amplitude superoperator[16];
+	void compile();
+public:
+	string name;
+	DensityMatrix operator()(const DensityMatrix& rho) const;
+	void apply(DensityMatrix *rhos, int count) const;
+	// Quantum trajectory: picks one K_i with probability |K_i psi|^2 and
+	// returns the renormalized K_i psi, so pure-state pulses see the exact
+	// same statistics as the density matrix path.
+	state sample(state s) const;
+	// The same trajectory with the noise acting on one qubit (0 Alice,
+	// 1 Bob) of an entangled pair
+	pairState sample(const pairState& psi, int half) const;
+};
+
+class DepolarizingNoiseModel : public NoiseModel {
+public:
+	DepolarizingNoiseModel();
+	DepolarizingNoiseModel(double p);
+};
+class DephasingNoiseModel : public NoiseModel {
+public:
+	DephasingNoiseModel();
+	DephasingNoiseModel(double p);
+};
+class AmplitudeDampingNoiseModel : public NoiseModel {
+public:
+	AmplitudeDampingNoiseModel();
+	AmplitudeDampingNoiseModel(double gamma);
+};
+class RotationNoiseModel : public NoiseModel {
+public:
+	RotationNoiseModel();
+	RotationNoiseModel(double radians);
+};
+NoiseModel* chooseNoiseModel();
+
+#endif
@@ -0,0 +1,48 @@
+#include <vector>
+#include <cstdint>
+
+#include "packedbits.h"
+
+using namespace std;
+
+
+PackedBits::PackedBits() {
+	size = 0;
+}
+void PackedBits::append(const PackedBits& other) {
+	int shift = size & 63;
+	if (shift == 0) {
+		words.insert(words.end(), other.words.begin(), other.words.end());
+	} else {
+		for (size_t w = 0; w < other.words.size(); ++w) {
+			words.back() |= other.words[w] << shift;
+			words.push_back(other.words[w] >> (64 - shift));
+		}
+	}
+	size += other.size;
+	words.resize((size + 63) / 64);
+	if (size & 63)
+		words.back() &= (1ULL << (size & 63)) - 1;
+}
+void PackedBits::append(const PackedBits& other, long long first, long long count) {
+	for (long long i = first; i < first + count; ++i) {
+		push(other.get(i));
+	}
+}
+void PackedBits::truncate(long long count) {
+	if (count >= size)
+		return;
+	size = count;
+	words.resize((size + 63) / 64);
+	if (size & 63)
+		words.back() &= (1ULL << (size & 63)) - 1;
+}
+void PackedBits::clear() {
+	words.clear();
+	size = 0;
+}
+
+void unpackBits(const uint64_t *words, char *bits, int count) {
+	for (int i = 0; i < count; ++i)
+		bits[i] = (words[i >> 6] >> (i & 63)) & 1;
+}
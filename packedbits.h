@@ -0,0 +1,37 @@
+#ifndef _PACKEDBITS_H_
+#define _PACKEDBITS_H_
+
+#include <vector>
+#include <cstdint>
+
+using namespace std;
+
+// Growable bitstring packed 64 bits per word, bit i in word i/64 at
+// position i%64.
+struct PackedBits {
+	vector<uint64_t> words;
+	long long size;
+
+	PackedBits();
+	inline void push(bool bit) {
+		if ((size & 63) == 0)
+			words.push_back(0);
+		words.back() |= (uint64_t) bit << (size & 63);
+		size++;
+	}
+	inline bool get(long long i) const {
+		return (words[i >> 6] >> (i & 63)) & 1;
+	}
+	void append(const PackedBits& other);
+	// Appends bits [first, first+count) of other
+	void append(const PackedBits& other, long long first, long long count);
+	// Keeps only the first count bits
+	void truncate(long long count);
+	void clear();
+};
+
+// Spreads count packed bits (bit i in words[i/64] at i%64) to one byte
+// each, for per-slot arrays filled from bulk random words
+void unpackBits(const uint64_t *words, char *bits, int count);
+
+#endif
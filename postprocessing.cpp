@@ -0,0 +1,377 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "postprocessing.h"
+
+using namespace std;
+
+
+static const int CASCADE_PASSES = 4;
+static const double MAX_QBER = 0.11;
+static const uint64_t HASH_PRIME = (1ULL << 61) - 1;
+
+static long long bytes(long long bits) {
+	return (bits + 7) / 8;
+}
+static double seconds(chrono::steady_clock::duration duration) {
+	return chrono::duration<double>(duration).count();
+}
+static void pack(const vector<char>& bits, vector<uint64_t>& words) {
+	words.assign((bits.size() + 63) / 64, 0);
+	for (size_t i = 0; i < bits.size(); ++i)
+		words[i >> 6] |= (uint64_t) bits[i] << (i & 63);
+}
+// Polynomial in x mod 2^61 - 1 with the key's 32-bit halves as coefficients
+static uint64_t polynomialHash(const vector<uint64_t>& words, uint64_t x) {
+	uint64_t hash = 0;
+	for (uint64_t word : words) {
+		for (int half = 0; half < 2; ++half) {
+			unsigned __int128 product = (unsigned __int128) hash * x + ((word >> (32*half)) & 0xffffffffULL);
+			uint64_t folded = (uint64_t) (product & HASH_PRIME) + (uint64_t) (product >> 61);
+			hash = (folded >= HASH_PRIME) ? folded - HASH_PRIME : folded;
+		}
+	}
+	return hash;
+}
+
+void toeplitzHash(const vector<uint64_t>& key, long long bits, const vector<uint64_t>& seed,
+				  long long outputBits, PackedBits& out) {
+	long long words = (bits + 63) / 64;
+	// The seed shifted by 0..63 bits, so that every row is a whole word
+	// aligned run of one of them and the sums vectorize
+	long long shiftedWords = seed.size() - 1;
+	vector<uint64_t> shifted(64 * shiftedWords);
+	for (int shift = 0; shift < 64; ++shift) {
+		uint64_t *target = shifted.data() + shift*shiftedWords;
+		for (long long w = 0; w < shiftedWords; ++w)
+			target[w] = shift ? (seed[w] >> shift) | (seed[w+1] << (64 - shift)) : seed[w];
+	}
+	out.clear();
+	for (long long i = 0; i < outputBits; ++i) {
+		// Row i is the seed from bit i on
+		const uint64_t *row = shifted.data() + (i & 63)*shiftedWords + (i >> 6);
+		uint64_t sum = 0;
+		for (long long j = 0; j < words; ++j)
+			sum ^= key[j] & row[j];
+		out.push(__builtin_popcountll(sum) & 1);
+	}
+}
+
+
+PostProcessor::PostProcessor(long long _blockBits, int _inFlight, double _sampleFraction, double _epsilon,
+							 double confidence, uint64_t _seed, int threads, ClassicalChannel *_classical) {
+	blockBits = _blockBits;
+	inFlight = max(1, _inFlight);
+	sampleFraction = _sampleFraction;
+	epsilon = _epsilon;
+	z = zForConfidence(confidence);
+	seed = _seed;
+	classical = _classical;
+	// Only the tags of messages sent from here on are this key's to pay
+	priorTagBits = (classical != nullptr) ? classical->authenticationBits() : 0;
+	stopping = false;
+	active = 0;
+	filling = nullptr;
+	nextIndex = 0;
+	nextFinal = 0;
+	blocks = 0;
+	abortedBlocks = 0;
+	failedBlocks = 0;
+	siftedBits = 0;
+	leakedBits = 0;
+	tagBits = 0;
+	maxEndToEnd = 0;
+	tail = 0;
+	wallSeconds = 0;
+	begun = clock::now();
+	lastFinal = begun;
+	for (int t = 0; t < max(1, threads); ++t)
+		workers.push_back(thread(&PostProcessor::work, this));
+}
+PostProcessor::~PostProcessor() {
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+	}
+	changed.notify_all();
+	for (auto& worker : workers)
+		worker.join();
+	delete filling;
+	for (auto block : finished)
+		delete block;
+}
+
+void PostProcessor::append(const PackedBits& alice, const PackedBits& bob) {
+	unique_lock<mutex> guard(lock);
+	for (long long i = 0; i < alice.size; ++i) {
+		if (filling == nullptr) {
+			filling = new KeyBlock();
+			filling->index = nextIndex++;
+			filling->started = clock::now();
+			filling->alice.reserve(blockBits);
+			filling->bob.reserve(blockBits);
+		}
+		filling->alice.push_back(alice.get(i));
+		filling->bob.push_back(bob.get(i));
+		if ((long long) filling->alice.size() == blockBits) {
+			changed.wait(guard, [&]() { return active < inFlight; });
+			submit(filling);
+			filling = nullptr;
+		}
+	}
+}
+void PostProcessor::finish() {
+	unique_lock<mutex> guard(lock);
+	auto quantumDone = clock::now();
+	if (filling != nullptr) {
+		changed.wait(guard, [&]() { return active < inFlight; });
+		submit(filling);
+		filling = nullptr;
+	}
+	changed.wait(guard, [&]() { return active == 0; });
+	// Tags of messages no block paid for (sifting, blocks without key)
+	// come off the end of the final key
+	if (classical != nullptr) {
+		long long unpaid = classical->authenticationBits() - priorTagBits - tagBits;
+		long long debited = min(unpaid, finalKey.size);
+		finalKey.truncate(finalKey.size - debited);
+		tagBits += debited;
+	}
+	tail = max(0.0, seconds(lastFinal - quantumDone));
+	wallSeconds = seconds(clock::now() - begun);
+}
+
+void PostProcessor::submit(KeyBlock *block) {
+	uint64_t state = seed + (uint64_t) block->index * 0x9E3779B97F4A7C15ULL;
+	block->stream = Rng(splitmix64(state));
+	block->cut = clock::now();
+	block->sifted = block->alice.size();
+	block->qber = block->qberUpper = 0;
+	block->leaked = 0;
+	block->messages = 0;
+	block->tagBits = 0;
+	block->aborted = block->failed = false;
+	active++;
+	tasks.push_back(make_pair(block, ESTIMATE));
+	changed.notify_all();
+}
+void PostProcessor::work() {
+	while (true) {
+		pair<KeyBlock*, Stage> task;
+		{
+			unique_lock<mutex> guard(lock);
+			changed.wait(guard, [&]() { return stopping || !tasks.empty(); });
+			if (tasks.empty())
+				return;
+			task = tasks.front();
+			tasks.pop_front();
+		}
+		run(task.first, task.second);
+	}
+}
+void PostProcessor::run(KeyBlock *block, Stage stage) {
+	auto start = clock::now();
+	if (stage == ESTIMATE)
+		estimate(block);
+	else if (stage == RECONCILE)
+		reconcile(block);
+	else
+		amplify(block);
+	block->stageSeconds[stage] = seconds(clock::now() - start);
+
+	lock_guard<mutex> guard(lock);
+	if (stage == AMPLIFY || block->aborted || block->failed) {
+		finalize(block);
+	} else {
+		// A started block goes first, which keeps its latency down
+		tasks.push_front(make_pair(block, (Stage) (stage + 1)));
+	}
+	changed.notify_all();
+}
+void PostProcessor::finalize(KeyBlock *block) {
+	block->finalized = clock::now();
+	finished.push_back(block);
+	while (true) {
+		auto next = find_if(finished.begin(), finished.end(),
+							[&](KeyBlock *b) { return b->index == nextFinal; });
+		if (next == finished.end())
+			break;
+		KeyBlock *ready = *next;
+		finished.erase(next);
+		blocks++;
+		abortedBlocks += ready->aborted;
+		failedBlocks += ready->failed;
+		siftedBits += ready->sifted;
+		leakedBits += ready->leaked;
+		tagBits += ready->tagBits;
+		finalKey.append(ready->finalKey);
+		double total = seconds(ready->finalized - ready->started);
+		endToEnd.add(total);
+		afterCut.add(seconds(ready->finalized - ready->cut));
+		maxEndToEnd = max(maxEndToEnd, total);
+		for (int s = ESTIMATE; s <= AMPLIFY; ++s) {
+			if (!ready->aborted && !ready->failed)
+				stageSeconds[s].add(ready->stageSeconds[s]);
+		}
+		lastFinal = ready->finalized;
+		delete ready;
+		nextFinal++;
+		active--;
+	}
+}
+
+void PostProcessor::send(KeyBlock *block, ClassicalStage stage, long long bytes) {
+	if (classical == nullptr)
+		return;
+	classical->send(stage, bytes);
+	block->messages++;
+}
+void PostProcessor::exchange(KeyBlock *block, ClassicalStage stage, long long requestBytes, long long replyBytes) {
+	if (classical == nullptr)
+		return;
+	classical->exchange(stage, requestBytes, replyBytes);
+	block->messages += 2;
+}
+
+void PostProcessor::estimate(KeyBlock *block) {
+	auto& alice = block->alice;
+	auto& bob = block->bob;
+	size_t kept = 0;
+	ProportionStat sample;
+	for (size_t i = 0; i < alice.size(); ++i) {
+		if (block->stream.uniform() < sampleFraction) {
+			sample.add(alice[i] != bob[i]);
+		} else {
+			alice[kept] = alice[i];
+			bob[kept] = bob[i];
+			kept++;
+		}
+	}
+	alice.resize(kept);
+	bob.resize(kept);
+	// Bob sends the sample's seed and his bits, Alice the errors she counts
+	exchange(block, CLASSICAL_ESTIMATION, 8 + bytes(sample.trials), 8);
+	block->qber = sample.value();
+	block->qberUpper = (sample.trials > 0) ? sample.wilson(z).second : 0.5;
+	block->aborted = (block->qberUpper > MAX_QBER || kept == 0);
+}
+void PostProcessor::reconcile(KeyBlock *block) {
+	auto& alice = block->alice;
+	auto& bob = block->bob;
+	int n = alice.size();
+	Rng& stream = block->stream;
+	int firstSize = (int) min<double>(n, max(4.0, ceil(0.73 / max(block->qber, 1e-4))));
+	vector<vector<int> > order(CASCADE_PASSES), where(CASCADE_PASSES);
+	vector<vector<char> > odd(CASCADE_PASSES);
+	vector<int> size(CASCADE_PASSES);
+	vector<pair<int, int> > pending;
+	for (int pass = 0; pass < CASCADE_PASSES; ++pass) {
+		size[pass] = (int) min<long long>(n, (long long) firstSize << pass);
+		auto& permutation = order[pass];
+		permutation.resize(n);
+		for (int i = 0; i < n; ++i)
+			permutation[i] = i;
+		for (int i = n - 1; i > 0; --i)
+			swap(permutation[i], permutation[stream.below(i + 1)]);
+		where[pass].resize(n);
+		for (int i = 0; i < n; ++i)
+			where[pass][permutation[i]] = i;
+		int blockCount = (n + size[pass] - 1) / size[pass];
+		odd[pass].assign(blockCount, 0);
+		for (int i = 0; i < n; ++i)
+			odd[pass][i / size[pass]] ^= alice[permutation[i]] ^ bob[permutation[i]];
+		// Alice announces every block's parity, Bob which ones differ
+		block->leaked += blockCount;
+		exchange(block, CLASSICAL_RECONCILIATION, bytes(blockCount), bytes(blockCount));
+		for (int b = 0; b < blockCount; ++b) {
+			if (odd[pass][b])
+				pending.push_back(make_pair(pass, b));
+		}
+		// The odd blocks are searched side by side, one round trip per
+		// halving; blocks of earlier passes that a correction makes odd are
+		// searched in the next wave
+		while (!pending.empty()) {
+			vector<pair<int, int> > wave;
+			wave.swap(pending);
+			vector<long long> searching;
+			for (auto& entry : wave) {
+				int p = entry.first, b = entry.second;
+				if (!odd[p][b])
+					continue;
+				// Binary search on halves, Alice announcing each first half's parity
+				int low = b * size[p], high = min(low + size[p], n);
+				for (size_t step = 0; high - low > 1; ++step) {
+					int middle = (low + high) / 2;
+					char parity = 0;
+					for (int i = low; i < middle; ++i)
+						parity ^= alice[order[p][i]] ^ bob[order[p][i]];
+					block->leaked++;
+					if (step == searching.size())
+						searching.push_back(0);
+					searching[step]++;
+					if (parity)
+						high = middle;
+					else
+						low = middle;
+				}
+				int position = order[p][low];
+				bob[position] ^= 1;
+				// The flip changes the parity of its block in every pass so far
+				for (int q = 0; q <= pass; ++q) {
+					int containing = where[q][position] / size[q];
+					odd[q][containing] ^= 1;
+					if (odd[q][containing])
+						pending.push_back(make_pair(q, containing));
+				}
+			}
+			for (long long blocks : searching) {
+				exchange(block, CLASSICAL_RECONCILIATION, bytes(blocks), bytes(blocks));
+			}
+		}
+	}
+}
+void PostProcessor::amplify(KeyBlock *block) {
+	vector<uint64_t> aliceWords, bobWords;
+	pack(block->alice, aliceWords);
+	pack(block->bob, bobWords);
+	uint64_t point = block->stream() % HASH_PRIME;
+	block->leaked += 64;
+	exchange(block, CLASSICAL_VERIFICATION, 16, 1);
+	if (polynomialHash(aliceWords, point) != polynomialHash(bobWords, point)) {
+		block->failed = true;
+		return;
+	}
+	long long n = block->alice.size();
+	double secure = n * (1 - binaryEntropy(block->qberUpper)) - block->leaked - 2*log2(1/epsilon);
+	// The block pays the tags of its messages, the Toeplitz seed's included
+	long long tags = (classical != nullptr) ? (block->messages + 1) * classical->tagBits : 0;
+	long long outputBits = max(0LL, (long long) floor(secure) - tags);
+	if (outputBits == 0)
+		return;
+	block->tagBits = tags;
+	// Bob's key is equal once verified, so only Alice's is hashed
+	vector<uint64_t> seedWords((n + outputBits) / 64 + 2);
+	block->stream.fillBits(seedWords.data(), seedWords.size() * 64);
+	send(block, CLASSICAL_AMPLIFICATION, bytes(n + outputBits - 1));
+	toeplitzHash(aliceWords, n, seedWords, outputBits, block->finalKey);
+}
+
+void PostProcessor::printReport() const {
+	cout << "Post-processing (key blocks of " << blockBits << " sifted bits, at most " << inFlight
+		 << " in flight):" << endl;
+	cout << "\tKey blocks: " << blocks << " (" << abortedBlocks << " aborted, " << failedBlocks
+		 << " failed verification)" << endl;
+	cout << "\tSifted bits: " << siftedBits << ", leaked in reconciliation: " << leakedBits
+		 << ", final key: " << finalKey.size << " bits";
+	if (classical != nullptr)
+		cout << " (after " << tagBits << " bits of authentication tags)";
+	cout << endl;
+	cout << "\tLatency per key block: " << endToEnd.mean() << " s from its first sifted bit (max "
+		 << maxEndToEnd << " s), " << afterCut.mean() << " s once cut" << endl;
+	cout << "\tStage time per block: estimate " << stageSeconds[0].mean()*1000 << " ms, reconcile "
+		 << stageSeconds[1].mean()*1000 << " ms, amplify " << stageSeconds[2].mean()*1000 << " ms" << endl;
+	cout << "\tLast final key " << tail << " s after the quantum phase, " << wallSeconds << " s in all" << endl;
+}
@@ -0,0 +1,149 @@
+#ifndef _POSTPROCESSING_H_
+#define _POSTPROCESSING_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+
+#include "packedbits.h"
+#include "statistics.h"
+#include "rng.h"
+#include "classical.h"
+
+using namespace std;
+
+// Classical post-processing of the sifted key while the quantum phase is
+// still running. Sifting itself happens per pulse block in the simulation
+// loop; the merged sifted bits are cut into key blocks of blockBits, and
+// every full key block goes through
+//
+//	estimate   Alice and Bob compare a random sample of sampleFraction of
+//	           the bits and drop them; the QBER's upper confidence limit
+//	           (z standard deviations) aborts the block above 11%
+//	reconcile  Cascade (Brassard, Salvail 1993): four passes of shuffled
+//	           blocks of 0.73/QBER, 2x that, ... bits, every odd parity
+//	           block binary searched and the correction cascaded back to
+//	           earlier passes; each parity Alice announces is leaked
+//	verify     64-bit polynomial hash of both keys (64 more bits leaked),
+//	           the block is dropped when they differ
+//	amplify    Toeplitz hashing down to n (1 - h(QBER_U)) - leaked
+//	           - 2 log2(1/epsilon) bits
+//
+// as tasks of a small graph run by its own threads, each stage of a block
+// queued when the previous one finishes. At most inFlight key blocks are
+// between being cut and being final: the simulation waits when it runs
+// further ahead. Key block i draws from its own stream (from seed and i),
+// so the final key does not depend on the number of threads.
+//
+// Every stage reports what it would send over the classical channel (when
+// there is one): the Cascade searches of a wave advance together, one
+// round trip per halving. The Wegman-Carter tags of a block's messages are
+// paid from its own privacy amplification output, and finish() takes the
+// tags nobody paid for (sifting, blocks that made no key) off the end of
+// the final key, so finalKey is net of authentication.
+class PostProcessor {
+private:
+	typedef chrono::steady_clock clock;
+	enum Stage { ESTIMATE, RECONCILE, AMPLIFY };
+	struct KeyBlock {
+		long long index;
+		Rng stream;
+		vector<char> alice;
+		vector<char> bob;
+		long long sifted;
+		double qber;
+		double qberUpper;
+		long long leaked;
+		// Classical messages so far and the tag key they took off the
+		// block's final key
+		long long messages;
+		long long tagBits;
+		bool aborted;
+		bool failed;
+		PackedBits finalKey;
+		clock::time_point started;
+		clock::time_point cut;
+		clock::time_point finalized;
+		double stageSeconds[3];
+	};
+	long long blockBits;
+	int inFlight;
+	double sampleFraction;
+	double epsilon;
+	double z;
+	uint64_t seed;
+	ClassicalChannel *classical;
+	// The channel's tag bits before this processor sent anything
+	long long priorTagBits;
+
+	mutex lock;
+	condition_variable changed;
+	deque<pair<KeyBlock*, Stage> > tasks;
+	vector<thread> workers;
+	bool stopping;
+	int active;
+	KeyBlock *filling;
+	long long nextIndex;
+	// Finished blocks waiting for the ones before them
+	vector<KeyBlock*> finished;
+	long long nextFinal;
+	clock::time_point begun;
+	clock::time_point lastFinal;
+
+	void work();
+	void run(KeyBlock *block, Stage stage);
+	// Called with lock held
+	void submit(KeyBlock *block);
+	void finalize(KeyBlock *block);
+	// Reported to the classical channel (when there is one) and counted
+	// against the block
+	void send(KeyBlock *block, ClassicalStage stage, long long bytes);
+	void exchange(KeyBlock *block, ClassicalStage stage, long long requestBytes, long long replyBytes);
+	void estimate(KeyBlock *block);
+	void reconcile(KeyBlock *block);
+	void amplify(KeyBlock *block);
+public:
+	// Results, in key block order
+	PackedBits finalKey;
+	long long blocks;
+	long long abortedBlocks;
+	long long failedBlocks;
+	long long siftedBits;
+	long long leakedBits;
+	// Authentication tag key taken off the final key
+	long long tagBits;
+	// Seconds from a key block's first sifted bit (and from the block
+	// being cut) to its final key
+	RunningStat endToEnd;
+	RunningStat afterCut;
+	double maxEndToEnd;
+	RunningStat stageSeconds[3];
+	// Seconds from the end of the quantum phase to the last final key
+	double tail;
+	double wallSeconds;
+
+	PostProcessor(long long _blockBits, int _inFlight, double _sampleFraction, double _epsilon,
+				  double confidence, uint64_t _seed, int threads, ClassicalChannel *_classical);
+	~PostProcessor();
+	// Merged sifted bits in pulse order; waits while inFlight key blocks
+	// are being processed
+	void append(const PackedBits& alice, const PackedBits& bob);
+	// The quantum phase is over: the last partial block is processed too
+	// and every block is waited for
+	void finish();
+	void printReport() const;
+};
+
+// outputBits bits of the product of the key's first bits with the Toeplitz
+// matrix whose anti-diagonals are the seed's bits (bit i + j of seed in row
+// i, column j, so seed needs (bits + outputBits)/64 + 2 words); bits of key
+// past bits have to be 0
+void toeplitzHash(const vector<uint64_t>& key, long long bits, const vector<uint64_t>& seed,
+				  long long outputBits, PackedBits& out);
+
+#endif
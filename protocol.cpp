@@ -0,0 +1,94 @@
+#include <string>
+#include <vector>
+#include <complex>
+
+#include "protocol.h"
+
+using namespace std;
+
+
+Protocol::Protocol(string _name, vector<state> _states, vector<char> _keyBits, vector<basis> _bases,
+				   int _announcements, SiftRule rule) {
+	name = _name;
+	states = _states;
+	keyBits = _keyBits;
+	bases = _bases;
+	announcements = _announcements;
+
+	int basisCount = bases.size();
+	oneProbabilities.resize(states.size() * basisCount);
+	for (size_t s = 0; s < states.size(); ++s) {
+		for (int b = 0; b < basisCount; ++b) {
+			state one = bases[b].second;
+			amplitude overlap = conj(one.first)*states[s].first + conj(one.second)*states[s].second;
+			oneProbabilities[s*basisCount + b] = norm(overlap);
+		}
+	}
+	sifted.resize(states.size() * announcements * basisCount * 2);
+	for (size_t s = 0; s < states.size(); ++s)
+	for (int a = 0; a < announcements; ++a)
+	for (int b = 0; b < basisCount; ++b)
+	for (int outcome = 0; outcome < 2; ++outcome) {
+		sifted[((s*announcements + a)*basisCount + b)*2 + outcome] = rule(*this, s, a, b, outcome);
+	}
+}
+
+
+static state YPLUS()  { return make_pair(amplitude(1/root2), amplitude(0, 1/root2)); }
+static state YMINUS() { return make_pair(amplitude(1/root2), amplitude(0, -1/root2)); }
+
+static int matchingBases(const Protocol& protocol, int state, int announcement, int basis, int outcome) {
+	return (state/2 == basis) ? outcome : -1;
+}
+// Outcome 1 in Z rules out |0>, so |+> was sent; outcome 1 (|->) in X
+// rules out |+>
+static int b92Sift(const Protocol& protocol, int state, int announcement, int basis, int outcome) {
+	if (outcome == 0)
+		return -1;
+	return (basis == 0) ? 1 : 0;
+}
+// Alice announces {her state, state 2*(other basis) + announcement}. Bob's
+// outcome rules out the state of his basis orthogonal to it; when that is
+// one of the pair he takes the other, whose basis is the bit.
+static int sarg04Sift(const Protocol& protocol, int state, int announcement, int basis, int outcome) {
+	int partner = 2*(1 - state/2) + announcement;
+	int ruledOut = 2*basis + (1 - outcome);
+	if (ruledOut == state)
+		return partner / 2;
+	if (ruledOut == partner)
+		return state / 2;
+	return -1;
+}
+
+const Protocol& bb84Protocol() {
+	static const Protocol protocol("BB84", {ZERO, ONE, PLUS, MINUS}, {0, 1, 0, 1},
+								   {make_pair(ZERO, ONE), make_pair(PLUS, MINUS)}, 1, matchingBases);
+	return protocol;
+}
+const Protocol& sixStateProtocol() {
+	static const Protocol protocol("Six-state", {ZERO, ONE, PLUS, MINUS, YPLUS(), YMINUS()}, {0, 1, 0, 1, 0, 1},
+								   {make_pair(ZERO, ONE), make_pair(PLUS, MINUS), make_pair(YPLUS(), YMINUS())},
+								   1, matchingBases);
+	return protocol;
+}
+const Protocol& b92Protocol() {
+	static const Protocol protocol("B92", {ZERO, PLUS}, {0, 1},
+								   {make_pair(ZERO, ONE), make_pair(PLUS, MINUS)}, 1, b92Sift);
+	return protocol;
+}
+const Protocol& sarg04Protocol() {
+	static const Protocol protocol("SARG04", {ZERO, ONE, PLUS, MINUS}, {0, 0, 1, 1},
+								   {make_pair(ZERO, ONE), make_pair(PLUS, MINUS)}, 2, sarg04Sift);
+	return protocol;
+}
+const Protocol* findProtocol(string name) {
+	if (name == "bb84")
+		return &bb84Protocol();
+	if (name == "sixstate")
+		return &sixStateProtocol();
+	if (name == "b92")
+		return &b92Protocol();
+	if (name == "sarg04")
+		return &sarg04Protocol();
+	return nullptr;
+}
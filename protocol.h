@@ -0,0 +1,65 @@
+#ifndef _PROTOCOL_H_
+#define _PROTOCOL_H_
+
+#include <string>
+#include <vector>
+
+#include "constants.h"
+
+using namespace std;
+
+class Protocol;
+
+// Bob's sifted key bit for a detection, or -1 to discard it. It may only
+// act on what is public: Alice's basis and announcement, Bob's basis and
+// outcome. It is given Alice's state so that it can work out what she
+// announced (e.g. SARG04's pair of states).
+typedef int (*SiftRule)(const Protocol& protocol, int state, int announcement, int basis, int outcome);
+
+// Prepare and measure protocol described by tables. Alice picks one of
+// her bases and a bit value, i.e. state 2*basis + value of her alphabet,
+// and optionally a public announcement; Bob measures in one of his bases.
+// The outcome probabilities of every state in every basis and the sifting
+// decision of every (state, announcement, basis, outcome) are worked out
+// once, so the hot path only indexes tables with small integers.
+class Protocol {
+public:
+	string name;
+	vector<state> states;
+	// Alice's key bit for each state
+	vector<char> keyBits;
+	// Bob's bases; outcome 0 collapses to .first and 1 to .second
+	vector<basis> bases;
+	// Values of Alice's announcement per pulse, 1 when she announces nothing
+	int announcements;
+	// P(outcome 1) at [state*bases + basis]
+	vector<double> oneProbabilities;
+	// SiftRule results at [((state*announcements + announcement)*bases + basis)*2 + outcome]
+	vector<char> sifted;
+
+	Protocol(string _name, vector<state> _states, vector<char> _keyBits, vector<basis> _bases,
+			 int _announcements, SiftRule rule);
+	int sourceBases() const {
+		return states.size() / 2;
+	}
+	double oneProbability(int state, int basis) const {
+		return oneProbabilities[state*bases.size() + basis];
+	}
+	int sift(int state, int announcement, int basis, int outcome) const {
+		return sifted[((state*announcements + announcement)*bases.size() + basis)*2 + outcome];
+	}
+};
+
+// Z/X states, bases equal
+const Protocol& bb84Protocol();
+// Z/X/Y states, bases equal
+const Protocol& sixStateProtocol();
+// |0> for 0 and |+> for 1; Bob keeps the outcomes that rule one state out
+const Protocol& b92Protocol();
+// BB84 states with the bit in the basis; Alice announces her state and one
+// from the other basis and Bob keeps the outcomes that rule one out
+const Protocol& sarg04Protocol();
+// By name (bb84, sixstate, b92, sarg04), nullptr if unknown
+const Protocol* findProtocol(string name);
+
+#endif
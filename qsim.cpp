@@ -3,8 +3,10 @@
 #include <complex>
 #include <iostream> 
 #include <random>
+#include <thread>
 
 #include <cstdlib>
+#include <cstdio>
 #include <ctime>
 #include <cmath>
 
@@ -13,11 +15,345 @@
 #include "devices.h"
 #include "factories.h"
 #include "transformers.h"
+#include "metrics.h"
+#include "logging.h"
+#include "attacks.h"
+#include "simulation.h"
+#include "rng.h"
+#include "config.h"
+#include "shard.h"
+#include "network.h"
+#include "kms.h"
+#include "entanglement.h"
+#include "keyrate.h"
 
 using namespace std;
 
-int main() {
-	srand(time(NULL));
+Generator* chooseGenerator(vector<GeneratorInfo>& Generators, string prompt) {
+	int index = 1;
+	for (auto info: Generators) {
+		cout << index << ")" << info.name << endl;
+		index++;
+	}
+	cout << prompt;
+	int choice;
+	cin >> choice;
+	if (choice <= 0 || choice > Generators.size()){
+		cout << "Out of Index generator choice" << endl;
+		throw -1;
+	}
+	return Generators[choice-1].generator;
+}
+
+Detector* chooseDetector(vector<DetectorInfo>& Detectors, string prompt) {
+	int index = 1;
+	for (auto info: Detectors) {
+		cout << index << ")" << info.name << endl;
+		index++;
+	}
+	cout << prompt;
+	int choice;
+	cin >> choice;
+	if (choice <= 0 || choice > Detectors.size()){
+		cout << "Out of Index detector choice" << endl;
+		throw -1;
+	}
+	return Detectors[choice-1].detector;
+}
+
+Channel* chooseChannel(vector<ChannelInfo>& Channels, string prompt) {
+	int index = 1;
+	for (auto info: Channels) {
+		cout << index << ")" << info.name << endl;
+		index++;
+	}
+	cout << prompt;
+	int choice;
+	cin >> choice;
+	if (choice <= 0 || choice > Channels.size()){
+		cout << "Out of Index channel choice" << endl;
+		throw -1;
+	}
+	return Channels[choice-1].channel;
+}
+
+Attack* chooseAttack(int algorithm, vector<GeneratorInfo>& Generators, vector<DetectorInfo>& Detectors) {
+	if (algorithm <= 1 || algorithm > 5) {
+		return nullptr;
+	}
+	auto Edetector = chooseDetector(Detectors, "Choose Eve's detector to use: ");
+	switch (algorithm) {
+		case 2: {
+			auto Egenerator = chooseGenerator(Generators, "Choose Eve's generator: ");
+			return new PhotonNumberSplittingAttack(Edetector, Egenerator);
+		}
+		case 3: {
+			auto Egenerator = chooseGenerator(Generators, "Choose Eve's generator: ");
+			return new InterceptResendAttack(Edetector, Egenerator);
+		}
+		case 4: {
+			return new BeamSplittingAttack(Edetector);
+		}
+		default: {
+			auto Egenerator = chooseGenerator(Generators, "Choose Eve's generator: ");
+			return new UnambiguousStateDiscriminationAttack(Edetector, Egenerator);
+		}
+	}
+}
+
+// Recorded bits or basis choices of a BB84 run, mapped rather than typed in
+static BitFile* readBitFile() {
+	cout << "Enter file format (ascii or packed) and path, e.g. packed:bits.bin: ";
+	string spec;
+	cin >> spec;
+	return openBitFile("file", spec, 2);
+}
+
+// Typed basis choices index the protocol's tables, so each has to be a
+// digit below values
+static void checkBasisDigits(const string& digits, int values) {
+	for (char c : digits) {
+		if (c < '0' || c >= '0' + values) {
+			cout << "Basis choices must be digits 0 to " << values - 1 << endl;
+			throw -1;
+		}
+	}
+}
+
+// seedGiven (when not null) tells whether the user typed the seed
+SimulationInput readSimulationInput(bool *seedGiven = nullptr) {
+	SimulationInput input;
+	input.seed = rng()();
+	input.threads = max(1u, thread::hardware_concurrency());
+	if (getenv("QKDSIM_THREADS") != NULL) {
+		input.threads = max(1, atoi(getenv("QKDSIM_THREADS")));
+	}
+	int choice;
+
+	cout << "(1)Generate random bitstring to transmit" << endl;
+	cout << "(2)Manually input bitstring to transmit" << endl;
+	cout << "(3)Generate random bits until the confidence intervals are narrow enough" << endl;
+	cout << "(4)Read bitstring from a file" << endl;
+	cout << "Choose:";
+	cin >> choice;
+
+	switch (choice) {
+		case 1: {
+			cout << "Enter bitstring length: ";
+			cin >> input.length;
+			break;
+		}
+		case 2: {
+			// TODO: add check if string entered is bitstring
+			cin >> input.bits;
+			break;
+		}
+		case 3: {
+			cout << "Enter target confidence interval width (e.g. 0.01): ";
+			cin >> input.targetWidth;
+			cout << "Enter confidence level (e.g. 0.95): ";
+			cin >> input.confidence;
+			cout << "Enter maximum bitstring length: ";
+			cin >> input.length;
+			break;
+		}
+		case 4: {
+			input.bitsFile = readBitFile();
+			// Files can be far longer than what is worth printing
+			input.keepStrings = false;
+			break;
+		}
+		default:{
+			cout << "Invalid choice for bitstring" << endl;
+			throw -1;
+		}
+	}
+
+	cout << "(1)Generate random basis chocies to transmit" << endl;
+	cout << "(2)Manually input basis choices as bitstring" << endl;
+	cout << "(3)Read basis choices from a file" << endl;
+	cout << "Choose:";
+	cin >> choice;
+
+	switch (choice) {
+		case 1: {
+			input.sourceBases = "auto";
+			break;
+		}
+		case 2: {
+			cin >> input.sourceBases;
+			if ((long long) input.sourceBases.size() != input.pulses()){
+				cout << "Mismatch in length of bitstring and basis choice bitstring" << endl;
+				throw -1;
+			}
+			checkBasisDigits(input.sourceBases, input.protocol->sourceBases());
+			break;
+		}
+		case 3: {
+			input.sourceBasesFile = readBitFile();
+			if (input.sourceBasesFile->length() < input.pulses()) {
+				cout << "Basis choice file is shorter than the bitstring" << endl;
+				throw -1;
+			}
+			break;
+		}
+		default:{
+			cout << "Invalid choice for basis choice bitstring" << endl;
+			throw -1;
+		}
+	}
+
+	cout << "(1)Generate random basis chocies for detector" << endl;
+	cout << "(2)Manually input basis choices for detector" << endl;
+	cout << "(3)Read basis choices for detector from a file" << endl;
+	cout << "Choose:";
+	cin >> choice;
+
+	switch (choice) {
+		case 1: {
+			input.detectorBases = "auto";
+			break;
+		}
+		case 2: {
+			cin >> input.detectorBases;
+			if ((long long) input.detectorBases.size() != input.pulses()){
+				cout << "Mismatch in length of bitstring and basis choice bitstring" << endl;
+				throw -1;
+			}
+			checkBasisDigits(input.detectorBases, input.protocol->bases.size());
+			break;
+		}
+		case 3: {
+			input.detectorBasesFile = readBitFile();
+			if (input.detectorBasesFile->length() < input.pulses()) {
+				cout << "Basis choice file is shorter than the bitstring" << endl;
+				throw -1;
+			}
+			break;
+		}
+		default:{
+			cout << "Invalid choice for basis choice bitstring" << endl;
+			throw -1;
+		}
+	}
+
+	cout << "Importance sampling floor for rare measurement outcomes (0 for plain Monte Carlo): ";
+	cin >> input.outcomeBias;
+
+	cout << "Seed (0 for a fresh one; repeating one with the same generator and channel reuses their pulses): ";
+	uint64_t seed;
+	cin >> seed;
+	if (seed != 0) {
+		input.seed = seed;
+	}
+	if (seedGiven != nullptr)
+		*seedGiven = (seed != 0);
+
+	return input;
+}
+
+// Non-interactive modes:
+//	--config file --shard k/N --out dir	run one shard
+//	--config file --shards N --out dir	fork N shard processes and merge them
+//	--merge dir N				merge shards already written to dir
+//	--config file				run an entangled protocol (protocol = bbm92/e91)
+//	--config file --curve			key rate against distance of the curve.* link
+//	--network topology [--threads T]	simulate a trusted node network
+//	--config file --kms socket [--shm name] [--key-size bits] [--capacity n]
+//						serve the link's key to local clients
+//	--kms-bench socket clients requests batch	load test a running service
+int runBatch(int argc, char** argv) {
+	string configPath, outDir = ".", mergeDir, topology, kmsSocket, shmName, benchSocket;
+	int shard = 0, shards = 1, mergeCount = 0;
+	int keyBits = 256, capacity = 65536, clients = 0, requests = 0, batch = 0;
+	int threads = max(1u, thread::hardware_concurrency());
+	bool forkShards = false, sharded = false, curve = false;
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		bool hasValue = (i+1 < argc);
+		if (arg == "--config" && hasValue) {
+			configPath = argv[++i];
+		} else if (arg == "--shard" && hasValue) {
+			if (sscanf(argv[++i], "%d/%d", &shard, &shards) != 2) {
+				cout << "Expected --shard k/N" << endl;
+				return 1;
+			}
+			sharded = true;
+		} else if (arg == "--shards" && hasValue) {
+			shards = atoi(argv[++i]);
+			forkShards = true;
+		} else if (arg == "--out" && hasValue) {
+			outDir = argv[++i];
+		} else if (arg == "--network" && hasValue) {
+			topology = argv[++i];
+		} else if (arg == "--threads" && hasValue) {
+			threads = max(1, atoi(argv[++i]));
+		} else if (arg == "--kms" && hasValue) {
+			kmsSocket = argv[++i];
+		} else if (arg == "--shm" && hasValue) {
+			shmName = argv[++i];
+		} else if (arg == "--key-size" && hasValue) {
+			keyBits = atoi(argv[++i]);
+		} else if (arg == "--capacity" && hasValue) {
+			capacity = atoi(argv[++i]);
+			if (capacity <= 0) {
+				cout << "Expected a positive --capacity" << endl;
+				return 1;
+			}
+		} else if (arg == "--kms-bench" && i+4 < argc) {
+			benchSocket = argv[++i];
+			clients = atoi(argv[++i]);
+			requests = atoi(argv[++i]);
+			batch = atoi(argv[++i]);
+		} else if (arg == "--curve") {
+			curve = true;
+		} else if (arg == "--merge" && i+2 < argc) {
+			mergeDir = argv[++i];
+			mergeCount = atoi(argv[++i]);
+		} else {
+			cout << "Unknown argument " << arg << endl;
+			return 1;
+		}
+	}
+	try {
+		if (!topology.empty()) {
+			runNetwork(topology, threads);
+		} else if (!kmsSocket.empty()) {
+			runKeyManagementService(SimulationConfig(configPath), kmsSocket, shmName, keyBits, capacity);
+		} else if (!benchSocket.empty()) {
+			return runKeyManagementBenchmark(benchSocket, clients, requests, batch);
+		} else if (!mergeDir.empty()) {
+			mergeShards(mergeDir, mergeCount);
+		} else if (curve) {
+			runKeyRateCurve(SimulationConfig(configPath));
+		} else if (findProtocol(SimulationConfig(configPath).get("protocol")) == nullptr) {
+			// Checked before forking, whose children would only fail at the merge
+			if (forkShards || sharded) {
+				cout << "Entangled protocols can not be sharded" << endl;
+				return 1;
+			}
+			runEntangledProtocol(SimulationConfig(configPath));
+		} else if (forkShards) {
+			runShardsLocally(argv[0], configPath, shards, outDir);
+		} else {
+			runShard(SimulationConfig(configPath), shard, shards, outDir);
+		}
+	} catch (int) {
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	seedRng(time(NULL));
+#ifdef QKDSIM_METRICS
+	if (getenv("QKDSIM_METRICS_INTERVAL") != NULL) {
+		Metrics::setDumpInterval(atoll(getenv("QKDSIM_METRICS_INTERVAL")));
+	}
+#endif
+	if (argc > 1) {
+		return runBatch(argc, argv);
+	}
 
 	auto idealPNF = new IdealPulseNumberFactory();
 	auto idealBCF = new IdealBasisChoiceFactory();
@@ -52,7 +388,7 @@ int main() {
 		cout << "(5) Add  Detectors" << endl;
 		cout << "(6) Add  Channels" << endl;
 		cout << "(7) Run a QKD algorithm" << endl;
-		cout << "(8) Turn Debug statements " << (DEBUGPRINT?"Off":"On") << endl;
+		cout << "(8) Turn Debug statements " << (PulseTrace::enabled()?"Off":"On") << endl;
 		cout << "What would you like to do:";
 		int choice;
 		cin >> choice;
@@ -89,6 +425,8 @@ int main() {
 					cout << index << ") " << info.name << endl;
 					cout << "\tAbsorption Rate Factory: " << info.AbsorptionRateFactoryName << endl;
 					cout << "\tState Deviation Transformer: " << info.stateDeviationTransformerName << endl;
+					cout << "\tNoise Model: " << info.noiseModelName << endl;
+					cout << "\tPolarization Drift: " << info.driftName << endl;
 					cout << endl;
 					index++;
 				}
@@ -133,414 +471,112 @@ int main() {
 				
 				auto arf = chooseAbsorptionRateFactory();
 				auto sdt = chooseStateDeviationTransformer();
+				auto nm  = chooseNoiseModel();
+				bool analytic = false;
+				if (nm != nullptr) {
+					cout << "Pass outcome probabilities straight to the detector instead of sampling photon states (1/0): ";
+					cin >> analytic;
+				}
 
 				cout << "Name the generator: ";
 				string name;
 				cin >> name;
 
-				auto channel = new Channel(arf, sdt);
-				Channels.push_back(ChannelInfo(name, channel, arf->name, sdt->name));
+				auto drift = choosePolarizationDrift();
+
+				auto channel = new Channel(arf, sdt, nm, analytic);
+				channel->setDrift(drift);
+				Channels.push_back(ChannelInfo(name, channel, arf->name, sdt->name,
+											   (nm != nullptr) ? nm->name + (analytic ? " (analytic)" : "") : "None",
+											   (drift != nullptr) ? drift->name : "None"));
 				break;
 			}
 			case 7:{
 				// Run Algorithm
-				int index;
 				int choice;
 
 				cout << "(1) Standard (No Eve)" << endl;
 				cout << "(2) Photon Splitting Attack" << endl;
-				cout << "(3) Naive Eve" << endl;
+				cout << "(3) Naive Eve (Intercept-Resend)" << endl;
+				cout << "(4) Beam Splitting Attack" << endl;
+				cout << "(5) Unambiguous State Discrimination Attack" << endl;
+				cout << "(6) Compare several scenarios on one pulse stream" << endl;
 				cout << "Choose which algortihm to run: ";
 				cin >> choice;
+				if (choice <= 0 || choice > 6) {
+					cout << "Not implemented yet!" << endl;
+					break;
+				}
 
-				switch(choice) {
-					case 1: {	
-						// No Eve
-
-						index = 1;
-						for (auto info: Generators) {
-							cout << index << ")" << info.name << endl;
-							index++;
-						}
-						cout << "Choose which generator to use: ";
-						cin >> choice;
-						if (choice <= 0 || choice > Generators.size()){
-							cout << "Out of Index generator choice" << endl;
-							throw -1;
-						}
-						auto generator = Generators[choice-1].generator;
-
-						index = 1;
-						for (auto info: Detectors) {
-							cout << index << ")" << info.name << endl;
-							index++;
-						}
-						cout << "Choose which detector to use: ";
-						cin >> choice;
-						if (choice <= 0 || choice > Detectors.size()){
-							cout << "Out of Index detector choice" << endl;
-							throw -1;
-						}
-						auto detector = Detectors[choice-1].detector;
-
-						index = 1;
-						for (auto info: Channels) {
-							cout << index << ")" << info.name << endl;
-							index++;
-						}
-						cout << "Choose which channel to use: ";
-						cin >> choice;
-						if (choice <= 0 || choice > Channels.size()){
-							cout << "Out of Index channel choice" << endl;
-							throw -1;
-						}
-						auto channel = Channels[choice-1].channel;
-
-						cout << "(1)Generate random bitstring to transmit" << endl;
-						cout << "(2)Manually input bitstring to transmit" << endl;
-						cout << "Choose:";
-						cin >> choice;
-
-						string bitstring;
-						switch (choice) {
-							case 1: {
-								cout << "Enter bitstring length: ";
-								int len;
-								cin >> len;
-								for (int i = 0; i < len; ++i) {
-									bitstring += (rand()%2 == 0) ? "1":"0";
-								}
-								break;
-							}
-							case 2: {
-								// TODO: add check if string entered is bitstring
-								cin >> bitstring;
-								break;
-							}
-							default:{
-								cout << "Invalid choice for bitstring" << endl;
-								throw -1;
-							}
-						}
-
-						cout << "(1)Generate random basis chocies to transmit" << endl;
-						cout << "(2)Manually input basis choices as bitstring" << endl;
-						cout << "Choose:";
-						cin >> choice;
-
-						string sourceBasisChoiceString;
-						switch (choice) {
-							case 1: {
-								sourceBasisChoiceString = "auto";
-								break;
-							}
-							case 2: {
-								// TODO: add check if string entered is bitstring
-								cin >> sourceBasisChoiceString;
-								if (sourceBasisChoiceString.size() != bitstring.size()){
-									cout << "Mismatch in length of bitstring and basis choice bitstring" << endl;
-									throw -1;
-								}
-								break;
-							}
-							default:{
-								cout << "Invalid choice for basis choice bitstring" << endl;
-								throw -1;
-							}
-						}
-
-						cout << "(1)Generate random basis chocies for detector" << endl;
-						cout << "(2)Manually input basis choices for detector" << endl;
-						cout << "Choose:";
-						cin >> choice;
-
-						string detectorBasisChoiceString;
-						switch (choice) {
-							case 1: {
-								detectorBasisChoiceString = "auto";
-								break;
-							}
-							case 2: {
-								// TODO: add check if string entered is bitstring
-								cin >> detectorBasisChoiceString;
-								if (detectorBasisChoiceString.size() != bitstring.size()){
-									cout << "Mismatch in length of bitstring and basis choice bitstring" << endl;
-									throw -1;
-								}
-								break;
-							}
-							default:{
-								cout << "Invalid choice for basis choice bitstring" << endl;
-								throw -1;
-							}
-						}
-
-						cout << "Source Bitstring:" << endl;
-						cout << bitstring << endl;	
-						string transmittedString = "";
-						for (int i = 0; i < bitstring.size(); ++i) {
-							bool bit = (bitstring[i] == '1');
-							Pulse pulse = generator->createPulse(bit);
-							pulse = (sourceBasisChoiceString == "auto") ? 
-									 generator->createPulse(bit) :
-									 generator->createPulse(bit, sourceBasisChoiceString[i]=='1');
-							pulse = channel->propagate(pulse);
-							if (DEBUGPRINT) {
-								cout << "Pulse #" << i << ": ";
-								for (int i = 0; i < pulse.size(); ++i) {
-									cout << pulse[i]->alpha << ',' << pulse[i]->beta << "|";
-								}
-								cout << endl;
-							}
-							if (pulse.size() > 0) {
-								bool observation = (((detectorBasisChoiceString == "auto")?
-									 detector->detectPulse(pulse)
-									:detector->detectPulse(pulse, detectorBasisChoiceString[i])=='1') == 1);
-								if (DEBUGPRINT) {
-									cout << "Algo observation: " << observation << endl;
-									cout << "Transmitted so far: " << transmittedString << endl;
-								}
-								transmittedString += (observation) ? "1":"0";
-							}
-						}
-
-						cout << "Transmitted String:" << endl;
-						cout << transmittedString << endl;
-
-						int matching = 0;
-						for (int i = 0; i < transmittedString.size(); ++i) {
-							if (transmittedString[i] == bitstring[i])
-								matching++;
-						}
-						cout << "Accuracy of transmission: " << (matching*100.0/bitstring.size()) << "%" << endl;
-						break;
-					}
-					case 2: {	
-						// Photon Splitting Attack
-
-						index = 1;
-						for (auto info: Generators) {
-							cout << index << ")" << info.name << endl;
-							index++;
-						}
-						cout << "Choose Alice's generator: ";
-						cin >> choice;
-						if (choice <= 0 || choice > Generators.size()){
-							cout << "Out of Index generator choice" << endl;
-							throw -1;
-						}
-						auto generator = Generators[choice-1].generator;
-
-						index = 1;
-						for (auto info: Detectors) {
-							cout << index << ")" << info.name << endl;
-							index++;
-						}
-						cout << "Choose Bob's detector to use: ";
-						cin >> choice;
-						if (choice <= 0 || choice > Detectors.size()){
-							cout << "Out of Index detector choice" << endl;
-							throw -1;
-						}
-						auto detector = Detectors[choice-1].detector;
-
-						index = 1;
-						for (auto info: Detectors) {
-							cout << index << ")" << info.name << endl;
-							index++;
-						}
-						cout << "Choose Eve's detector to use: ";
-						cin >> choice;
-						if (choice <= 0 || choice > Detectors.size()){
-							cout << "Out of Index Edetector choice" << endl;
-							throw -1;
-						}
-						auto Edetector = Detectors[choice-1].detector;
-
-
-						index = 1;
-						for (auto info: Generators) {
-							cout << index << ")" << info.name << endl;
-							index++;
-						}
-						cout << "Choose Eve's generator: ";
-						cin >> choice;
-						if (choice <= 0 || choice > Generators.size()){
-							cout << "Out of Index Egenerator choice" << endl;
-							throw -1;
-						}
-						auto Egenerator = Generators[choice-1].generator;
-
-						index = 1;
-						for (auto info: Channels) {
-							cout << index << ")" << info.name << endl;
-							index++;
-						}
-						cout << "Choose which channel to use: ";
-						cin >> choice;
-						if (choice <= 0 || choice > Channels.size()){
-							cout << "Out of Index channel choice" << endl;
-							throw -1;
-						}
-						auto channel = Channels[choice-1].channel;
-
-						cout << "(1)Generate random bitstring to transmit" << endl;
-						cout << "(2)Manually input bitstring to transmit" << endl;
-						cout << "Choose:";
-						cin >> choice;
-
-						string bitstring;
-						switch (choice) {
-							case 1: {
-								cout << "Enter bitstring length: ";
-								int len;
-								cin >> len;
-								for (int i = 0; i < len; ++i) {
-									bitstring += (rand()%2 == 0) ? "1":"0";
-								}
-								break;
-							}
-							case 2: {
-								// TODO: add check if string entered is bitstring
-								cin >> bitstring;
-								break;
-							}
-							default:{
-								cout << "Invalid choice for bitstring" << endl;
-								throw -1;
-							}
-						}
-
-						cout << "(1)Generate random basis chocies to transmit" << endl;
-						cout << "(2)Manually input basis choices as bitstring" << endl;
-						cout << "Choose:";
-						cin >> choice;
-
-						string sourceBasisChoiceString;
-						switch (choice) {
-							case 1: {
-								sourceBasisChoiceString = "auto";
-								break;
-							}
-							case 2: {
-								// TODO: add check if string entered is bitstring
-								cin >> sourceBasisChoiceString;
-								if (sourceBasisChoiceString.size() != bitstring.size()){
-									cout << "Mismatch in length of bitstring and basis choice bitstring" << endl;
-									throw -1;
-								}
-								break;
-							}
-							default:{
-								cout << "Invalid choice for basis choice bitstring" << endl;
-								throw -1;
-							}
-						}
-
-						cout << "(1)Generate random basis chocies for detector" << endl;
-						cout << "(2)Manually input basis choices for detector" << endl;
-						cout << "Choose:";
-						cin >> choice;
-
-						string detectorBasisChoiceString;
-						switch (choice) {
-							case 1: {
-								detectorBasisChoiceString = "auto";
-								break;
-							}
-							case 2: {
-								// TODO: add check if string entered is bitstring
-								cin >> detectorBasisChoiceString;
-								if (detectorBasisChoiceString.size() != bitstring.size()){
-									cout << "Mismatch in length of bitstring and basis choice bitstring" << endl;
-									throw -1;
-								}
-								break;
-							}
-							default:{
-								cout << "Invalid choice for basis choice bitstring" << endl;
-								throw -1;
-							}
-						}
-
-						cout << "Source Bitstring:" << endl;
-						cout << bitstring << endl;	
-						string transmittedString = "";
-						string interceptedString = "";
-						for (int i = 0; i < bitstring.size(); ++i) {
-							bool bit = (bitstring[i] == '1');
-							Pulse pulse = generator->createPulse(bit);
-							pulse = (sourceBasisChoiceString == "auto") ? 
-									 generator->createPulse(bit) :
-									 generator->createPulse(bit, sourceBasisChoiceString[i]=='1');
-							pulse = channel->propagate(pulse);
-							auto splitPhoton = pulse.extract();
-							bool observation = Edetector->detectPulse(Pulse(splitPhoton));
-							interceptedString +=  (observation) ? "1":"0";
-							if (pulse.size() == 0) {
-								if (DEBUGPRINT) {
-									cout << "Intercepted Single qubit pulse, Eve constructing new pulse" << endl;
-								}
-								pulse = Egenerator->createPulse(observation);
-							}
-							if (DEBUGPRINT) {
-								cout << "Pulse #" << i << ": ";
-								for (int i = 0; i < pulse.size(); ++i) {
-									cout << pulse[i]->alpha << ',' << pulse[i]->beta << "|";
-								}
-								cout << endl;
-							}
-							if (pulse.size() > 0) {
-								if (detectorBasisChoiceString == "auto") {
-									observation = (detector->detectPulse(pulse) == 1);
-								} else {
-									bool basisChoice = (detectorBasisChoiceString[i]=='1');
-									observation = (detector->detectPulse(pulse, basisChoice) == 1);
-								}
-								if (DEBUGPRINT) {
-									cout << "Algo observation: " << observation << endl;
-									cout << "Transmitted so far: " << transmittedString << endl;
-								}
-								transmittedString += (observation) ? "1":"0";
-							}
-						}
-
-						cout << "Transmitted String:" << endl;
-						cout << transmittedString << endl;
-						cout << "interceptedString" << endl;
-						cout << interceptedString << endl;
-
-						int matching = 0;
-						for (int i = 0; i < transmittedString.size(); ++i) {
-							if (transmittedString[i] == bitstring[i])
-								matching++;
-						}
-						cout << "Accuracy of Bob's bitstring: " << (matching*100.0/bitstring.size()) << "%" << endl;
-						matching = 0;
-						for (int i = 0; i < interceptedString.size(); ++i) {
-							if (interceptedString[i] == bitstring[i])
-								matching++;
-						}
-						cout << "Accuracy of Eve's bitstring: " << (matching*100.0/bitstring.size()) << "%" << endl;
-						matching = 0;
-						for (int i = 0; i < transmittedString.size(); ++i) {
-							if (transmittedString[i] == interceptedString[i])
-								matching++;
-						}
-						cout << "Correlation between Eve's and Bob's bitstring: " << (matching*100.0/bitstring.size()) << "%" << endl;
-						break;
+				auto generator = chooseGenerator(Generators, "Choose Alice's generator: ");
+
+				if (choice == 6) {
+					cout << "How many scenarios: ";
+					int scenarioCount;
+					cin >> scenarioCount;
+					vector<Scenario> scenarios;
+					for (int s = 1; s <= scenarioCount; ++s) {
+						cout << "Scenario " << s << ":" << endl;
+						cout << "(1) Standard (No Eve)" << endl;
+						cout << "(2) Photon Splitting Attack" << endl;
+						cout << "(3) Naive Eve (Intercept-Resend)" << endl;
+						cout << "(4) Beam Splitting Attack" << endl;
+						cout << "(5) Unambiguous State Discrimination Attack" << endl;
+						cout << "Choose: ";
+						int algorithm;
+						cin >> algorithm;
+						auto detector = chooseDetector(Detectors, "Choose Bob's detector to use: ");
+						auto attack = chooseAttack(algorithm, Generators, Detectors);
+						auto channel = chooseChannel(Channels, "Choose which channel to use: ");
+						string name = "Scenario " + to_string(s) + " (" + (attack ? attack->name : "No Eve") + ")";
+						scenarios.push_back(Scenario(name, channel, attack, detector));
 					}
-					default:{
-						cout << "Not implemented yet!" << endl;
-						break;
+					auto input = readSimulationInput();
+					auto results = runScenarios(generator, scenarios, input);
+					printScenarioComparison(input, scenarios, results);
+					for (auto& scenario : scenarios) {
+						delete scenario.attack;
 					}
+					break;
 				}
 
+				auto detector = chooseDetector(Detectors, "Choose Bob's detector to use: ");
+				auto attack = chooseAttack(choice, Generators, Detectors);
+				auto channel = chooseChannel(Channels, "Choose which channel to use: ");
+				bool seedGiven;
+				auto input = readSimulationInput(&seedGiven);
+				// Only a typed seed can be repeated, and the cache keeps just
+				// the last run's blocks. Generator and channel objects live for
+				// the whole session, so their addresses identify them
+				static StageCache sessionCache;
+				if (seedGiven) {
+					input.stageCache = &sessionCache;
+					input.upstream = "generator=" + to_string((uintptr_t) generator) + ";channel="
+								   + to_string((uintptr_t) channel) + ";";
+				}
+
+				auto result = runSimulation(generator, channel, attack, detector, input);
+				cout << "Source Bitstring:" << endl;
+				cout << result.bits << endl;
+				printSimulationResult(input, result, attack != nullptr);
+				delete attack;
 				break;
 			}
 			case 8:{
 				// Toggle Debug printing
-				DEBUGPRINT = !DEBUGPRINT;
+				if (!LogPolicy<LOG_LEVEL_TRACE>::compiled) {
+					cout << "Debug statements were compiled out (QKDSIM_LOG_LEVEL)" << endl;
+				} else if (PulseTrace::enabled()) {
+					PulseTrace::configure(0, 0);
+				} else {
+					cout << "Trace 1 in how many pulses: ";
+					long long stride;
+					cin >> stride;
+					cout << "How many traced pulses to keep (0 prints every traced pulse): ";
+					int reservoir;
+					cin >> reservoir;
+					PulseTrace::configure(stride, reservoir);
+				}
 				break;
 			}
 			default:{
@@ -0,0 +1,270 @@
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#include "qsimapi.h"
+#include "devices.h"
+#include "factories.h"
+#include "transformers.h"
+#include "noise.h"
+#include "protocol.h"
+#include "simulation.h"
+#include "attacks.h"
+#include "rng.h"
+
+using namespace std;
+
+
+struct qsim_link {
+	Generator *generator;
+	Channel *channel;
+	Detector *detector;
+	Attack *attack;
+	SimulationInput input;
+	int threads;
+	// Stream and index of the block the next call starts at
+	Rng nextStream;
+	long long nextBlock;
+	// Everything built for the link, deleted as what it was built as (the
+	// device classes neither own their parts nor have virtual destructors)
+	vector<shared_ptr<void> > owned;
+
+	template<typename T>
+	T* own(T *object) {
+		owned.push_back(shared_ptr<void>(object));
+		return object;
+	}
+};
+
+static thread_local string lastError;
+
+// Parameters are checked here rather than by the device constructors, which
+// report on cout
+static void require(bool valid, const char *message) {
+	if (!valid)
+		throw invalid_argument(message);
+}
+static bool probability(double p) {
+	return 0 <= p && p <= 1;
+}
+
+// Parameters as the caller's (possibly older, shorter) struct gives them,
+// the rest from the defaults
+template<typename T>
+static T readParams(const T *given, void (*defaults)(T*)) {
+	T params;
+	defaults(&params);
+	if (given != nullptr)
+		memcpy(&params, given, min<size_t>(given->size, sizeof(T)));
+	params.size = sizeof(T);
+	return params;
+}
+
+static Generator* buildGenerator(qsim_link *link, const qsim_generator_params& params) {
+	require(probability(params.diagonal_probability), "diagonal_probability must be in [0,1]");
+	require(params.mean_photons >= 0, "mean_photons must not be negative");
+	IntFactory *pulses;
+	if (params.decoy_mu > 0) {
+		require(0 < params.decoy_nu && params.decoy_nu < params.decoy_mu && params.decoy_p_mu >= 0
+				&& params.decoy_p_nu >= 0 && params.decoy_p_mu + params.decoy_p_nu <= 1,
+				"Decoy states need 0 < decoy_nu < decoy_mu and class probabilities summing to at most 1");
+		pulses = link->own(new DecoyPulseNumberFactory(params.decoy_mu, params.decoy_nu, params.decoy_p_mu,
+													   params.decoy_p_nu));
+	} else if (params.mean_photons > 0) {
+		pulses = link->own(new ImportancePoissonPulseNumberFactory(params.mean_photons, params.mean_photons));
+	} else {
+		pulses = link->own(new IdealPulseNumberFactory());
+	}
+	BoolFactory *bases;
+	if (params.diagonal_probability == 0.5)
+		bases = link->own(new IdealBasisChoiceFactory());
+	else
+		bases = link->own(new BiasedBasisChoiceFactory(params.diagonal_probability));
+	return link->own(new Generator(pulses, bases, link->own(new IdealStateDeviationTransformer())));
+}
+static Channel* buildChannel(qsim_link *link, const qsim_channel_params& params) {
+	require(probability(params.loss), "Channel loss must be a probability");
+	require(probability(params.depolarizing) && probability(params.dephasing),
+			"Channel noise parameters must be probabilities");
+	require(params.depolarizing == 0 || params.dephasing == 0, "At most one channel noise model");
+	BoolFactory *absorption;
+	if (params.loss > 0)
+		absorption = link->own(new PercentAbsorptionRateFactory(params.loss*100));
+	else
+		absorption = link->own(new IdealAbsorptionRateFactory());
+	NoiseModel *noise = nullptr;
+	if (params.depolarizing > 0)
+		noise = link->own(new DepolarizingNoiseModel(params.depolarizing));
+	else if (params.dephasing > 0)
+		noise = link->own(new DephasingNoiseModel(params.dephasing));
+	return link->own(new Channel(absorption, link->own(new IdealStateDeviationTransformer()), noise,
+								 params.analytic != 0));
+}
+static Detector* buildDetector(qsim_link *link, const qsim_detector_params& params) {
+	require(probability(params.diagonal_probability), "diagonal_probability must be in [0,1]");
+	require(probability(params.dark_probability), "dark_probability must be in [0,1]");
+	BoolFactory *bases;
+	if (params.diagonal_probability == 0.5)
+		bases = link->own(new IdealBasisChoiceFactory());
+	else
+		bases = link->own(new BiasedBasisChoiceFactory(params.diagonal_probability));
+	BasisTransformer *deviation;
+	if (params.misalignment != 0)
+		deviation = link->own(new FixedMisalignmentBasisTransformer(params.misalignment));
+	else
+		deviation = link->own(new IdealBasisDeviationTransformer());
+	auto detector = link->own(new Detector(0, link->own(new IdealQuantumEfficiencyFactory()), bases, deviation));
+	detector->setDarkCountProbability(params.dark_probability);
+	return detector;
+}
+// As the attack config key: none, intercept, pns, usd or beamsplit:fraction
+static Attack* buildAttack(qsim_link *link, string spec, const Protocol& protocol) {
+	if (spec == "none")
+		return nullptr;
+	require(protocol.name == bb84Protocol().name, "Attacks are only modelled for the bb84 protocol");
+	auto eveDetector = link->own(new Detector(0, link->own(new IdealQuantumEfficiencyFactory()),
+											  link->own(new IdealBasisChoiceFactory()),
+											  link->own(new IdealBasisDeviationTransformer())));
+	auto eveGenerator = link->own(new Generator(link->own(new IdealPulseNumberFactory()),
+												link->own(new IdealBasisChoiceFactory()),
+												link->own(new IdealStateDeviationTransformer())));
+	if (spec == "intercept")
+		return link->own(new InterceptResendAttack(eveDetector, eveGenerator));
+	if (spec == "pns")
+		return link->own(new PhotonNumberSplittingAttack(eveDetector, eveGenerator));
+	if (spec == "usd")
+		return link->own(new UnambiguousStateDiscriminationAttack(eveDetector, eveGenerator));
+	if (spec.compare(0, 10, "beamsplit:") == 0) {
+		char *end;
+		double fraction = strtod(spec.c_str() + 10, &end);
+		require(end != spec.c_str() + 10 && *end == '\0' && probability(fraction),
+				"beamsplit needs a fraction in [0,1]");
+		return link->own(new BeamSplittingAttack(eveDetector, fraction));
+	}
+	throw invalid_argument("Unknown attack " + spec);
+}
+
+extern "C" {
+
+int qsim_api_version(void) {
+	return QSIM_API_VERSION;
+}
+
+void qsim_generator_defaults(qsim_generator_params *params) {
+	memset(params, 0, sizeof(*params));
+	params->size = sizeof(*params);
+	params->diagonal_probability = 0.5;
+}
+void qsim_channel_defaults(qsim_channel_params *params) {
+	memset(params, 0, sizeof(*params));
+	params->size = sizeof(*params);
+}
+void qsim_detector_defaults(qsim_detector_params *params) {
+	memset(params, 0, sizeof(*params));
+	params->size = sizeof(*params);
+	params->diagonal_probability = 0.5;
+}
+void qsim_run_defaults(qsim_run_params *params) {
+	memset(params, 0, sizeof(*params));
+	params->size = sizeof(*params);
+	params->seed = 1;
+	params->threads = 1;
+}
+
+qsim_link* qsim_link_create(const qsim_generator_params *generator, const qsim_channel_params *channel,
+							const qsim_detector_params *detector, const qsim_run_params *run) {
+	qsim_link *link = nullptr;
+	try {
+		auto generatorParams = readParams(generator, qsim_generator_defaults);
+		auto channelParams = readParams(channel, qsim_channel_defaults);
+		auto detectorParams = readParams(detector, qsim_detector_defaults);
+		auto runParams = readParams(run, qsim_run_defaults);
+		string protocolName = runParams.protocol ? runParams.protocol : "bb84";
+		const Protocol *protocol = findProtocol(protocolName);
+		if (protocol == nullptr)
+			throw invalid_argument("Unknown protocol " + protocolName);
+		link = new qsim_link();
+		link->generator = buildGenerator(link, generatorParams);
+		link->channel = buildChannel(link, channelParams);
+		link->detector = buildDetector(link, detectorParams);
+		link->attack = buildAttack(link, runParams.attack ? runParams.attack : "none", *protocol);
+		link->input.protocol = protocol;
+		link->input.seed = runParams.seed;
+		link->input.keepStrings = false;
+		link->threads = max(1, runParams.threads);
+		link->nextStream = Rng(runParams.seed);
+		link->nextBlock = 0;
+		return link;
+	} catch (const exception& e) {
+		lastError = e.what();
+	} catch (...) {
+		lastError = "Invalid link parameters";
+	}
+	delete link;
+	return nullptr;
+}
+
+void qsim_link_destroy(qsim_link *link) {
+	delete link;
+}
+
+int qsim_run(qsim_link *link, uint64_t pulses, uint64_t *alice_key, uint64_t *bob_key,
+			 uint64_t key_capacity_bits, qsim_counters *counters) {
+	if (link == nullptr) {
+		lastError = "No link";
+		return -1;
+	}
+	long long blocks = (pulses + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	SimulationInput& input = link->input;
+	input.firstBlock = link->nextBlock;
+	input.blockCount = blocks;
+	input.length = link->nextBlock * BLOCK_SIZE + pulses;
+	input.firstBlockStream = &link->nextStream;
+	// Threads beyond the blocks there are would only be started and joined
+	input.threads = (int) min<long long>(link->threads, max(1LL, blocks));
+	SimulationResult result;
+	try {
+		result = runSimulation(link->generator, link->channel, link->attack, link->detector, input);
+	} catch (const exception& e) {
+		lastError = string("Simulation failed: ") + e.what();
+		return -1;
+	} catch (...) {
+		lastError = "Simulation failed";
+		return -1;
+	}
+	for (long long b = 0; b < blocks; ++b)
+		link->nextStream.jump();
+	link->nextBlock += blocks;
+
+	long long keyBits = min<long long>(result.aliceKey.size, key_capacity_bits);
+	long long fullWords = keyBits / 64;
+	int rest = keyBits % 64;
+	uint64_t mask = (1ULL << rest) - 1;
+	for (auto buffer : {make_pair(alice_key, &result.aliceKey), make_pair(bob_key, &result.bobKey)}) {
+		if (buffer.first == nullptr)
+			continue;
+		memcpy(buffer.first, buffer.second->words.data(), fullWords * sizeof(uint64_t));
+		if (rest > 0)
+			buffer.first[fullWords] = buffer.second->words[fullWords] & mask;
+	}
+	if (counters != nullptr) {
+		counters->pulses = result.detectionRate.trials;
+		counters->detections = result.detectionRate.successes;
+		counters->sifted = result.qber.trials;
+		counters->errors = result.qber.successes;
+		counters->eve_compared = result.eveAgreement.trials;
+		counters->eve_agreed = result.eveAgreement.successes;
+		counters->key_bits = keyBits;
+	}
+	return 0;
+}
+
+const char* qsim_last_error(void) {
+	return lastError.c_str();
+}
+
+}
@@ -0,0 +1,120 @@
+#ifndef _QSIMAPI_H_
+#define _QSIMAPI_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * C interface of libqsim for embedding the simulator. A link is a
+ * generator, channel and detector (and optionally Eve) built from the
+ * parameter structs below; qsim_run simulates the next pulses of it and
+ * writes the counters and sifted keys into the caller's buffers.
+ *
+ * Successive calls on a link continue one run: each call starts at the
+ * next block of BLOCK_SIZE pulses of the seed's streams, so a link gives
+ * the same keys for the same sequence of call sizes whatever the number
+ * of threads. Calls on different links may run concurrently; calls on
+ * one link may not.
+ *
+ * Every parameter struct starts with its size. Fill it with the
+ * qsim_*_defaults function (which sets size) and change what you need;
+ * later versions only append fields, and read the ones a caller built
+ * against an older header does not have from the defaults.
+ */
+
+#define QSIM_API_VERSION 1
+
+typedef struct {
+	uint32_t size;
+	/* 0 for exactly one photon per pulse, else Poisson with this mean */
+	double mean_photons;
+	/* When decoy_mu > 0: Poisson(decoy_mu) signals, Poisson(decoy_nu)
+	   decoys and vacuum, with probabilities decoy_p_mu, decoy_p_nu and
+	   the rest (overrides mean_photons) */
+	double decoy_mu;
+	double decoy_nu;
+	double decoy_p_mu;
+	double decoy_p_nu;
+	/* Probability of preparing in the diagonal basis */
+	double diagonal_probability;
+} qsim_generator_params;
+
+typedef struct {
+	uint32_t size;
+	/* Probability that each photon is absorbed */
+	double loss;
+	/* At most one of the two noise models */
+	double depolarizing;
+	double dephasing;
+	/* Non-zero to propagate density matrices (see Channel) */
+	int analytic;
+} qsim_channel_params;
+
+typedef struct {
+	uint32_t size;
+	/* Probability of measuring in the diagonal basis */
+	double diagonal_probability;
+	/* Fixed rotation of the measurement bases, radians */
+	double misalignment;
+	/* Probability of a dark click in a slot with no detection */
+	double dark_probability;
+} qsim_detector_params;
+
+typedef struct {
+	uint32_t size;
+	/* "bb84" (or NULL), "sixstate", "b92" or "sarg04" */
+	const char *protocol;
+	/* NULL or "none", "intercept", "pns", "usd", "beamsplit:fraction";
+	   attacks need protocol "bb84" */
+	const char *attack;
+	uint64_t seed;
+	int threads;
+} qsim_run_params;
+
+typedef struct {
+	uint64_t pulses;
+	uint64_t detections;
+	/* Sifted bits and the errors among them */
+	uint64_t sifted;
+	uint64_t errors;
+	/* Sifted bits where Eve has a bit too, and those equal to Bob's */
+	uint64_t eve_compared;
+	uint64_t eve_agreed;
+	/* Key bits written to each key buffer, at most its capacity */
+	uint64_t key_bits;
+} qsim_counters;
+
+typedef struct qsim_link qsim_link;
+
+int qsim_api_version(void);
+
+void qsim_generator_defaults(qsim_generator_params *params);
+void qsim_channel_defaults(qsim_channel_params *params);
+void qsim_detector_defaults(qsim_detector_params *params);
+void qsim_run_defaults(qsim_run_params *params);
+
+/* NULL for any of them means its defaults. Returns NULL for invalid
+   parameters, see qsim_last_error. Nothing is printed to stdout. */
+qsim_link* qsim_link_create(const qsim_generator_params *generator, const qsim_channel_params *channel,
+							const qsim_detector_params *detector, const qsim_run_params *run);
+/* Frees the link and everything it was built with */
+void qsim_link_destroy(qsim_link *link);
+
+/* Simulates the link's next pulses pulses. Alice's and Bob's sifted keys
+   go to alice_key and bob_key (either may be NULL), bit i in word i/64 at
+   position i%64, up to key_capacity_bits bits each. Returns 0, or -1 with
+   qsim_last_error set. */
+int qsim_run(qsim_link *link, uint64_t pulses, uint64_t *alice_key, uint64_t *bob_key,
+			 uint64_t key_capacity_bits, qsim_counters *counters);
+
+/* Message of the calling thread's last failure */
+const char* qsim_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
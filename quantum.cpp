@@ -1,7 +1,10 @@
 #include <random>
 #include <iostream>
+#include <algorithm>
 
 #include "quantum.h"
+#include "logging.h"
+#include "rng.h"
 
 using namespace std;
 
@@ -11,20 +14,17 @@ bool Qubit::perform_measure(amplitude zero_amp, amplitude one_amp) {
 	int probA = (int) (norm(zero_amp) * (1<<((sizeof(int)*4)-1)));
 	int probB = (int) (norm(one_amp)  * (1<<((sizeof(int)*4)-1)));
 
-	int randValue = rand() % (probA+probB);
+	int randValue = rng().below(probA+probB);
 	if (randValue < probA) {
 		observation = false;
 	} else {
 		observation = true;
 	}
-	if (DEBUGPRINT) {
-		cout << "qubit:" << alpha << "," << beta << " observed to be " << observation << "(";
-		cout << probA << "," << probB << "," << randValue << ")" << endl;
-	}
+	TRACE("qubit:" << alpha << "," << beta << " observed to be " << observation << "("
+		<< probA << "," << probB << "," << randValue << ")");
 	return observation;
 }
-Qubit::Qubit(state s) {
-	Qubit(s.first, s.second);
+Qubit::Qubit(state s) : Qubit(s.first, s.second) {
 }
 Qubit::Qubit(amplitude a, amplitude b) {
 	double squareSum = norm(a) + norm(b);
@@ -51,7 +51,7 @@ bool Qubit::observe() {
 
 	return observation;
 }
-bool Qubit::observe(basis basisChoice) {
+void Qubit::decompose(basis basisChoice, amplitude& first_amp, amplitude& second_amp) {
 	state first_state, second_state;
 	first_state  = basisChoice.first;
 	second_state = basisChoice.second;
@@ -62,20 +62,43 @@ bool Qubit::observe(basis basisChoice) {
 	a2 = second_state.first;
 	b2 = second_state.second;
 
+	first_amp  = ((alpha*b2)-(beta*a2)) / ((a1*b2)-(b1*a2));
+	second_amp = ((alpha*b1)-(beta*a1)) / ((a2*b1)-(b2*a1));
+}
+void Qubit::collapse(basis basisChoice, bool observation) {
+	if (observation) {
+		alpha = basisChoice.second.first;
+		beta  = basisChoice.second.second;
+	} else {
+		alpha = basisChoice.first.first;
+		beta  = basisChoice.first.second;
+	}
+}
+bool Qubit::observe(basis basisChoice) {
 	amplitude new_alpha, new_beta;
-	new_alpha = ((alpha*b2)-(beta*a2)) / ((a1*b2)-(b1*a2));
-	new_beta  = ((alpha*b1)-(beta*a1)) / ((a2*b1)-(b2*a1));
-	// cout << new_alpha << "|" << new_beta << ":";
+	decompose(basisChoice, new_alpha, new_beta);
 
 	bool observation = perform_measure(new_alpha, new_beta);
-	if (observation) {
-		alpha = a2;
-		beta = b2;
+	collapse(basisChoice, observation);
+	return observation;
+}
+bool Qubit::observe(basis basisChoice, double minorityFloor, double& weight) {
+	amplitude new_alpha, new_beta;
+	decompose(basisChoice, new_alpha, new_beta);
+
+	double oneProb = norm(new_beta) / (norm(new_alpha) + norm(new_beta));
+	bool minority = (oneProb < 0.5);
+	double minorityProb = minority ? oneProb : 1-oneProb;
+	bool observation;
+	if (minorityProb > 0 && minorityProb < minorityFloor) {
+		bool drawMinority = rng().uniform() < minorityFloor;
+		weight *= drawMinority ? minorityProb/minorityFloor : (1-minorityProb)/(1-minorityFloor);
+		observation = drawMinority ? minority : !minority;
 	} else {
-		alpha = a1;
-		beta = b1;
+		observation = rng().uniform() < oneProb;
 	}
-
+	TRACE("qubit:" << alpha << "," << beta << " observed to be " << observation << " weight " << weight);
+	collapse(basisChoice, observation);
 	return observation;
 }
 void Qubit::changeState(amplitude a, amplitude b) {
@@ -96,35 +119,204 @@ void Qubit::changeState(state s) {
 }
 
 
-Pulse::Pulse() {
-	qubits = vector<Qubit*>();
+QubitPool::~QubitPool() {
+	for (auto q : spare) {
+		delete q;
+	}
 }
-Pulse::Pulse(vector<Qubit*>& _qubits) {
-	for (auto q : _qubits) {
-		qubits.push_back(q);
+Qubit* QubitPool::acquire(amplitude a, amplitude b) {
+	if (spare.empty()) {
+		return new Qubit(a, b);
 	}
+	Qubit *qubit = spare.back();
+	spare.pop_back();
+	qubit->changeState(a, b);
+	return qubit;
 }
-Pulse::Pulse(Qubit* qubit){
-	qubits.push_back(qubit);
+void QubitPool::recycle(Qubit *qubit) {
+	spare.push_back(qubit);
+}
+QubitPool& qubitPool() {
+	static thread_local QubitPool pool;
+	return pool;
+}
+
+
+Pulse::Pulse() {
+	photons = 0;
+}
+Pulse::Pulse(vector<Qubit*>&& _qubits) : qubits(move(_qubits)), counts(qubits.size(), 1) {
+	photons = qubits.size();
+}
+Pulse::~Pulse() {
+	// Empty pulses leave the pool alone, as thread_local ones may outlive it
+	if (!qubits.empty())
+		release();
+}
+Pulse::Pulse(Pulse&& other) : qubits(move(other.qubits)), counts(move(other.counts)) {
+	photons = other.photons;
+	other.photons = 0;
+}
+Pulse& Pulse::operator=(Pulse&& other) {
+	release();
+	qubits.swap(other.qubits);
+	counts.swap(other.counts);
+	std::swap(photons, other.photons);
+	return *this;
 }
 
 Qubit* Pulse::extract() {
+	photons--;
+	if (counts.back() > 1) {
+		counts.back()--;
+		return qubitPool().acquire(qubits.back()->alpha, qubits.back()->beta);
+	}
 	auto extractedQubit = qubits.back();
 	qubits.pop_back();
+	counts.pop_back();
 	return extractedQubit;
 }
-int Pulse::size() {
+int Pulse::size() const {
+	return photons;
+}
+int Pulse::groups() const {
 	return qubits.size();
 }
+Qubit* Pulse::group(int g) {
+	return qubits[g];
+}
+int Pulse::multiplicity(int g) const {
+	return counts[g];
+}
 void Pulse::insert(Qubit *qubit) {
 	qubits.push_back(qubit);
+	counts.push_back(1);
+	photons++;
+}
+void Pulse::insert(amplitude a, amplitude b) {
+	insert(a, b, 1);
+}
+void Pulse::insert(amplitude a, amplitude b, int count) {
+	qubits.push_back(qubitPool().acquire(a, b));
+	counts.push_back(count);
+	photons += count;
+}
+void Pulse::setMultiplicity(int g, int count) {
+	photons += count - counts[g];
+	counts[g] = count;
+}
+void Pulse::compact() {
+	size_t kept = 0;
+	for (size_t g = 0; g < qubits.size(); ++g) {
+		if (counts[g] > 0) {
+			std::swap(qubits[kept], qubits[g]);
+			std::swap(counts[kept], counts[g]);
+			kept++;
+		}
+	}
+	truncate(kept);
+}
+void Pulse::expand() {
+	size_t groupCount = qubits.size();
+	for (size_t g = 0; g < groupCount; ++g) {
+		for (; counts[g] > 1; counts[g]--) {
+			qubits.push_back(qubitPool().acquire(qubits[g]->alpha, qubits[g]->beta));
+			counts.push_back(1);
+		}
+	}
+}
+void Pulse::swap(int g, int h) {
+	std::swap(qubits[g], qubits[h]);
+	std::swap(counts[g], counts[h]);
+}
+void Pulse::truncate(int count) {
+	for (size_t g = count; g < qubits.size(); ++g) {
+		qubitPool().recycle(qubits[g]);
+		photons -= counts[g];
+	}
+	qubits.resize(min<size_t>(count, qubits.size()));
+	counts.resize(qubits.size());
+}
+void Pulse::release() {
+	truncate(0);
+}
+void Pulse::copyFrom(const Pulse& other) {
+	release();
+	for (size_t g = 0; g < other.qubits.size(); ++g) {
+		insert(other.qubits[g]->alpha, other.qubits[g]->beta, other.counts[g]);
+	}
+}
+Qubit* const* Pulse::data() const {
+	return qubits.data();
+}
+const int* Pulse::multiplicities() const {
+	return counts.data();
+}
+ostream& operator<<(ostream& out, Pulse& pulse) {
+	for (int g = 0; g < pulse.groups(); ++g) {
+		out << pulse.group(g)->alpha << ',' << pulse.group(g)->beta;
+		if (pulse.multiplicity(g) > 1)
+			out << 'x' << pulse.multiplicity(g);
+		out << "|";
+	}
+	return out;
 }
 Qubit* Pulse::operator[] (int idx) {
 	if (idx >= size()  || idx < 0){
 		cout << "Index " << idx << " is out of bounds (size=" <<  size() << ")";
 		cout << endl;
 		throw -1;
-	} else {
-		return qubits[idx];
 	}
-}
\ No newline at end of file
+	int g = 0;
+	for (; idx >= counts[g]; ++g) {
+		idx -= counts[g];
+	}
+	return qubits[g];
+}
+
+
+PulseView::PulseView(const Pulse& pulse) {
+	qubits = pulse.data();
+	counts = pulse.multiplicities();
+	groupCount = pulse.groups();
+	photons = pulse.size();
+}
+PulseView::PulseView(Qubit* const* first, int size) {
+	qubits = first;
+	counts = nullptr;
+	groupCount = size;
+	photons = size;
+}
+PulseView::PulseView(Qubit* const* first, const int* multiplicities, int groups) {
+	qubits = first;
+	counts = multiplicities;
+	groupCount = groups;
+	photons = 0;
+	for (int g = 0; g < groups; ++g) {
+		photons += counts[g];
+	}
+}
+int PulseView::size() const {
+	return photons;
+}
+int PulseView::groups() const {
+	return groupCount;
+}
+Qubit* PulseView::group(int g) const {
+	return qubits[g];
+}
+int PulseView::multiplicity(int g) const {
+	return (counts == nullptr) ? 1 : counts[g];
+}
+Qubit* PulseView::operator[] (int idx) const {
+	if (idx >= photons || idx < 0){
+		cout << "Index " << idx << " is out of bounds (size=" << photons << ")";
+		cout << endl;
+		throw -1;
+	}
+	int g = 0;
+	for (; idx >= multiplicity(g); ++g) {
+		idx -= multiplicity(g);
+	}
+	return qubits[g];
+}
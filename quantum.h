@@ -2,6 +2,7 @@
 #define _QUANTUM_H_
 
 #include <vector>
+#include <ostream>
 
 #include "constants.h"
 
@@ -10,6 +11,8 @@ using namespace std;
 class Qubit {
 private:
 	bool perform_measure(amplitude zero_amp, amplitude one_amp);
+	void decompose(basis basisChoice, amplitude& first_amp, amplitude& second_amp);
+	void collapse(basis basisChoice, bool observation);
 public:
 	amplitude alpha;
 	amplitude beta;
@@ -20,22 +23,98 @@ public:
 	Qubit(amplitude a, amplitude b);
 	bool observe();
 	bool observe(basis basisChoice);
+	// Importance sampled measurement: an outcome rarer than minorityFloor is
+	// drawn with probability minorityFloor instead, and weight is multiplied
+	// by the likelihood ratio of the outcome actually drawn.
+	bool observe(basis basisChoice, double minorityFloor, double& weight);
 	void changeState(amplitude a, amplitude b);
 	void changeState(state s);
 };
 
+// Recycles released photons so that, once warmed up, creating and
+// absorbing photons does not touch the heap. Each thread has its own pool
+// (qubitPool()), and a photon goes back to the pool of the thread that
+// releases it.
+class QubitPool {
+private:
+	vector<Qubit*> spare;
+public:
+	QubitPool() = default;
+	QubitPool(const QubitPool&) = delete;
+	QubitPool& operator=(const QubitPool&) = delete;
+	~QubitPool();
+	Qubit* acquire(amplitude a, amplitude b);
+	void recycle(Qubit *qubit);
+};
+QubitPool& qubitPool();
+
+// Owns its photons and can only be moved. Photons prepared in the same
+// state are stored once as a group with a multiplicity; stages that treat
+// photons individually expand() the pulse first. Releasing a pulse keeps
+// its storage, so a pulse slot that is refilled block after block stops
+// allocating after the first block.
 class Pulse {
 private:
 	vector<Qubit*> qubits;
+	vector<int> counts;
+	int photons;
 public:
 	Pulse();
-	Pulse(vector<Qubit*>& _qubits);
-	Pulse(Qubit* qubit);
+	explicit Pulse(vector<Qubit*>&& _qubits);
+	Pulse(const Pulse&) = delete;
+	Pulse& operator=(const Pulse&) = delete;
+	Pulse(Pulse&& other);
+	// Releases this pulse's own photons before taking other's
+	Pulse& operator=(Pulse&& other);
+	// Returns the photons to the pool of the thread it runs on
+	~Pulse();
 
+	// Removes one photon, which the caller then owns
 	Qubit* extract();
-	int size();
+	// Number of photons
+	int size() const;
+	int groups() const;
+	Qubit* group(int g);
+	int multiplicity(int g) const;
 	void insert(Qubit *qubit);
+	void insert(amplitude a, amplitude b);
+	void insert(amplitude a, amplitude b, int count);
+	// A group left with multiplicity 0 stays until compact()
+	void setMultiplicity(int g, int count);
+	void compact();
+	// Gives every photon its own group
+	void expand();
+	void swap(int g, int h);
+	// Returns every group after the first count to the pool
+	void truncate(int count);
+	void release();
+	// Replaces this pulse's photons with copies of other's
+	void copyFrom(const Pulse& other);
+	Qubit* const* data() const;
+	const int* multiplicities() const;
+	// The group holding photon idx
 	Qubit* operator[] (int idx);
 };
 
+// Non-owning view of consecutive groups of photons: a whole pulse, part of
+// one, or single photons (no multiplicities given). Valid until the photons
+// it covers are moved or released.
+class PulseView {
+private:
+	Qubit* const* qubits;
+	const int* counts;
+	int groupCount;
+	int photons;
+public:
+	PulseView(const Pulse& pulse);
+	PulseView(Qubit* const* first, int size);
+	PulseView(Qubit* const* first, const int* multiplicities, int groups);
+	int size() const;
+	int groups() const;
+	Qubit* group(int g) const;
+	int multiplicity(int g) const;
+	Qubit* operator[] (int idx) const;
+};
+ostream& operator<<(ostream& out, Pulse& pulse);
+
 #endif
\ No newline at end of file
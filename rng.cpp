@@ -0,0 +1,102 @@
+#include <atomic>
+#include <cstdint>
+#include <random>
+#include <algorithm>
+#include <cmath>
+
+#include "rng.h"
+
+using namespace std;
+
+static atomic<uint64_t> threadSeed(0x5EED5EED5EED5EEDULL);
+
+uint64_t splitmix64(uint64_t& state) {
+	uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+Rng::Rng() {
+	seed(threadSeed.fetch_add(0x9E3779B97F4A7C15ULL));
+}
+Rng::Rng(uint64_t seedValue) {
+	seed(seedValue);
+}
+void Rng::seed(uint64_t seedValue) {
+	uint64_t state = seedValue;
+	for (int i = 0; i < 4; ++i)
+		s[i] = splitmix64(state);
+}
+void Rng::jump() {
+	static const uint64_t JUMP[] = { 0x180ec6d33cfd0aba, 0xd5a61266f0c9392c,
+									 0xa9582618e03fc9aa, 0x39abdc4529b1661c };
+	uint64_t t[4] = {0, 0, 0, 0};
+	for (int i = 0; i < 4; ++i) {
+		for (int b = 0; b < 64; ++b) {
+			if (JUMP[i] & (1ULL << b)) {
+				for (int k = 0; k < 4; ++k)
+					t[k] ^= s[k];
+			}
+			operator()();
+		}
+	}
+	for (int k = 0; k < 4; ++k)
+		s[k] = t[k];
+}
+
+void Rng::longJump() {
+	static const uint64_t LONG_JUMP[] = { 0x76e15d3efefdcbbf, 0xc5004e441c522fb3,
+										  0x77710069854ee241, 0x39109bb02acbe635 };
+	uint64_t t[4] = {0, 0, 0, 0};
+	for (int i = 0; i < 4; ++i) {
+		for (int b = 0; b < 64; ++b) {
+			if (LONG_JUMP[i] & (1ULL << b)) {
+				for (int k = 0; k < 4; ++k)
+					t[k] ^= s[k];
+			}
+			operator()();
+		}
+	}
+	for (int k = 0; k < 4; ++k)
+		s[k] = t[k];
+}
+int Rng::binomial(int trials, double p) {
+	if (trials == 1)
+		return uniform() < p;
+	// Constructed per call, the distribution keeps no state between draws
+	return binomial_distribution<int>(trials, p)(*this);
+}
+
+void Rng::fillBits(uint64_t *words, int count) {
+	for (int w = 0; w < (count + 63) / 64; ++w)
+		words[w] = operator()();
+}
+void Rng::fillBiasedBits(uint64_t *words, int count, double p) {
+	uint64_t digits = (uint64_t) llround(std::min(std::max(p, 0.0), 1.0) * 4294967296.0);
+	int lowest = 0;
+	while (lowest < 32 && !((digits >> lowest) & 1))
+		lowest++;
+	for (int w = 0; w < (count + 63) / 64; ++w) {
+		if (lowest == 32) {
+			// p rounded to 0 or 1
+			words[w] = digits ? ~0ULL : 0;
+			continue;
+		}
+		// From the least significant digit up, P(1) goes to P/2 + 1/2 on a
+		// 1 (or with a fair word) and to P/2 on a 0 (and)
+		uint64_t x = 0;
+		for (int d = lowest; d < 32; ++d)
+			x = ((digits >> d) & 1) ? (x | operator()()) : (x & operator()());
+		words[w] = x;
+	}
+}
+
+Rng& rng() {
+	static thread_local Rng stream;
+	return stream;
+}
+void seedRng(uint64_t seedValue) {
+	rng().seed(seedValue);
+	threadSeed.store(seedValue ^ 0xA5A5A5A5A5A5A5A5ULL);
+}
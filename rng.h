@@ -0,0 +1,67 @@
+#ifndef _RNG_H_
+#define _RNG_H_
+
+#include <cstdint>
+
+using namespace std;
+
+// xoshiro256** generator. It satisfies UniformRandomBitGenerator so it can
+// drive the <random> distributions, and jump() skips ahead 2^128 draws to
+// give non-overlapping streams.
+class Rng {
+private:
+	uint64_t s[4];
+	static inline uint64_t rotl(uint64_t x, int k) {
+		return (x << k) | (x >> (64 - k));
+	}
+public:
+	typedef uint64_t result_type;
+	static constexpr uint64_t min() { return 0; }
+	static constexpr uint64_t max() { return UINT64_MAX; }
+
+	Rng();
+	Rng(uint64_t seed);
+	void seed(uint64_t seed);
+	void jump();
+	void longJump();
+
+	inline uint64_t operator()() {
+		uint64_t result = rotl(s[1] * 5, 7) * 9;
+		uint64_t t = s[1] << 17;
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = rotl(s[3], 45);
+		return result;
+	}
+	// Uniform double in [0,1)
+	inline double uniform() {
+		return (operator()() >> 11) * (1.0 / 9007199254740992.0);
+	}
+	// Uniform integer in [0,n)
+	inline uint32_t below(uint32_t n) {
+		return (uint32_t) (((operator()() >> 32) * n) >> 32);
+	}
+	inline bool bit() {
+		return operator()() >> 63;
+	}
+	// Successes in trials independent draws of probability p
+	int binomial(int trials, double p);
+	// count uniform bits packed 64 per word, bit i in words[i/64] at i%64
+	void fillBits(uint64_t *words, int count);
+	// The same with each bit 1 with probability p rounded to a multiple of
+	// 2^-32: whole words are combined with & and | following p's binary
+	// digits, so a word takes one draw per digit after the last 1 (one
+	// for p = 1/2, at most 32) instead of 64 comparisons
+	void fillBiasedBits(uint64_t *words, int count, double p);
+};
+
+// Stream used by every device on the calling thread. Simulation runners
+// replace it per block so results do not depend on thread scheduling.
+Rng& rng();
+void seedRng(uint64_t seed);
+uint64_t splitmix64(uint64_t& state);
+
+#endif
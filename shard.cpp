@@ -0,0 +1,278 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cerrno>
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "shard.h"
+
+using namespace std;
+
+
+static const char SHARD_MAGIC[4] = {'Q', 'K', 'S', '2'};
+
+template<typename T>
+static void writeValue(ofstream& file, const T& value) {
+	file.write((const char*) &value, sizeof(T));
+}
+template<typename T>
+static T readValue(ifstream& file) {
+	T value;
+	file.read((char*) &value, sizeof(T));
+	return value;
+}
+
+static void writeString(ofstream& file, const string& s) {
+	writeValue<uint64_t>(file, s.size());
+	file.write(s.data(), s.size());
+}
+static string readString(ifstream& file) {
+	string s(readValue<uint64_t>(file), '\0');
+	file.read(&s[0], s.size());
+	return s;
+}
+static void writeProportion(ofstream& file, const ProportionStat& stat) {
+	writeValue<int64_t>(file, stat.successes);
+	writeValue<int64_t>(file, stat.trials);
+}
+static ProportionStat readProportion(ifstream& file) {
+	ProportionStat stat;
+	stat.successes = readValue<int64_t>(file);
+	stat.trials = readValue<int64_t>(file);
+	return stat;
+}
+static void writeRunning(ofstream& file, const RunningStat& stat) {
+	writeValue<int64_t>(file, stat.count());
+	writeValue<double>(file, stat.mean());
+	writeValue<double>(file, stat.squaredDeviations());
+}
+static RunningStat readRunning(ifstream& file) {
+	long long n = readValue<int64_t>(file);
+	double mean = readValue<double>(file);
+	double squaredDeviations = readValue<double>(file);
+	return RunningStat(n, mean, squaredDeviations);
+}
+static void writeBits(ofstream& file, const PackedBits& bits) {
+	writeValue<int64_t>(file, bits.size);
+	file.write((const char*) bits.words.data(), bits.words.size() * sizeof(uint64_t));
+}
+static PackedBits readBits(ifstream& file) {
+	PackedBits bits;
+	bits.size = readValue<int64_t>(file);
+	bits.words.resize((bits.size + 63) / 64);
+	file.read((char*) bits.words.data(), bits.words.size() * sizeof(uint64_t));
+	return bits;
+}
+
+
+ShardHeader::ShardHeader() {
+	index = 0;
+	count = 1;
+	firstPulse = 0;
+	pulses = 0;
+}
+
+string shardPath(string dir, int index) {
+	return dir + "/shard-" + to_string(index) + ".qks";
+}
+
+void writeShard(string path, const ShardHeader& header, const SimulationResult& result) {
+	ofstream file(path, ios::binary);
+	if (!file) {
+		cout << "Could not write shard file " << path << endl;
+		throw -1;
+	}
+	file.write(SHARD_MAGIC, sizeof(SHARD_MAGIC));
+	writeString(file, header.config);
+	writeValue<int32_t>(file, header.index);
+	writeValue<int32_t>(file, header.count);
+	writeValue<int64_t>(file, header.firstPulse);
+	writeValue<int64_t>(file, header.pulses);
+
+	writeProportion(file, result.detectionRate);
+	writeProportion(file, result.qber);
+	writeProportion(file, result.eveAgreement);
+	writeValue<uint8_t>(file, result.weighted);
+	writeRunning(file, result.weightedSifted);
+	writeRunning(file, result.weightedErrors);
+	writeRunning(file, result.weightedMultiphoton);
+	writeRunning(file, result.weightedEveSuccess);
+	writeValue<uint32_t>(file, result.photonHistogram.size());
+	for (auto bin : result.photonHistogram) {
+		writeValue<int64_t>(file, bin);
+	}
+	writeValue<uint32_t>(file, result.intensities.size());
+	for (size_t c = 0; c < result.intensities.size(); ++c) {
+		writeValue<double>(file, result.intensities[c]);
+		writeProportion(file, result.classGain[c]);
+		writeProportion(file, result.classQber[c]);
+	}
+	writeBits(file, result.aliceKey);
+	writeBits(file, result.bobKey);
+}
+
+ShardHeader readShard(string path, SimulationResult& result) {
+	ifstream file(path, ios::binary);
+	char magic[sizeof(SHARD_MAGIC)];
+	if (!file || !file.read(magic, sizeof(magic)) || !equal(magic, magic + sizeof(magic), SHARD_MAGIC)) {
+		cout << "Missing or invalid shard file " << path << endl;
+		throw -1;
+	}
+	ShardHeader header;
+	header.config = readString(file);
+	header.index = readValue<int32_t>(file);
+	header.count = readValue<int32_t>(file);
+	header.firstPulse = readValue<int64_t>(file);
+	header.pulses = readValue<int64_t>(file);
+
+	result = SimulationResult();
+	result.detectionRate = readProportion(file);
+	result.qber = readProportion(file);
+	result.eveAgreement = readProportion(file);
+	result.weighted = readValue<uint8_t>(file);
+	result.weightedSifted = readRunning(file);
+	result.weightedErrors = readRunning(file);
+	result.weightedMultiphoton = readRunning(file);
+	result.weightedEveSuccess = readRunning(file);
+	result.photonHistogram.resize(readValue<uint32_t>(file));
+	for (auto& bin : result.photonHistogram) {
+		bin = readValue<int64_t>(file);
+	}
+	result.intensities.resize(readValue<uint32_t>(file));
+	result.classGain.resize(result.intensities.size());
+	result.classQber.resize(result.intensities.size());
+	for (size_t c = 0; c < result.intensities.size(); ++c) {
+		result.intensities[c] = readValue<double>(file);
+		result.classGain[c] = readProportion(file);
+		result.classQber[c] = readProportion(file);
+	}
+	result.aliceKey = readBits(file);
+	result.bobKey = readBits(file);
+	if (!file) {
+		cout << "Truncated shard file " << path << endl;
+		throw -1;
+	}
+	return header;
+}
+
+static void createOutputDirectory(string dir) {
+	if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+		cout << "Could not create output directory " << dir << endl;
+		throw -1;
+	}
+}
+
+void runShard(const SimulationConfig& config, int index, int count, string dir) {
+	if (count < 1 || index < 0 || index >= count) {
+		cout << "Invalid shard " << index << "/" << count << endl;
+		throw -1;
+	}
+	if (findProtocol(config.get("protocol")) == nullptr) {
+		cout << "Entangled protocols can not be sharded" << endl;
+		throw -1;
+	}
+	auto input = config.buildInput();
+	if (input.targetWidth > 0) {
+		cout << "Adaptive run length (target_width) can not be sharded" << endl;
+		throw -1;
+	}
+	long long blocks = (input.pulses() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	input.firstBlock = blocks * index / count;
+	input.blockCount = blocks * (index + 1) / count - input.firstBlock;
+	input.keepStrings = false;
+	input.postProcessor = config.buildPostProcessor(input);
+	// A node running a single shard may not have the directory yet
+	createOutputDirectory(dir);
+
+	auto generator = config.buildGenerator();
+	auto channel = config.buildChannel();
+	auto detector = config.buildDetector();
+	auto attack = config.buildAttack();
+	auto result = runSimulation(generator, channel, attack, detector, input);
+
+	ShardHeader header;
+	header.config = config.describe();
+	header.index = index;
+	header.count = count;
+	header.firstPulse = input.firstBlock * BLOCK_SIZE;
+	header.pulses = result.detectionRate.trials;
+	writeShard(shardPath(dir, index), header, result);
+	long long finalBits = 0;
+	if (input.postProcessor != nullptr) {
+		input.postProcessor->printReport();
+		finalBits = input.postProcessor->finalKey.size;
+		delete input.postProcessor;
+	}
+	if (input.classicalChannel != nullptr) {
+		input.classicalChannel->printReport(finalBits);
+		delete input.classicalChannel;
+	}
+	delete attack;
+}
+
+SimulationResult runShardsLocally(string program, string configPath, int count, string dir) {
+	createOutputDirectory(dir);
+	vector<pid_t> children;
+	for (int k = 0; k < count; ++k) {
+		string shard = to_string(k) + "/" + to_string(count);
+		pid_t pid = fork();
+		if (pid == 0) {
+			execl(program.c_str(), program.c_str(), "--config", configPath.c_str(),
+				  "--shard", shard.c_str(), "--out", dir.c_str(), (char*) NULL);
+			_exit(127);
+		}
+		if (pid < 0) {
+			cout << "Could not start shard " << shard << endl;
+			throw -1;
+		}
+		children.push_back(pid);
+	}
+	bool failed = false;
+	for (auto pid : children) {
+		int status;
+		waitpid(pid, &status, 0);
+		failed = failed || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+	}
+	if (failed) {
+		cout << "A shard process failed" << endl;
+		throw -1;
+	}
+	return mergeShards(dir, count);
+}
+
+SimulationResult mergeShards(string dir, int count) {
+	SimulationResult merged;
+	ShardHeader total;
+	for (int k = 0; k < count; ++k) {
+		SimulationResult shard;
+		auto header = readShard(shardPath(dir, k), shard);
+		if (k == 0) {
+			total.config = header.config;
+		}
+		if (header.config != total.config || header.index != k || header.count != count ||
+			header.firstPulse != total.pulses) {
+			cout << "Shard " << k << " does not continue the run in " << shardPath(dir, 0) << endl;
+			throw -1;
+		}
+		merged.append(shard);
+		total.pulses += header.pulses;
+	}
+	writeShard(dir + "/merged.qks", total, merged);
+
+	SimulationInput input;
+	printStatistics(input, merged, merged.eveAgreement.trials > 0);
+	cout << "Sifted key length: " << merged.bobKey.size << endl;
+	cout << "Photon number histogram:";
+	for (auto bin : merged.photonHistogram) {
+		cout << " " << bin;
+	}
+	cout << endl;
+	return merged;
+}
@@ -0,0 +1,41 @@
+#ifndef _SHARD_H_
+#define _SHARD_H_
+
+#include <string>
+
+#include "config.h"
+#include "simulation.h"
+
+using namespace std;
+
+// A sharded run splits the blocks of one configured run into count
+// contiguous ranges. Shard k skips its stream ahead to its first block, so
+// it simulates exactly the pulses a single run would, and writes its
+// counters, histograms and packed sifted keys to dir/shard-k.qks. Shards
+// are separate processes: forked here, or started by hand on other
+// machines sharing dir.
+struct ShardHeader {
+	// Canonical config (SimulationConfig::describe), shards of different
+	// runs refuse to merge
+	string config;
+	int index;
+	int count;
+	long long firstPulse;
+	long long pulses;
+	ShardHeader();
+};
+
+void writeShard(string path, const ShardHeader& header, const SimulationResult& result);
+ShardHeader readShard(string path, SimulationResult& result);
+string shardPath(string dir, int index);
+
+// Simulates shard index of count and writes its file
+void runShard(const SimulationConfig& config, int index, int count, string dir);
+// Starts one `program --config configPath --shard k/count --out dir` process
+// per shard, waits for all of them and merges
+SimulationResult runShardsLocally(string program, string configPath, int count, string dir);
+// Folds dir/shard-0..count-1 in order into dir/merged.qks (a 1 shard file
+// of the whole run) and prints its statistics
+SimulationResult mergeShards(string dir, int count);
+
+#endif
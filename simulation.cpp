@@ -0,0 +1,510 @@
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <cmath>
+
+#include "simulation.h"
+#include "blockengine.h"
+#include "metrics.h"
+#include "logging.h"
+#include "rng.h"
+
+using namespace std;
+
+
+static char resultChar(int result) {
+	return (result < 0) ? '-' : (result == 1) ? '1' : '0';
+}
+
+SimulationInput::SimulationInput() {
+	protocol = &bb84Protocol();
+	bits = "auto";
+	length = 0;
+	sourceBases = "auto";
+	detectorBases = "auto";
+	bitsFile = nullptr;
+	sourceBasesFile = nullptr;
+	detectorBasesFile = nullptr;
+	seed = 0;
+	threads = 1;
+	targetWidth = 0;
+	confidence = 0.95;
+	outcomeBias = 0;
+	firstBlock = 0;
+	blockCount = -1;
+	firstBlockStream = nullptr;
+	keepStrings = true;
+	stageCache = nullptr;
+	postProcessor = nullptr;
+	classicalChannel = nullptr;
+}
+long long SimulationInput::pulses() const {
+	if (bitsFile != nullptr)
+		return bitsFile->length();
+	return (bits == "auto") ? length : (long long) bits.size();
+}
+
+SimulationResult::SimulationResult() {
+	weighted = false;
+	photonHistogram.assign(PHOTON_HISTOGRAM_BINS, 0);
+}
+void SimulationResult::append(const SimulationResult& chunk) {
+	bits          += chunk.bits;
+	sourceBases   += chunk.sourceBases;
+	detectorBases += chunk.detectorBases;
+	transmitted   += chunk.transmitted;
+	intercepted   += chunk.intercepted;
+	detectionRate.add(chunk.detectionRate.successes, chunk.detectionRate.trials);
+	qber.add(chunk.qber.successes, chunk.qber.trials);
+	eveAgreement.add(chunk.eveAgreement.successes, chunk.eveAgreement.trials);
+	weighted = weighted || chunk.weighted;
+	weightedSifted.merge(chunk.weightedSifted);
+	weightedErrors.merge(chunk.weightedErrors);
+	weightedMultiphoton.merge(chunk.weightedMultiphoton);
+	weightedEveSuccess.merge(chunk.weightedEveSuccess);
+	aliceKey.append(chunk.aliceKey);
+	bobKey.append(chunk.bobKey);
+	for (size_t i = 0; i < photonHistogram.size(); ++i) {
+		photonHistogram[i] += chunk.photonHistogram[i];
+	}
+	if (intensities.empty()) {
+		intensities = chunk.intensities;
+		classGain.resize(chunk.classGain.size());
+		classQber.resize(chunk.classQber.size());
+	}
+	for (size_t c = 0; c < chunk.classGain.size(); ++c) {
+		classGain[c].add(chunk.classGain[c].successes, chunk.classGain[c].trials);
+		classQber[c].add(chunk.classQber[c].successes, chunk.classQber[c].trials);
+	}
+}
+
+Scenario::Scenario(string _name, Channel *chan, Attack *att, Detector *det) {
+	name = _name;
+	channel = chan;
+	attack = att;
+	detector = det;
+}
+
+SimulationResult runSimulation(Generator *generator, Channel *channel, Attack *attack,
+							   Detector *detector, const SimulationInput& input) {
+	vector<Scenario> scenarios {Scenario("", channel, attack, detector)};
+	return runScenarios(generator, scenarios, input)[0];
+}
+
+// Alice's side of a block: bits, bases, announcements and pulses
+static void generateSource(long long first, int count, Generator *generator, const SimulationInput& input,
+						   PulseBlock& source) {
+	bool autoBits = (input.bits == "auto");
+	bool autoSourceBases = (input.sourceBases == "auto");
+	const Protocol& protocol = *input.protocol;
+	source.reset(first, count);
+	// Random bits and bases are drawn a block at a time in packed words
+	static thread_local vector<uint64_t> words;
+	if (input.bitsFile != nullptr) {
+		input.bitsFile->read(first, count, source.bits.data());
+	} else if (autoBits) {
+		words.resize((count + 63) / 64);
+		rng().fillBits(words.data(), count);
+		unpackBits(words.data(), source.bits.data(), count);
+	} else {
+		for (int i = 0; i < count; ++i)
+			source.bits[i] = (input.bits[first+i] == '1');
+	}
+	if (input.sourceBasesFile != nullptr) {
+		input.sourceBasesFile->read(first, count, source.sourceBases.data());
+	} else if (autoSourceBases) {
+		generator->chooseBases(protocol.sourceBases(), source.sourceBases.data(), count);
+	} else {
+		for (int i = 0; i < count; ++i)
+			source.sourceBases[i] = input.sourceBases[first+i] - '0';
+	}
+	if (protocol.announcements > 1) {
+		for (int i = 0; i < count; ++i) {
+			source.announcements[i] = rng().below(protocol.announcements);
+		}
+	}
+	generator->createBlock(source);
+}
+
+// Simulates block number blockIndex with its own stream into one chunk per
+// scenario. Alice's side draws from the block's stream, the channel and
+// everything after it from two streams long jumped from it, so reusing a
+// cached propagated block (stageKey, single scenario) leaves the rest of
+// the run unchanged.
+static void simulateBlock(long long blockIndex, const Rng& blockStream, Generator *generator,
+						  vector<Scenario>& scenarios, const SimulationInput& input, StageCache *cache,
+						  uint64_t stageKey, const vector<double>& rotations, PulseBlock& source,
+						  PulseBlock& working, vector<SimulationResult>& chunks) {
+	long long first = blockIndex * BLOCK_SIZE;
+	int count = (int) min<long long>(BLOCK_SIZE, input.pulses() - first);
+	bool autoDetectorBases = (input.detectorBases == "auto");
+	Rng channelStream = blockStream;
+	channelStream.longJump();
+	Rng downstreamStream = channelStream;
+	downstreamStream.longJump();
+
+	const Protocol& protocol = *input.protocol;
+	bool reused = (cache != nullptr) && cache->load(stageKey, blockIndex, source);
+	if (!reused) {
+		rng() = blockStream;
+		generateSource(first, count, generator, input, source);
+	}
+	source.protocol = &protocol;
+	source.outcomeBias = input.outcomeBias;
+
+	for (size_t s = 0; s < scenarios.size(); ++s) {
+		auto& scenario = scenarios[s];
+		bool last = (s+1 == scenarios.size());
+		if (!last) {
+			working.copySource(source);
+		}
+		PulseBlock& block = last ? source : working;
+
+		TRACE_BLOCK_BEGIN(first, count);
+		if (!reused) {
+			rng() = channelStream;
+			block.channelRotation = rotations[s];
+			scenario.channel->propagateBlock(block, scenario.attack == nullptr);
+			if (cache != nullptr)
+				cache->store(stageKey, blockIndex, block);
+		}
+		rng() = downstreamStream;
+		if (input.detectorBasesFile != nullptr) {
+			input.detectorBasesFile->read(first, count, block.detectorBases.data());
+		} else if (autoDetectorBases) {
+			scenario.detector->chooseBases(protocol.bases.size(), block.detectorBases.data(), count);
+		} else {
+			for (int i = 0; i < count; ++i)
+				block.detectorBases[i] = input.detectorBases[first+i] - '0';
+		}
+		if (scenario.attack != nullptr) {
+			scenario.attack->operator()(block);
+			block.pristine = false;
+		}
+		scenario.detector->detectBlock(block);
+
+		auto& chunk = chunks[s];
+		chunk.intensities = generator->intensities();
+		chunk.classGain.resize(chunk.intensities.size());
+		chunk.classQber.resize(chunk.intensities.size());
+		bool decoy = !chunk.intensities.empty();
+		if (input.keepStrings) {
+			for (auto str : {&chunk.bits, &chunk.sourceBases, &chunk.detectorBases, &chunk.transmitted, &chunk.intercepted}) {
+				str->reserve(count);
+			}
+		}
+		for (int i = 0; i < count; ++i) {
+			TRACE_PULSE(first+i);
+			TRACE(scenario.name << " bit " << (int) block.bits[i] << " basis " << (int) block.sourceBases[i]
+				  << " -> Bob basis " << (int) block.detectorBases[i] << " observed " << block.detections[i]
+				  << " Eve observed " << block.interceptions[i]);
+			int bob = block.detections[i], eve = block.interceptions[i];
+			int aliceState = 2*block.sourceBases[i] + block.bits[i];
+			int aliceBit = protocol.keyBits[aliceState];
+			int bobBit = (bob < 0) ? -1 : protocol.sift(aliceState, block.announcements[i], block.detectorBases[i], bob);
+			if (input.keepStrings) {
+				chunk.bits          += block.bits[i] ? '1' : '0';
+				chunk.sourceBases   += '0' + block.sourceBases[i];
+				chunk.detectorBases += '0' + block.detectorBases[i];
+				chunk.transmitted   += resultChar(bob);
+				chunk.intercepted   += resultChar(eve);
+			}
+			chunk.detectionRate.add(bob >= 0);
+			// Decoy and vacuum pulses' bits and bases are announced, so only
+			// signal pulses make key; the others count in their class only
+			if (bobBit >= 0 && (!decoy || block.intensityClasses[i] == 0)) {
+				chunk.qber.add(bobBit != aliceBit);
+				chunk.aliceKey.push(aliceBit);
+				chunk.bobKey.push(bobBit);
+			}
+			chunk.photonHistogram[min(block.photons[i], PHOTON_HISTOGRAM_BINS-1)]++;
+			if (decoy) {
+				int intensityClass = block.intensityClasses[i];
+				chunk.classGain[intensityClass].add(bob >= 0);
+				if (bobBit >= 0)
+					chunk.classQber[intensityClass].add(bobBit != aliceBit);
+			}
+			if (bob >= 0 && eve >= 0) {
+				chunk.eveAgreement.add(bob == eve);
+			}
+			double weight = block.weights[i];
+			bool sifted = (bobBit >= 0);
+			bool error = sifted && (bobBit != aliceBit);
+			chunk.weighted = chunk.weighted || (weight != 1);
+			chunk.weightedSifted.add(sifted ? weight : 0);
+			chunk.weightedErrors.add(error ? weight : 0);
+			chunk.weightedMultiphoton.add(block.photons[i] >= 2 ? weight : 0);
+			chunk.weightedEveSuccess.add((sifted && !error && eve == aliceBit) ? weight : 0);
+		}
+		TRACE_BLOCK_END();
+		block.release();
+	}
+}
+
+static bool converged(const SimulationInput& input, vector<Scenario>& scenarios,
+					  const vector<SimulationResult>& results) {
+	double z = zForConfidence(input.confidence);
+	for (size_t s = 0; s < scenarios.size(); ++s) {
+		if (results[s].detectionRate.width(z) > input.targetWidth ||
+			results[s].qber.width(z) > input.targetWidth)
+			return false;
+		if (scenarios[s].attack != nullptr && results[s].eveAgreement.width(z) > input.targetWidth)
+			return false;
+	}
+	return true;
+}
+
+static int bitsFor(int values) {
+	int bits = 0;
+	while ((1 << bits) < values)
+		bits++;
+	return bits;
+}
+// One round trip per block: Bob announces which slots clicked and his basis
+// for each, Alice which of those are kept, with her announcement and the
+// decoy class of each where the protocol and source have them
+static void announceSifting(ClassicalChannel *classical, const Protocol& protocol, const SimulationResult& chunk) {
+	long long slots = chunk.detectionRate.trials, detections = chunk.detectionRate.successes;
+	long long request = slots + detections*bitsFor(protocol.bases.size());
+	long long reply = detections * (1 + bitsFor(protocol.announcements) + bitsFor(chunk.intensities.size()));
+	classical->exchange(CLASSICAL_SIFTING, (request + 7) / 8, (reply + 7) / 8);
+}
+
+vector<SimulationResult> runScenarios(Generator *generator, vector<Scenario>& scenarios,
+									  const SimulationInput& input) {
+	vector<SimulationResult> results(scenarios.size());
+	long long blocks = (input.pulses() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	long long firstBlock = min(input.firstBlock, blocks);
+	long long lastBlock = (input.blockCount < 0) ? blocks : min(blocks, firstBlock + input.blockCount);
+
+	// Skip ahead to the first block's stream
+	Rng firstStream(input.seed);
+	if (input.firstBlockStream != nullptr) {
+		firstStream = *input.firstBlockStream;
+	} else {
+		for (long long b = 0; b < firstBlock; ++b) {
+			firstStream.jump();
+		}
+	}
+	// Drifting channels: the fiber walks as blocks are handed out and a
+	// compensating controller only sees merged blocks, so a block waits
+	// until the ones its controller setting depends on are merged
+	vector<DriftTracker*> trackers(scenarios.size(), nullptr);
+	bool drifting = false;
+	for (size_t s = 0; s < scenarios.size(); ++s) {
+		if (scenarios[s].channel->getDrift() != nullptr) {
+			trackers[s] = new DriftTracker(scenarios[s].channel->getDrift(), input.seed, firstBlock);
+			drifting = true;
+		}
+	}
+	// The stage cache holds a single static channel's output
+	StageCache *cache = (scenarios.size() == 1 && !drifting) ? input.stageCache : nullptr;
+	PostProcessor *postProcessor = (scenarios.size() == 1) ? input.postProcessor : nullptr;
+	ClassicalChannel *classical = (scenarios.size() == 1) ? input.classicalChannel : nullptr;
+	uint64_t key = 0;
+	if (cache != nullptr) {
+		key = stageKey(input.upstream + "seed=" + to_string(input.seed) + ";pulses=" + to_string(input.pulses())
+					   + ";bits=" + (input.bitsFile != nullptr ? input.bitsFile->describe() : input.bits)
+					   + ";sourceBases=" + (input.sourceBasesFile != nullptr ? input.sourceBasesFile->describe()
+																			: input.sourceBases)
+					   + ";protocol=" + input.protocol->name
+					   + ";attack=" + (scenarios[0].attack != nullptr ? "1" : "0"));
+	}
+
+	struct Scratch {
+		PulseBlock source, working;
+		vector<double> rotations;
+	};
+	auto dispatch = [&](long long blockIndex, long long merged, Scratch& scratch) {
+		for (auto tracker : trackers) {
+			if (tracker != nullptr && merged < tracker->mergedBefore(blockIndex))
+				return false;
+		}
+		scratch.rotations.assign(scenarios.size(), 0.0);
+		for (size_t s = 0; s < scenarios.size(); ++s) {
+			if (trackers[s] != nullptr)
+				scratch.rotations[s] = trackers[s]->rotation(blockIndex);
+		}
+		return true;
+	};
+	auto simulate = [&](long long blockIndex, const Rng& blockStream, Scratch& scratch,
+						vector<SimulationResult>& chunks) {
+		chunks.resize(scenarios.size());
+		simulateBlock(blockIndex, blockStream, generator, scenarios, input, cache, key, scratch.rotations,
+					  scratch.source, scratch.working, chunks);
+	};
+	auto merge = [&](long long blockIndex, vector<SimulationResult>& ready) {
+		for (size_t s = 0; s < scenarios.size(); ++s) {
+			results[s].append(ready[s]);
+			if (trackers[s] != nullptr)
+				trackers[s]->merged(ready[s].qber.successes, ready[s].qber.trials);
+		}
+		if (classical != nullptr)
+			announceSifting(classical, *input.protocol, ready[0]);
+		// Waits here while the post-processor is too far behind
+		if (postProcessor != nullptr)
+			postProcessor->append(ready[0].aliceKey, ready[0].bobKey);
+		METRICS_PERIODIC(min((blockIndex + 1) * BLOCK_SIZE, input.pulses()) - firstBlock * BLOCK_SIZE);
+		return input.targetWidth > 0 && converged(input, scenarios, results);
+	};
+	runBlocks<Scratch, vector<SimulationResult> >(firstStream, firstBlock, lastBlock, input.threads,
+												   dispatch, simulate, merge);
+	for (auto tracker : trackers) {
+		delete tracker;
+	}
+	if (postProcessor != nullptr)
+		postProcessor->finish();
+	PulseTrace::flush(cout);
+
+	return results;
+}
+
+long long secretKeyLength(const SimulationResult& result) {
+	double fraction = max(0.0, 1 - 2*binaryEntropy(result.qber.value()));
+	return (long long) (result.aliceKey.size * fraction);
+}
+
+DecoyEstimate decoyBounds(double mu, double nu, double signalGain, double signalErrors, double decoyGain,
+						  double decoyErrors, double y0ForY1, double y0ForE1, double siftedFraction,
+						  double f) {
+	DecoyEstimate estimate;
+	estimate.y0 = y0ForY1;
+	estimate.y1 = max(0.0, mu / (mu*nu - nu*nu) * (decoyGain*exp(nu) - signalGain*exp(mu)*nu*nu/(mu*mu)
+												   - y0ForY1*(mu*mu - nu*nu)/(mu*mu)));
+	estimate.e1 = (estimate.y1 > 0) ? min(0.5, max(0.0, (decoyErrors*exp(nu) - y0ForE1/2) / (estimate.y1*nu)))
+									: 0.5;
+	estimate.q1 = estimate.y1 * mu * exp(-mu);
+	double signalQber = (signalGain > 0) ? min(0.5, signalErrors / signalGain) : 0;
+	estimate.rate = max(0.0, siftedFraction * (estimate.q1*(1 - binaryEntropy(estimate.e1))
+											   - f*signalGain*binaryEntropy(signalQber)));
+	estimate.secretBits = 0;
+	return estimate;
+}
+
+DecoyEstimate estimateDecoy(const SimulationResult& result, double f) {
+	long long detections = 0, sifted = 0;
+	for (size_t c = 0; c < result.classGain.size(); ++c) {
+		detections += result.classGain[c].successes;
+		sifted += result.classQber[c].trials;
+	}
+	double siftedFraction = (detections > 0) ? (double) sifted / detections : 0;
+	double signalGain = result.classGain[0].value(), decoyGain = result.classGain[1].value();
+	double y0 = result.classGain[2].value();
+	DecoyEstimate estimate = decoyBounds(result.intensities[0], result.intensities[1], signalGain,
+										 signalGain*result.classQber[0].value(), decoyGain,
+										 decoyGain*result.classQber[1].value(), y0, y0, siftedFraction, f);
+	estimate.secretBits = (long long) (estimate.rate * result.classGain[0].trials);
+	return estimate;
+}
+
+static long long matching(const string& a, const string& b) {
+	long long matches = 0;
+	for (size_t i = 0; i < a.size() && i < b.size(); ++i) {
+		if (a[i] == b[i] && a[i] != '-')
+			matches++;
+	}
+	return matches;
+}
+static double matchingPercent(const string& a, const string& b, long long total) {
+	return (total > 0) ? matching(a, b)*100.0/total : 0;
+}
+void printProportion(string label, const ProportionStat& stat, double confidence) {
+	auto interval = stat.wilson(zForConfidence(confidence));
+	cout << label << stat.value()*100 << "% [" << interval.first*100 << "%, " << interval.second*100
+		 << "%] over " << stat.trials << endl;
+}
+
+static void printEstimate(string label, const RunningStat& stat, double confidence) {
+	cout << label << stat.mean() << " +/- " << stat.halfWidth(zForConfidence(confidence))
+		 << " (variance " << stat.variance() << ")" << endl;
+}
+static void printWeightedEstimates(const SimulationResult& result, double confidence) {
+	if (!result.weighted)
+		return;
+	cout << "Importance sampled estimates per pulse:" << endl;
+	printEstimate("\tSifted detection probability: ", result.weightedSifted, confidence);
+	printEstimate("\tSifted error probability: ", result.weightedErrors, confidence);
+	printEstimate("\tMultiphoton probability: ", result.weightedMultiphoton, confidence);
+	printEstimate("\tEve knows an error free sifted bit: ", result.weightedEveSuccess, confidence);
+	if (result.weightedSifted.mean() > 0) {
+		cout << "\tQBER (ratio estimate): " << result.weightedErrors.mean() / result.weightedSifted.mean() << endl;
+	}
+}
+
+void printSimulationResult(const SimulationInput& input, const SimulationResult& result, bool eve) {
+	if (!input.keepStrings) {
+		printStatistics(input, result, eve);
+		METRICS_DUMP(cout);
+		return;
+	}
+	long long total = result.bits.size();
+	cout << "Transmitted String:" << endl;
+	cout << result.transmitted << endl;
+	if (!eve) {
+		cout << "Accuracy of transmission: " << matchingPercent(result.transmitted, result.bits, total) << "%" << endl;
+	} else {
+		cout << "interceptedString" << endl;
+		cout << result.intercepted << endl;
+		cout << "Accuracy of Bob's bitstring: " << matchingPercent(result.transmitted, result.bits, total) << "%" << endl;
+		cout << "Accuracy of Eve's bitstring: " << matchingPercent(result.intercepted, result.bits, total) << "%" << endl;
+		cout << "Correlation between Eve's and Bob's bitstring: " << matchingPercent(result.transmitted, result.intercepted, total) << "%" << endl;
+	}
+	printStatistics(input, result, eve);
+	METRICS_DUMP(cout);
+}
+
+void printStatistics(const SimulationInput& input, const SimulationResult& result, bool eve) {
+	cout << "Pulses simulated: " << result.detectionRate.trials << endl;
+	printProportion("Detection rate: ", result.detectionRate, input.confidence);
+	printProportion("QBER (sifted): ", result.qber, input.confidence);
+	if (eve) {
+		printProportion("Eve/Bob agreement: ", result.eveAgreement, input.confidence);
+	}
+	printWeightedEstimates(result, input.confidence);
+	if (!result.intensities.empty()) {
+		const char *names[] = {"signal", "decoy", "vacuum"};
+		cout << "Decoy states:" << endl;
+		for (size_t c = 0; c < result.intensities.size(); ++c) {
+			cout << "\t" << names[c] << " (intensity " << result.intensities[c] << ", "
+				 << result.classGain[c].trials << " pulses)" << endl;
+			printProportion("\t\tGain: ", result.classGain[c], input.confidence);
+			printProportion("\t\tQBER (sifted): ", result.classQber[c], input.confidence);
+		}
+		DecoyEstimate estimate = estimateDecoy(result, 1);
+		cout << "\tY0 = " << estimate.y0 << ", Y1 >= " << estimate.y1 << ", e1 <= " << estimate.e1
+			 << ", Q1 >= " << estimate.q1 << endl;
+		cout << "\tSecret key rate: " << estimate.rate << " bits per signal pulse, "
+			 << estimate.secretBits << " bits" << endl;
+	}
+}
+
+void printScenarioComparison(const SimulationInput& input, vector<Scenario>& scenarios,
+							 const vector<SimulationResult>& results) {
+	for (size_t s = 0; s < scenarios.size(); ++s) {
+		auto& result = results[s];
+		long long total = result.bits.size();
+		cout << scenarios[s].name << endl;
+		printProportion("\tDetection rate: ", result.detectionRate, input.confidence);
+		printProportion("\tQBER (sifted): ", result.qber, input.confidence);
+		printWeightedEstimates(result, input.confidence);
+		cout << "\tAccuracy of Bob's bitstring: " << matchingPercent(result.transmitted, result.bits, total) << "%" << endl;
+		if (scenarios[s].attack != nullptr) {
+			cout << "\tAccuracy of Eve's bitstring: " << matchingPercent(result.intercepted, result.bits, total) << "%" << endl;
+		}
+		if (s > 0 && total > 0) {
+			// Paired per-pulse difference against the first scenario
+			double diff = 0, diffSquares = 0;
+			for (long long i = 0; i < total; ++i) {
+				int a = (results[0].transmitted[i] == result.bits[i]);
+				int b = (result.transmitted[i] == result.bits[i]);
+				diff += b - a;
+				diffSquares += (b - a) * (b - a);
+			}
+			double mean = diff / total;
+			double stderror = sqrt(max(0.0, diffSquares/total - mean*mean) / total);
+			cout << "\tAccuracy difference vs " << scenarios[0].name << ": " << mean*100 << "% +/- "
+				 << zForConfidence(input.confidence)*stderror*100 << "%" << endl;
+		}
+	}
+	METRICS_DUMP(cout);
+}
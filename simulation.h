@@ -0,0 +1,178 @@
+#ifndef _SIMULATION_H_
+#define _SIMULATION_H_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "devices.h"
+#include "attacks.h"
+#include "statistics.h"
+#include "packedbits.h"
+#include "stagecache.h"
+#include "bitfile.h"
+#include "postprocessing.h"
+#include "classical.h"
+
+using namespace std;
+
+#define PHOTON_HISTOGRAM_BINS (16)
+
+struct SimulationInput {
+	// Prepare and measure protocol, BB84 by default
+	const Protocol *protocol;
+	// "auto" draws length random bits from each block's stream
+	string bits;
+	long long length;
+	// "auto" lets the generator/detector pick each basis itself, otherwise
+	// one digit per pulse indexing the protocol's bases
+	string sourceBases;
+	string detectorBases;
+	// Recorded values instead of the strings above (nullptr for none); a
+	// bits file sets the run length, bases files have to cover it
+	BitFile *bitsFile;
+	BitFile *sourceBasesFile;
+	BitFile *detectorBasesFile;
+	// Block b draws from the seed's stream jumped b times, so a run gives
+	// the same result from its seed whatever the number of threads
+	uint64_t seed;
+	int threads;
+	// Adaptive run length: when > 0, stop at the first block boundary where
+	// every tracked Wilson interval is narrower than this (length is then
+	// only an upper bound)
+	double targetWidth;
+	double confidence;
+	// Importance sampling: detector outcomes rarer than this are drawn with
+	// this probability and reweighted (0 for plain Monte Carlo)
+	double outcomeBias;
+	// Runs only blocks [firstBlock, firstBlock + blockCount) of the full
+	// run (blockCount < 0 for all the rest), e.g. one shard of it
+	long long firstBlock;
+	long long blockCount;
+	// firstBlock's stream when the caller already has it, e.g. one that
+	// runs in consecutive pieces, so it is not jumped to from the seed
+	const Rng *firstBlockStream;
+	// Per-pulse strings grow with the run; large runs keep only the
+	// packed keys and counters
+	bool keepStrings;
+	// Single scenario runs reuse blocks from stageCache (when not null)
+	// whose upstream matches: this description of the generator and
+	// channel plus the seed, pulses, bits, source bases, protocol and
+	// whether there is an attack
+	StageCache *stageCache;
+	string upstream;
+	// Single scenario runs hand every merged block's sifted key to it (when
+	// not null) and finish it before returning
+	PostProcessor *postProcessor;
+	// Single scenario runs report each merged block's sifting messages to
+	// it (when not null), as does postProcessor for its stages
+	ClassicalChannel *classicalChannel;
+
+	SimulationInput();
+	long long pulses() const;
+};
+
+struct SimulationResult {
+	// One character per pulse, '-' when nothing was detected/learned
+	string bits;
+	string sourceBases;
+	string detectorBases;
+	string transmitted;
+	string intercepted;
+	ProportionStat detectionRate;
+	// Errors among detections where Alice's and Bob's bases agree (signal
+	// pulses only with decoy states)
+	ProportionStat qber;
+	// Eve's bit equal to Bob's where both have one
+	ProportionStat eveAgreement;
+	// Importance sampling estimates, per-pulse means of weight * indicator,
+	// which are unbiased whatever biasing the stages applied
+	bool weighted;
+	RunningStat weightedSifted;
+	RunningStat weightedErrors;
+	RunningStat weightedMultiphoton;
+	// Sifted, error free bits that Eve also knows
+	RunningStat weightedEveSuccess;
+	// Sifted key bits (bases agree and Bob detected something), from the
+	// signal pulses only with decoy states
+	PackedBits aliceKey;
+	PackedBits bobKey;
+	// Pulses by photon number emitted, the last bin counting all larger ones
+	vector<long long> photonHistogram;
+	// Decoy states: the source's intensity per class and, per class, the
+	// gain (detection rate) and sifted QBER; empty for a single intensity
+	vector<double> intensities;
+	vector<ProportionStat> classGain;
+	vector<ProportionStat> classQber;
+
+	SimulationResult();
+	void append(const SimulationResult& chunk);
+};
+
+// Everything downstream of Alice's generator
+struct Scenario {
+	string name;
+	Channel *channel;
+	Attack *attack;
+	Detector *detector;
+	Scenario(string _name, Channel *chan, Attack *att, Detector *det);
+};
+
+// Runs the protocol a block at a time: generate, propagate, attack (when
+// attack is not null), detect. Every scenario, with or without Eve, goes
+// through this one loop.
+SimulationResult runSimulation(Generator *generator, Channel *channel, Attack *attack,
+							   Detector *detector, const SimulationInput& input);
+
+// Common random numbers: Alice's bits, bases and pulses are generated once
+// per block and shared read-only by all scenarios. Each scenario works on
+// its own copy of the photons (the last one takes the shared block itself)
+// and replays the same channel and downstream random streams, so
+// differences between scenarios come from their configuration and not
+// from sampling noise.
+//
+// Blocks are spread over input.threads worker threads and merged back in
+// block order, which is also where the adaptive stopping rule is checked.
+vector<SimulationResult> runScenarios(Generator *generator, vector<Scenario>& scenarios,
+									  const SimulationInput& input);
+
+// Secret bits the sifted key distills to at the asymptotic BB84 rate
+// 1 - 2h(QBER) (Shor-Preskill), none above about 11% QBER
+long long secretKeyLength(const SimulationResult& result);
+
+// Vacuum + weak decoy state bounds (Ma, Qi, Zhao, Lo 2005) from a decoy
+// source's signal (mu), decoy (nu) and vacuum classes:
+//	Y0 = Q_vacuum
+//	Y1 >= mu/(mu nu - nu^2) (Q_nu e^nu - Q_mu e^mu nu^2/mu^2 - Y0 (mu^2 - nu^2)/mu^2)
+//	e1 <= (E_nu Q_nu e^nu - Y0/2) / (Y1 nu)
+// and the GLLP key rate per signal pulse
+//	R = q (Q1 (1 - h(e1)) - f Q_mu h(E_mu)),  Q1 = Y1 mu e^-mu
+// with q the sifted fraction of detections and error correction at f times
+// the Shannon limit.
+struct DecoyEstimate {
+	double y0;
+	double y1;
+	double e1;
+	double q1;
+	double rate;
+	// Secret bits from the signal pulses at that rate
+	long long secretBits;
+};
+// The bounds from the signal and decoy gains Q and error gains E Q and the
+// vacuum yield; the Y0 entering the Y1 and e1 bounds are given separately
+// so that finite key rates can take the one that is worse for each
+DecoyEstimate decoyBounds(double mu, double nu, double signalGain, double signalErrors, double decoyGain,
+						  double decoyErrors, double y0ForY1, double y0ForE1, double siftedFraction,
+						  double f);
+// decoyBounds of a decoy run's classes; f = 1 matches secretKeyLength
+DecoyEstimate estimateDecoy(const SimulationResult& result, double f);
+
+// Prints label, the proportion in percent and its Wilson interval
+void printProportion(string label, const ProportionStat& stat, double confidence);
+void printSimulationResult(const SimulationInput& input, const SimulationResult& result, bool eve);
+// The counter based part of printSimulationResult, which needs no strings
+void printStatistics(const SimulationInput& input, const SimulationResult& result, bool eve);
+void printScenarioComparison(const SimulationInput& input, vector<Scenario>& scenarios,
+							 const vector<SimulationResult>& results);
+
+#endif
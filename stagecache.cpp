@@ -0,0 +1,186 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stagecache.h"
+
+using namespace std;
+
+
+static const char STAGE_MAGIC[4] = {'Q', 'S', 'C', '1'};
+
+template<typename T>
+static void put(vector<char>& bytes, const T& value) {
+	const char *raw = (const char*) &value;
+	bytes.insert(bytes.end(), raw, raw + sizeof(T));
+}
+template<typename T>
+static void putArray(vector<char>& bytes, const T *values, int count) {
+	const char *raw = (const char*) values;
+	bytes.insert(bytes.end(), raw, raw + count * sizeof(T));
+}
+
+// Bounds checked reads; a short or damaged entry just misses
+struct StageReader {
+	const char *next;
+	const char *end;
+	template<typename T>
+	bool get(T& value) {
+		return getArray(&value, 1);
+	}
+	template<typename T>
+	bool getArray(T *values, int count) {
+		if (count < 0 || (size_t) (end - next) < count * sizeof(T))
+			return false;
+		memcpy(values, next, count * sizeof(T));
+		next += count * sizeof(T);
+		return true;
+	}
+};
+
+// Layout: magic, size, mixed, pristine, the per-pulse source arrays, the
+// density matrices of a mixed block, then each pulse as its group count
+// followed by alpha, beta and multiplicity per group
+static void serialize(const PulseBlock& block, vector<char>& bytes) {
+	bytes.clear();
+	bytes.insert(bytes.end(), STAGE_MAGIC, STAGE_MAGIC + sizeof(STAGE_MAGIC));
+	put<int32_t>(bytes, block.size);
+	put<uint8_t>(bytes, block.mixed);
+	put<uint8_t>(bytes, block.pristine);
+	putArray(bytes, block.bits.data(), block.size);
+	putArray(bytes, block.sourceBases.data(), block.size);
+	putArray(bytes, block.announcements.data(), block.size);
+	putArray(bytes, block.intensityClasses.data(), block.size);
+	putArray(bytes, block.photons.data(), block.size);
+	putArray(bytes, block.weights.data(), block.size);
+	if (block.mixed)
+		putArray(bytes, block.mixedStates.data(), block.size);
+	for (int i = 0; i < block.size; ++i) {
+		PulseView pulse(block.pulses[i]);
+		put<int32_t>(bytes, pulse.groups());
+		for (int g = 0; g < pulse.groups(); ++g) {
+			put<amplitude>(bytes, pulse.group(g)->alpha);
+			put<amplitude>(bytes, pulse.group(g)->beta);
+			put<int32_t>(bytes, pulse.multiplicity(g));
+		}
+	}
+}
+
+static bool deserialize(const char *data, size_t length, long long first, PulseBlock& block) {
+	StageReader reader = {data, data + length};
+	char magic[sizeof(STAGE_MAGIC)];
+	int32_t size;
+	uint8_t mixed, pristine;
+	if (!reader.getArray(magic, sizeof(magic)) || !equal(magic, magic + sizeof(magic), STAGE_MAGIC)
+		|| !reader.get(size) || !reader.get(mixed) || !reader.get(pristine))
+		return false;
+	block.reset(first, size);
+	block.mixed = mixed;
+	block.pristine = pristine;
+	if (!reader.getArray(block.bits.data(), size) || !reader.getArray(block.sourceBases.data(), size)
+		|| !reader.getArray(block.announcements.data(), size) || !reader.getArray(block.intensityClasses.data(), size)
+		|| !reader.getArray(block.photons.data(), size) || !reader.getArray(block.weights.data(), size))
+		return false;
+	if (mixed && !reader.getArray(block.mixedStates.data(), size))
+		return false;
+	for (int i = 0; i < size; ++i) {
+		Pulse& pulse = block.pulses[i];
+		pulse.release();
+		int32_t groups;
+		if (!reader.get(groups))
+			return false;
+		for (int g = 0; g < groups; ++g) {
+			amplitude alpha, beta;
+			int32_t multiplicity;
+			if (!reader.get(alpha) || !reader.get(beta) || !reader.get(multiplicity))
+				return false;
+			if (multiplicity > 0)
+				pulse.insert(alpha, beta, multiplicity);
+		}
+	}
+	return true;
+}
+
+
+StageCache::StageCache() {
+	memoryKey = 0;
+}
+StageCache::StageCache(string _dir) {
+	dir = _dir;
+	memoryKey = 0;
+	mkdir(dir.c_str(), 0755);
+}
+string StageCache::path(uint64_t key, long long blockIndex) const {
+	char name[64];
+	snprintf(name, sizeof(name), "/stage-%016llx-%lld.qsc", (unsigned long long) key, blockIndex);
+	return dir + name;
+}
+
+bool StageCache::load(uint64_t key, long long blockIndex, PulseBlock& block) {
+	long long first = blockIndex * BLOCK_SIZE;
+	if (dir.empty()) {
+		lock_guard<mutex> lock(memoryLock);
+		auto entry = memory.find(make_pair(key, blockIndex));
+		return entry != memory.end() && deserialize(entry->second.data(), entry->second.size(), first, block);
+	}
+	int fd = open(path(key, blockIndex).c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat info;
+	bool loaded = false;
+	if (fstat(fd, &info) == 0 && info.st_size > 0) {
+		void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			loaded = deserialize((const char*) data, info.st_size, first, block);
+			munmap(data, info.st_size);
+		}
+	}
+	close(fd);
+	return loaded;
+}
+
+void StageCache::store(uint64_t key, long long blockIndex, const PulseBlock& block) {
+	vector<char> bytes;
+	serialize(block, bytes);
+	if (dir.empty()) {
+		lock_guard<mutex> lock(memoryLock);
+		if (key != memoryKey) {
+			memory.clear();
+			memoryKey = key;
+		}
+		memory[make_pair(key, blockIndex)].swap(bytes);
+		return;
+	}
+	// Written aside and renamed, so readers never map a partial file
+	string target = path(key, blockIndex);
+	string temporary = target + ".tmp" + to_string(getpid());
+	FILE *file = fopen(temporary.c_str(), "wb");
+	if (file == NULL) {
+		cout << "Could not write stage cache file " << temporary << endl;
+		throw -1;
+	}
+	bool written = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+	written = (fclose(file) == 0) && written;
+	if (!written || rename(temporary.c_str(), target.c_str()) != 0) {
+		unlink(temporary.c_str());
+		cout << "Could not write stage cache file " << target << endl;
+		throw -1;
+	}
+}
+
+uint64_t stageKey(const string& description) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (unsigned char c : description) {
+		hash ^= c;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
@@ -0,0 +1,44 @@
+#ifndef _STAGECACHE_H_
+#define _STAGECACHE_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <cstdint>
+
+#include "devices.h"
+
+using namespace std;
+
+// Memoized output of the generator and channel. A block's photons after
+// propagation depend only on the upstream configuration, the seed and the
+// block index (the simulation gives the channel its own random stream), so
+// a run that changes only the detector or the attack reloads them instead
+// of generating and propagating again, and gets the same result.
+//
+// Without a directory blocks are kept in memory, e.g. for an interactive
+// session, but only those of the latest key: storing under a new key drops
+// the others, so memory holds one run's blocks at most. With a directory
+// each block is a file <dir>/stage-<key>-<block>.qsc that later runs map
+// with mmap.
+class StageCache {
+private:
+	string dir;
+	mutex memoryLock;
+	map<pair<uint64_t, long long>, vector<char> > memory;
+	uint64_t memoryKey;
+	string path(uint64_t key, long long blockIndex) const;
+public:
+	StageCache();
+	StageCache(string _dir);
+	// Fills block (everything but its protocol and outcome bias) with the
+	// stored copy, false when there is none
+	bool load(uint64_t key, long long blockIndex, PulseBlock& block);
+	void store(uint64_t key, long long blockIndex, const PulseBlock& block);
+};
+
+// 64-bit FNV-1a hash of an upstream description
+uint64_t stageKey(const string& description);
+
+#endif
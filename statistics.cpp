@@ -0,0 +1,103 @@
+#include <cmath>
+#include <algorithm>
+
+#include "statistics.h"
+
+using namespace std;
+
+
+RunningStat::RunningStat() {
+	n = 0;
+	m = 0;
+	m2 = 0;
+}
+RunningStat::RunningStat(long long count, double mean, double squaredDeviations) {
+	n = count;
+	m = mean;
+	m2 = squaredDeviations;
+}
+void RunningStat::add(double x) {
+	n++;
+	double delta = x - m;
+	m += delta / n;
+	m2 += delta * (x - m);
+}
+void RunningStat::merge(const RunningStat& other) {
+	if (other.n == 0)
+		return;
+	long long total = n + other.n;
+	double delta = other.m - m;
+	m += delta * other.n / total;
+	m2 += other.m2 + delta * delta * ((double) n * other.n / total);
+	n = total;
+}
+long long RunningStat::count() const {
+	return n;
+}
+double RunningStat::mean() const {
+	return m;
+}
+double RunningStat::variance() const {
+	return (n > 1) ? m2 / (n - 1) : 0;
+}
+double RunningStat::squaredDeviations() const {
+	return m2;
+}
+double RunningStat::halfWidth(double z) const {
+	return (n > 0) ? z * sqrt(variance() / n) : INFINITY;
+}
+
+
+ProportionStat::ProportionStat() {
+	successes = 0;
+	trials = 0;
+}
+void ProportionStat::add(bool success) {
+	successes += success;
+	trials++;
+}
+void ProportionStat::add(long long s, long long t) {
+	successes += s;
+	trials += t;
+}
+double ProportionStat::value() const {
+	return (trials > 0) ? (double) successes / trials : 0;
+}
+pair<double, double> ProportionStat::wilson(double z) const {
+	if (trials == 0)
+		return make_pair(0.0, 1.0);
+	double n = trials;
+	double p = value();
+	double denominator = 1 + z*z/n;
+	double centre = (p + z*z/(2*n)) / denominator;
+	double spread = z * sqrt(p*(1-p)/n + z*z/(4*n*n)) / denominator;
+	return make_pair(max(0.0, centre - spread), min(1.0, centre + spread));
+}
+double ProportionStat::width(double z) const {
+	auto interval = wilson(z);
+	return interval.second - interval.first;
+}
+
+double zForConfidence(double confidence) {
+	// Acklam's rational approximation of the normal quantile at (1+c)/2
+	double p = (1 + confidence) / 2;
+	static const double a[] = {-3.969683028665376e+01, 2.209460984245205e+02, -2.759285104469687e+02,
+							   1.383577518672690e+02, -3.066479806614716e+01, 2.506628277459239e+00};
+	static const double b[] = {-5.447609879822406e+01, 1.615858368580409e+02, -1.556989798598866e+02,
+							   6.680131188771972e+01, -1.328068155288572e+01};
+	static const double c[] = {-7.784894002430293e-03, -3.223964580411365e-01, -2.400758277161838e+00,
+							   -2.549732539343734e+00, 4.374664141464968e+00, 2.938163982698783e+00};
+	static const double d[] = {7.784695709041462e-03, 3.224671290700398e-01, 2.445134137142996e+00,
+							   3.754408661907416e+00};
+	if (p > 0.97575) {
+		double q = sqrt(-2 * log(1 - p));
+		return -(((((c[0]*q+c[1])*q+c[2])*q+c[3])*q+c[4])*q+c[5]) / ((((d[0]*q+d[1])*q+d[2])*q+d[3])*q+1);
+	}
+	double q = p - 0.5, r = q*q;
+	return (((((a[0]*r+a[1])*r+a[2])*r+a[3])*r+a[4])*r+a[5])*q / (((((b[0]*r+b[1])*r+b[2])*r+b[3])*r+b[4])*r+1);
+}
+double binaryEntropy(double p) {
+	if (p <= 0 || p >= 1)
+		return 0;
+	return -p*log2(p) - (1-p)*log2(1-p);
+}
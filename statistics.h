@@ -0,0 +1,48 @@
+#ifndef _STATISTICS_H_
+#define _STATISTICS_H_
+
+#include <utility>
+
+using namespace std;
+
+// Welford's streaming mean/variance; merge() combines two partial streams
+// (Chan et al.) so per-block statistics can be folded together.
+class RunningStat {
+private:
+	long long n;
+	double m;
+	double m2;
+public:
+	RunningStat();
+	// Rebuilds a stream from its saved count(), mean() and squaredDeviations()
+	RunningStat(long long count, double mean, double squaredDeviations);
+	void add(double x);
+	void merge(const RunningStat& other);
+	long long count() const;
+	double mean() const;
+	double variance() const;
+	double squaredDeviations() const;
+	// Half width of the normal confidence interval on the mean
+	double halfWidth(double z) const;
+};
+
+// Count of successes out of trials, with a Wilson score interval, which
+// behaves at proportions near 0 and 1 (low QBER) where the normal one does not.
+class ProportionStat {
+public:
+	long long successes;
+	long long trials;
+	ProportionStat();
+	void add(bool success);
+	void add(long long s, long long t);
+	double value() const;
+	pair<double, double> wilson(double z) const;
+	double width(double z) const;
+};
+
+// z value for a two sided confidence level, e.g. 0.95 -> 1.96
+double zForConfidence(double confidence);
+// h(p) = -p log2 p - (1-p) log2 (1-p)
+double binaryEntropy(double p);
+
+#endif
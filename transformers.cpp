@@ -2,8 +2,11 @@
 #include <random>
 #include <complex>
 #include <string>
+#include <vector>
+#include <cmath>
 
 #include "transformers.h"
+#include "rng.h"
 
 using namespace std;
 
@@ -14,44 +17,91 @@ IdealStateDeviationTransformer::IdealStateDeviationTransformer() {
 state IdealStateDeviationTransformer::operator()(state s) {
 	return s;
 }
+bool IdealStateDeviationTransformer::isIdentity() {
+	return true;
+}
 
 UniformRadianStateDeviationTransformer::UniformRadianStateDeviationTransformer(double radians) {
-	gen = default_random_engine();
-	dist = uniform_real_distribution<double>(-radians, radians);
+	maxRadians = radians;
 	name = to_string(radians) + " radian Uniform Random State Deviation Transformer";
 }
 UniformRadianStateDeviationTransformer::UniformRadianStateDeviationTransformer() {
-	gen = default_random_engine();
 	cout << "Enter maximum radian deviation for uniform distribution(r), i.e. Uniform distribution from [-r,r]: ";
 	double radians;
 	cin >> radians;
-	dist = uniform_real_distribution<double>(-radians, radians);
+	maxRadians = radians;
 	name = to_string(radians) + " radian Uniform Random State Deviation Transformer";
 }
-state UniformRadianStateDeviationTransformer::operator()(state s) {
-	auto zero_amp = s.first;
-	auto one_amp = s.second;
-
-	double theta, phi;
-	complex<double> phaseDelta;
-	if (abs(zero_amp) == 0 || abs(one_amp) == 0) {
-		theta = (abs(zero_amp) == 0) ? 3.14159 : 0;
-		phi = 0;
-		phaseDelta = 1;
-	} else {
-		phaseDelta = zero_amp / abs(zero_amp);
-		phi = arg(one_amp) - arg(zero_amp);
-		theta = 2 * acos(abs(zero_amp));
-	}
 
+// Rotates s by dTheta and dPhi given as cos/sin(dTheta/2) and cos/sin(dPhi):
+//	alpha' = u (|alpha| cos(dTheta/2) - |beta| sin(dTheta/2))
+//	beta'  = v e^(i dPhi) (|beta| cos(dTheta/2) + |alpha| sin(dTheta/2))
+// u and v being the phases of alpha and beta (1 for a zero amplitude)
+static inline state rotate(state s, double cosHalfTheta, double sinHalfTheta, double cosPhi, double sinPhi) {
+	// Written out in real arithmetic: complex products would go through
+	// the library's NaN checking multiply
+	double zeroMagnitude = sqrt(norm(s.first)), oneMagnitude = sqrt(norm(s.second));
+	double zeroRe = 1, zeroIm = 0, oneRe = 1, oneIm = 0;
+	if (zeroMagnitude > 0 && oneMagnitude > 0) {
+		zeroRe = s.first.real() / zeroMagnitude;
+		zeroIm = s.first.imag() / zeroMagnitude;
+		oneRe = s.second.real() / oneMagnitude;
+		oneIm = s.second.imag() / oneMagnitude;
+	}
+	double zero = zeroMagnitude*cosHalfTheta - oneMagnitude*sinHalfTheta;
+	double one  = oneMagnitude*cosHalfTheta + zeroMagnitude*sinHalfTheta;
+	return make_pair(amplitude(zeroRe*zero, zeroIm*zero),
+					 amplitude((oneRe*cosPhi - oneIm*sinPhi)*one, (oneRe*sinPhi + oneIm*cosPhi)*one));
+}
 
-	double deviated_phi = phi + dist(gen);
-	double deviated_theta = theta + dist(gen);
+state UniformRadianStateDeviationTransformer::operator()(state s) {
+	double deviatedPhi = maxRadians * (2*rng().uniform() - 1);
+	double deviatedTheta = maxRadians * (2*rng().uniform() - 1);
+	return rotate(s, cos(deviatedTheta/2), sin(deviatedTheta/2), cos(deviatedPhi), sin(deviatedPhi));
+}
 
-	amplitude deviated_zero_amp = phaseDelta * cos(deviated_theta/2);
-	amplitude deviated_one_amp  = phaseDelta * exp(complex<double>(0,1) * deviated_phi) * sin(deviated_theta/2);
+// sin and cos of every x[i] (|x| up to about 1e6) without libm calls or
+// branches: reduce by multiples of pi/2 in two parts, then the Cephes
+// polynomials on [-pi/4, pi/4] and a quadrant swap, all plain arithmetic
+static void sincos(const double *x, double *sines, double *cosines, int count) {
+	const double twoOverPi = 0.63661977236758134308;
+	// Adding and subtracting 1.5 * 2^52 rounds to the nearest integer
+	const double roundingShift = 6755399441055744.0;
+	const double piOver2High = 1.57079632673412561417e+00;
+	const double piOver2Low = 6.07710050650619224932e-11;
+	for (int i = 0; i < count; ++i) {
+		double quadrant = (x[i]*twoOverPi + roundingShift) - roundingShift;
+		double y = (x[i] - quadrant*piOver2High) - quadrant*piOver2Low;
+		double z = y*y;
+		double s = y + y*z*((((((1.58962301576546568060e-10*z - 2.50507477628578072866e-8)*z
+								+ 2.75573136213857245213e-6)*z - 1.98412698295895385996e-4)*z
+								+ 8.33333333332211858878e-3)*z) - 1.66666666666666307295e-1);
+		double c = 1 - 0.5*z + z*z*(((((-1.13585365213876817300e-11*z + 2.08757008419747316778e-9)*z
+								- 2.75573141792967388112e-7)*z + 2.48015872888517045348e-5)*z
+								- 1.38888888888730564116e-3)*z + 4.16666666666665929218e-2);
+		long long q = (long long) quadrant;
+		bool swap = q & 1, negateSine = q & 2, negateCosine = (q+1) & 2;
+		double sine = swap ? c : s, cosine = swap ? s : c;
+		sines[i] = negateSine ? -sine : sine;
+		cosines[i] = negateCosine ? -cosine : cosine;
+	}
+}
 
-	return make_pair(deviated_zero_amp, deviated_one_amp);
+void UniformRadianStateDeviationTransformer::transform(state *states, int count) {
+	// Per thread so a transformer can be shared by the simulation threads
+	static thread_local vector<double> angles, sines, cosines;
+	angles.resize(2*count);
+	sines.resize(2*count);
+	cosines.resize(2*count);
+	// Same draws in the same order as operator(): phi, then theta
+	for (int i = 0; i < count; ++i) {
+		angles[2*i+1] = maxRadians * (2*rng().uniform() - 1);
+		angles[2*i] = maxRadians * (2*rng().uniform() - 1) / 2;
+	}
+	sincos(angles.data(), sines.data(), cosines.data(), 2*count);
+	for (int i = 0; i < count; ++i) {
+		states[i] = rotate(states[i], cosines[2*i], sines[2*i], cosines[2*i+1], sines[2*i+1]);
+	}
 }
 
 StateTransformer* chooseStateDeviationTransformer() {
@@ -86,16 +136,155 @@ StateTransformer* chooseStateDeviationTransformer() {
 }
 
 
+CompiledBasis::CompiledBasis(const basis& b) {
+	oneRe[0] = b.second.first.real();
+	oneIm[0] = b.second.first.imag();
+	oneRe[1] = b.second.second.real();
+	oneIm[1] = b.second.second.imag();
+}
+basis CompiledBasis::measured() const {
+	state one = make_pair(amplitude(oneRe[0], oneIm[0]), amplitude(oneRe[1], oneIm[1]));
+	state zero = make_pair(amplitude(-oneRe[1], oneIm[1]), amplitude(oneRe[0], -oneIm[0]));
+	return make_pair(zero, one);
+}
+
+void BasisTransformer::compile(const vector<basis>& bases, const char *choices, long long firstSlot, int count,
+							   CompiledBasis *compiled) {
+	for (int i = 0; i < count; ++i)
+		compiled[i] = CompiledBasis(operator()(bases[choices[i]]));
+}
+
 IdealBasisDeviationTransformer::IdealBasisDeviationTransformer() {
 	name = "Ideal Basis Deviation Transformer";
 }
 basis IdealBasisDeviationTransformer::operator()(basis b){
 	return b;
 }
+bool IdealBasisDeviationTransformer::isIdentity() {
+	return true;
+}
+
+// v -> cos v + sin Y v with Y = [[0,-1],[1,0]], on the parts of CompiledBasis
+static inline CompiledBasis misalign(const CompiledBasis& b, double cosine, double sine) {
+	CompiledBasis rotated;
+	rotated.oneRe[0] = cosine*b.oneRe[0] - sine*b.oneRe[1];
+	rotated.oneIm[0] = cosine*b.oneIm[0] - sine*b.oneIm[1];
+	rotated.oneRe[1] = sine*b.oneRe[0] + cosine*b.oneRe[1];
+	rotated.oneIm[1] = sine*b.oneIm[0] + cosine*b.oneIm[1];
+	return rotated;
+}
+
+basis MisalignmentBasisTransformer::operator()(basis b) {
+	double radians;
+	angles(0, 1, &radians);
+	double c = cos(radians), s = sin(radians);
+	state zero = make_pair(c*b.first.first - s*b.first.second, s*b.first.first + c*b.first.second);
+	state one = make_pair(c*b.second.first - s*b.second.second, s*b.second.first + c*b.second.second);
+	return make_pair(zero, one);
+}
+void MisalignmentBasisTransformer::compile(const vector<basis>& bases, const char *choices, long long firstSlot,
+										   int count, CompiledBasis *compiled) {
+	static thread_local vector<double> radians, sines, cosines;
+	radians.resize(count);
+	sines.resize(count);
+	cosines.resize(count);
+	angles(firstSlot, count, radians.data());
+	sincos(radians.data(), sines.data(), cosines.data(), count);
+	static thread_local vector<CompiledBasis> ideal;
+	ideal.assign(bases.begin(), bases.end());
+	for (int i = 0; i < count; ++i)
+		compiled[i] = misalign(ideal[(int) choices[i]], cosines[i], sines[i]);
+}
+
+FixedMisalignmentBasisTransformer::FixedMisalignmentBasisTransformer(double _offset) {
+	offset = _offset;
+	name = to_string(offset) + " radian Fixed Misalignment Basis Transformer";
+}
+FixedMisalignmentBasisTransformer::FixedMisalignmentBasisTransformer() {
+	cout << "Enter detector misalignment in radians: ";
+	cin >> offset;
+	name = to_string(offset) + " radian Fixed Misalignment Basis Transformer";
+}
+void FixedMisalignmentBasisTransformer::angles(long long firstSlot, int count, double *radians) {
+	for (int i = 0; i < count; ++i)
+		radians[i] = offset;
+}
+void FixedMisalignmentBasisTransformer::compile(const vector<basis>& bases, const char *choices, long long firstSlot,
+												int count, CompiledBasis *compiled) {
+	static thread_local vector<CompiledBasis> rotated;
+	rotated.resize(bases.size());
+	for (size_t b = 0; b < bases.size(); ++b)
+		rotated[b] = misalign(CompiledBasis(bases[b]), cos(offset), sin(offset));
+	for (int i = 0; i < count; ++i)
+		compiled[i] = rotated[(int) choices[i]];
+}
+
+GaussianMisalignmentBasisTransformer::GaussianMisalignmentBasisTransformer(double _sigma) {
+	sigma = _sigma;
+	name = to_string(sigma) + " radian Gaussian Misalignment Basis Transformer";
+}
+GaussianMisalignmentBasisTransformer::GaussianMisalignmentBasisTransformer() {
+	cout << "Enter standard deviation of detector misalignment in radians: ";
+	cin >> sigma;
+	name = to_string(sigma) + " radian Gaussian Misalignment Basis Transformer";
+}
+// Box-Muller: a pair of uniforms gives the radius sigma*sqrt(-2 ln u) and
+// an angle 2 pi v whose cosine and sine are two independent normals
+void GaussianMisalignmentBasisTransformer::angles(long long firstSlot, int count, double *radians) {
+	static thread_local vector<double> turns, sines, cosines, radii;
+	int pairs = (count + 1) / 2;
+	turns.resize(pairs);
+	sines.resize(pairs);
+	cosines.resize(pairs);
+	radii.resize(pairs);
+	for (int p = 0; p < pairs; ++p) {
+		radii[p] = sigma * sqrt(-2 * log(1 - rng().uniform()));
+		turns[p] = 2*M_PI * rng().uniform();
+	}
+	sincos(turns.data(), sines.data(), cosines.data(), pairs);
+	for (int i = 0; i < count; ++i)
+		radians[i] = radii[i/2] * ((i & 1) ? sines[i/2] : cosines[i/2]);
+}
+
+DriftMisalignmentBasisTransformer::DriftMisalignmentBasisTransformer(double _peak, double _period) {
+	peak = _peak;
+	period = _period;
+	if (period <= 0) {
+		cout << "Misalignment drift period must be positive" << endl;
+		throw -1;
+	}
+	name = to_string(peak) + " radian Drift Misalignment Basis Transformer";
+}
+DriftMisalignmentBasisTransformer::DriftMisalignmentBasisTransformer() {
+	cout << "Enter peak detector misalignment in radians: ";
+	cin >> peak;
+	cout << "Enter period of the drift in pulses: ";
+	cin >> period;
+	if (period <= 0) {
+		cout << "Misalignment drift period must be positive" << endl;
+		throw -1;
+	}
+	name = to_string(peak) + " radian Drift Misalignment Basis Transformer";
+}
+void DriftMisalignmentBasisTransformer::angles(long long firstSlot, int count, double *radians) {
+	static thread_local vector<double> phases, cosines;
+	phases.resize(count);
+	cosines.resize(count);
+	// The block's phase is reduced once so the batch stays in sincos' range
+	double start = 2*M_PI * fmod((double) firstSlot, period) / period, step = 2*M_PI / period;
+	for (int i = 0; i < count; ++i)
+		phases[i] = start + i*step;
+	sincos(phases.data(), radians, cosines.data(), count);
+	for (int i = 0; i < count; ++i)
+		radians[i] *= peak;
+}
 
 BasisTransformer* chooseBasisDeviationTransformer() {
 	BasisTransformer* chosenTransformer;
-	vector<string> transformers {"Ideal Basis Deviation Transformer, able to measure qubit in basis with exact precision"};
+	vector<string> transformers {"Ideal Basis Deviation Transformer, able to measure qubit in basis with exact precision",
+							  "Fixed Misalignment Basis Transformer, measures in bases rotated by a constant angle",
+							  "Gaussian Misalignment Basis Transformer, measures in bases rotated by normally distributed angles",
+							  "Drift Misalignment Basis Transformer, measures in bases rotated by a slowly oscillating angle"};
 
 	int index = 1;
 	for (auto name: transformers) {
@@ -110,6 +299,18 @@ BasisTransformer* chooseBasisDeviationTransformer() {
 			chosenTransformer = new IdealBasisDeviationTransformer();
 			break;
 		}
+		case 2: {
+			chosenTransformer = new FixedMisalignmentBasisTransformer();
+			break;
+		}
+		case 3: {
+			chosenTransformer = new GaussianMisalignmentBasisTransformer();
+			break;
+		}
+		case 4: {
+			chosenTransformer = new DriftMisalignmentBasisTransformer();
+			break;
+		}
 		default:{
 			cout << "Out of Index Basis Deviation Transformer choice" << endl;
 			throw -1;
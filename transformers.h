@@ -3,6 +3,7 @@
 
 #include <random>
 #include <complex>
+#include <vector>
 
 #include "constants.h"
 
@@ -12,12 +13,47 @@ class StateTransformer{
 public:
 	string name;
 	virtual state operator()(state){};
+	// Transforms count states in place, drawing the same distribution as
+	// operator() on each; batched transformers override it
+	virtual void transform(state *states, int count) {
+		for (int i = 0; i < count; ++i)
+			states[i] = operator()(states[i]);
+	};
+	// True when every state comes back unchanged, so identical photons
+	// stay identical and can be kept as one group
+	virtual bool isIdentity() { return false; };
+};
+
+// A measurement basis reduced to what the detector needs: the real and
+// imaginary parts of its outcome 1 vector, so that for an orthonormal
+// basis P(1) = |<one|psi>|^2 takes a few real multiplications
+struct CompiledBasis {
+	double oneRe[2];
+	double oneIm[2];
+
+	CompiledBasis() {};
+	CompiledBasis(const basis& b);
+	inline double oneProbability(amplitude alpha, amplitude beta) const {
+		double re = oneRe[0]*alpha.real() + oneIm[0]*alpha.imag() + oneRe[1]*beta.real() + oneIm[1]*beta.imag();
+		double im = oneRe[0]*alpha.imag() - oneIm[0]*alpha.real() + oneRe[1]*beta.imag() - oneIm[1]*beta.real();
+		return re*re + im*im;
+	}
+	// The basis itself, outcome 0 being the orthogonal vector (up to phase)
+	basis measured() const;
 };
 
 class BasisTransformer{
 public:
 	string name;
 	virtual basis operator()(basis){};
+	// Compiles the bases measured in count consecutive slots from firstSlot,
+	// the one chosen in slot firstSlot+i being bases[choices[i]]. Uses
+	// operator() on each by default; misalignment transformers generate the
+	// whole block at once.
+	virtual void compile(const vector<basis>& bases, const char *choices, long long firstSlot, int count,
+						 CompiledBasis *compiled);
+	// True when every basis comes back unchanged
+	virtual bool isIdentity() { return false; };
 };
 
 
@@ -25,15 +61,21 @@ class IdealStateDeviationTransformer : public StateTransformer {
 public:
 	IdealStateDeviationTransformer();
 	state operator()(state s) override;
+	bool isIdentity() override;
 };
+// Adds uniform [-r,r] deviations to both Bloch sphere angles. With
+// cos(theta/2) = |alpha| and sin(theta/2) = |beta| the angle addition
+// formulas rotate the amplitudes directly, so no angles are recovered;
+// transform() draws a whole batch of deviations and evaluates their
+// sines and cosines with a branch free polynomial the compiler vectorizes.
 class UniformRadianStateDeviationTransformer : public StateTransformer {
 private:
-	default_random_engine gen;
-	uniform_real_distribution<double> dist;
+	double maxRadians;
 public:
 	UniformRadianStateDeviationTransformer();
 	UniformRadianStateDeviationTransformer(double radians);
 	state operator()(state s) override;
+	void transform(state *states, int count) override;
 };
 StateTransformer* chooseStateDeviationTransformer();
 
@@ -42,6 +84,57 @@ class IdealBasisDeviationTransformer : public BasisTransformer {
 public:
 	IdealBasisDeviationTransformer();
 	basis operator()(basis b) override;
+	bool isIdentity() override;
+};
+// Detector misalignment: the basis measured is the chosen one rotated by
+// an angle in the polarization plane, i.e. linear polarizations turned by
+// the angle (|v> -> cos|v> + sin Y|v> on amplitudes), which gives an error
+// rate of sin^2 in Z and X. Subclasses give the angles of a block of slots
+// and compile() rotates the outcome 1 vectors with sines and cosines
+// evaluated in one batch. operator() measures as in slot 0.
+class MisalignmentBasisTransformer : public BasisTransformer {
+protected:
+	virtual void angles(long long firstSlot, int count, double *radians) = 0;
+public:
+	basis operator()(basis b) override;
+	void compile(const vector<basis>& bases, const char *choices, long long firstSlot, int count,
+				 CompiledBasis *compiled) override;
+};
+// The same angle in every slot; the protocol's few bases are rotated once
+// per block and copied
+class FixedMisalignmentBasisTransformer : public MisalignmentBasisTransformer {
+private:
+	double offset;
+protected:
+	void angles(long long firstSlot, int count, double *radians) override;
+public:
+	FixedMisalignmentBasisTransformer();
+	FixedMisalignmentBasisTransformer(double _offset);
+	void compile(const vector<basis>& bases, const char *choices, long long firstSlot, int count,
+				 CompiledBasis *compiled) override;
+};
+// Independent normally distributed angles, e.g. jitter of the polarization
+// controller
+class GaussianMisalignmentBasisTransformer : public MisalignmentBasisTransformer {
+private:
+	double sigma;
+protected:
+	void angles(long long firstSlot, int count, double *radians) override;
+public:
+	GaussianMisalignmentBasisTransformer();
+	GaussianMisalignmentBasisTransformer(double _sigma);
+};
+// Slow drift peak*sin(2 pi slot/period), a function of the slot only
+// so that results do not depend on how blocks are scheduled
+class DriftMisalignmentBasisTransformer : public MisalignmentBasisTransformer {
+private:
+	double peak;
+	double period;
+protected:
+	void angles(long long firstSlot, int count, double *radians) override;
+public:
+	DriftMisalignmentBasisTransformer();
+	DriftMisalignmentBasisTransformer(double _peak, double _period);
 };
 BasisTransformer* chooseBasisDeviationTransformer();
 
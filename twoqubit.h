@@ -0,0 +1,64 @@
+#ifndef _TWOQUBIT_H_
+#define _TWOQUBIT_H_
+
+#include <complex>
+
+#include "constants.h"
+
+using namespace std;
+
+// Fixed size kernels on two-qubit states. They are inline with constant
+// trip counts, so each call site compiles to straight-line 4x4 complex
+// arithmetic with nothing on the heap.
+
+// Row major 2x2 operator op applied to qubit Half (0 Alice, 1 Bob)
+template<int Half>
+inline pairState applyLocal(const amplitude op[4], const pairState& psi) {
+	// |q0 q1> is at index 2*q0 + q1
+	const int stride = (Half == 0) ? 2 : 1;
+	pairState out;
+	for (int other = 0; other < 2; ++other) {
+		int base = (Half == 0) ? other : 2*other;
+		out[base]        = op[0]*psi[base] + op[1]*psi[base+stride];
+		out[base+stride] = op[2]*psi[base] + op[3]*psi[base+stride];
+	}
+	return out;
+}
+
+// Product basis of a joint measurement: row 2*a + b is <a| (x) <b| for
+// Alice's outcome a and Bob's outcome b
+struct JointBasis {
+	amplitude m[16];
+
+	JointBasis() {}
+	JointBasis(const basis& alice, const basis& bob) {
+		const state aliceStates[2] = {alice.first, alice.second};
+		const state bobStates[2] = {bob.first, bob.second};
+		for (int a = 0; a < 2; ++a)
+		for (int b = 0; b < 2; ++b) {
+			amplitude *row = m + (2*a + b)*4;
+			row[0] = conj(aliceStates[a].first  * bobStates[b].first);
+			row[1] = conj(aliceStates[a].first  * bobStates[b].second);
+			row[2] = conj(aliceStates[a].second * bobStates[b].first);
+			row[3] = conj(aliceStates[a].second * bobStates[b].second);
+		}
+	}
+};
+
+// Probability of every joint outcome, indexed like the basis rows
+inline void jointProbabilities(const JointBasis& joint, const pairState& psi, double p[4]) {
+	for (int r = 0; r < 4; ++r) {
+		const amplitude *row = joint.m + r*4;
+		p[r] = norm(row[0]*psi[0] + row[1]*psi[1] + row[2]*psi[2] + row[3]*psi[3]);
+	}
+}
+
+// Index drawn from unnormalized probabilities p with uniform u in [0,1)
+inline int sampleOutcome(const double p[4], double u) {
+	double target = u * (p[0] + p[1] + p[2] + p[3]);
+	int r = 0;
+	for (double cumulative = p[0]; r < 3 && target >= cumulative; cumulative += p[++r]);
+	return r;
+}
+
+#endif